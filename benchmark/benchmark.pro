@@ -0,0 +1,21 @@
+TEMPLATE = app
+TARGET = tales-benchmark
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+QT += gui network quick
+
+INCLUDEPATH += ../src
+
+# The benchmark links against the Mana plugin library, which src/src.pro
+# places in one of the following directories
+win*|linux*:!tizen:!android:MANA_LIB_DIR = $$OUT_PWD/../lib/libmana/qml/Mana
+else:macx:MANA_LIB_DIR = $$OUT_PWD/../example/tales.app/Contents/Resources/qml/Mana
+else:MANA_LIB_DIR = $$OUT_PWD/../src/qml/Mana
+
+LIBS += -L$$MANA_LIB_DIR -lmana
+unix:QMAKE_RPATHDIR += $$MANA_LIB_DIR
+
+win*|linux*:!tizen:!android:DESTDIR = ../bin/
+
+SOURCES += main.cpp
@@ -0,0 +1,618 @@
+/*
+ * Mana Mobile
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A headless benchmark for the map rendering. It loads a TMX map from disk,
+ * displays it with a MapItem and moves the camera along a number of scripted
+ * paths, rendering each frame offscreen through QQuickRenderControl.
+ *
+ * Without a display or GPU, run it with QT_QPA_PLATFORM=offscreen (the
+ * default) on top of a software OpenGL implementation like Mesa's llvmpipe.
+ *
+ * With --vertices, it instead compares the SIMD and scalar vertex generation
+ * used by TilesNode, which needs no map or OpenGL.
+ *
+ * With --decode, it instead compares how fast the map is read with its tile
+ * layer data stored in each of the supported layer data formats.
+ */
+
+#include "mana/mapitem.h"
+#include "mana/renderstatistics.h"
+#include "mana/resourcemanager.h"
+#include "mana/textureuploadqueue.h"
+#include "mana/tilesnode.h"
+#include "mana/resource/mapresource.h"
+
+#include "tiled/compression.h"
+#include "tiled/map.h"
+#include "tiled/mapreader.h"
+#include "tiled/mapwriter.h"
+#include "tiled/tilelayer.h"
+#include "tiled/tileset.h"
+
+#include <QAtomicInt>
+#include <QBuffer>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QGuiApplication>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QQuickItem>
+#include <QQuickRenderControl>
+#include <QQuickWindow>
+#include <QTextStream>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+
+/*
+ * Count all heap allocations, including the ones made by libmana and Qt, so
+ * that the allocations per frame can be reported.
+ */
+static QAtomicInt allocations;
+
+void *operator new(std::size_t size)
+{
+    allocations.fetchAndAddRelaxed(1);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+/**
+ * The position and zoom of the camera.
+ */
+struct Camera
+{
+    QPointF center;
+    qreal scale;
+};
+
+/**
+ * A scripted camera path, returning the camera for a given progress \a t
+ * between 0 and 1 over a map of the given \a size.
+ */
+typedef Camera (*CameraPath)(qreal t, const QSizeF &size);
+
+static Camera panPath(qreal t, const QSizeF &size)
+{
+    Camera camera = { QPointF(size.width() * t, size.height() * t), 1 };
+    return camera;
+}
+
+static Camera circlePath(qreal t, const QSizeF &size)
+{
+    const qreal angle = t * 2 * M_PI;
+    const QPointF center(size.width() / 2, size.height() / 2);
+    const qreal radius = qMin(size.width(), size.height()) / 3;
+
+    Camera camera = { center + QPointF(std::cos(angle), std::sin(angle)) * radius, 1 };
+    return camera;
+}
+
+static Camera zoomPath(qreal t, const QSizeF &size)
+{
+    // Zoom out to a quarter of the size and back in
+    const qreal zoom = 1 - 0.75 * std::sin(t * M_PI);
+
+    Camera camera = { QPointF(size.width() / 2, size.height() / 2), zoom };
+    return camera;
+}
+
+struct PathInfo
+{
+    const char *name;
+    CameraPath path;
+};
+
+static const PathInfo PATHS[] = {
+    { "pan", panPath },
+    { "circle", circlePath },
+    { "zoom", zoomPath },
+};
+
+struct FrameResult
+{
+    qint64 syncTime;        // in microseconds
+    qint64 renderTime;      // in microseconds
+    int updateTime;         // in microseconds
+    int vertices;
+    int nodesCreated;
+    int nodesDestroyed;
+    int chunksBuilt;
+    int texturesUploaded;
+    int uploadLatency;      // in milliseconds
+    int allocations;
+};
+
+/**
+ * Renders a scene offscreen and measures each frame.
+ */
+class Renderer
+{
+public:
+    Renderer(const QSize &size);
+    ~Renderer();
+
+    bool isValid() const { return mFbo != 0; }
+    QQuickItem *contentItem() const { return mWindow->contentItem(); }
+
+    FrameResult renderFrame();
+
+private:
+    QOpenGLContext mContext;
+    QOffscreenSurface mSurface;
+    QQuickRenderControl mRenderControl;
+    QQuickWindow *mWindow;
+    QOpenGLFramebufferObject *mFbo;
+};
+
+Renderer::Renderer(const QSize &size)
+    : mWindow(new QQuickWindow(&mRenderControl))
+    , mFbo(0)
+{
+    QSurfaceFormat format;
+    format.setDepthBufferSize(16);
+    format.setStencilBufferSize(8);
+
+    mContext.setFormat(format);
+    if (!mContext.create())
+        return;
+
+    mSurface.setFormat(mContext.format());
+    mSurface.create();
+
+    if (!mContext.makeCurrent(&mSurface))
+        return;
+
+    mRenderControl.initialize(&mContext);
+
+    mFbo = new QOpenGLFramebufferObject(
+                size, QOpenGLFramebufferObject::CombinedDepthStencil);
+
+    mWindow->setRenderTarget(mFbo);
+    mWindow->setGeometry(0, 0, size.width(), size.height());
+    mWindow->contentItem()->setSize(size);
+}
+
+Renderer::~Renderer()
+{
+    mContext.makeCurrent(&mSurface);
+    delete mWindow;
+    delete mFbo;
+    mContext.doneCurrent();
+}
+
+FrameResult Renderer::renderFrame()
+{
+    FrameResult result;
+    const int allocationsBefore = allocations.load();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    mRenderControl.polishItems();
+    mRenderControl.sync();
+    result.syncTime = timer.nsecsElapsed() / 1000;
+
+    timer.restart();
+    mRenderControl.render();
+    mContext.functions()->glFinish();
+    result.renderTime = timer.nsecsElapsed() / 1000;
+
+    result.allocations = allocations.load() - allocationsBefore;
+
+    // Delivers the statistics of this frame
+    QCoreApplication::processEvents();
+
+    const Mana::RenderStatistics *stats = Mana::RenderStatistics::instance();
+    result.updateTime = stats->updateTime();
+    result.vertices = stats->vertices();
+    result.nodesCreated = stats->nodesCreated();
+    result.nodesDestroyed = stats->nodesDestroyed();
+    result.chunksBuilt = stats->chunksBuilt();
+    result.texturesUploaded = stats->texturesUploaded();
+    result.uploadLatency = stats->uploadLatency();
+
+    return result;
+}
+
+static qint64 percentile(QVector<qint64> values, qreal p)
+{
+    if (values.isEmpty())
+        return 0;
+
+    std::sort(values.begin(), values.end());
+    const int index = qMin(values.size() - 1, int(values.size() * p));
+    return values.at(index);
+}
+
+static void report(QTextStream &out, const char *name,
+                   const QVector<FrameResult> &frames)
+{
+    QVector<qint64> syncTimes;
+    QVector<qint64> renderTimes;
+    qint64 updateTime = 0;
+    qint64 vertices = 0;
+    qint64 allocationCount = 0;
+    int nodesCreated = 0;
+    int nodesDestroyed = 0;
+    int chunksBuilt = 0;
+    int texturesUploaded = 0;
+    int uploadLatency = 0;
+
+    foreach (const FrameResult &frame, frames) {
+        syncTimes.append(frame.syncTime);
+        renderTimes.append(frame.renderTime);
+        updateTime += frame.updateTime;
+        vertices += frame.vertices;
+        allocationCount += frame.allocations;
+        nodesCreated += frame.nodesCreated;
+        nodesDestroyed += frame.nodesDestroyed;
+        chunksBuilt += frame.chunksBuilt;
+        texturesUploaded += frame.texturesUploaded;
+        uploadLatency = qMax(uploadLatency, frame.uploadLatency);
+    }
+
+    const int count = qMax(1, frames.size());
+
+    out << name << ":\n"
+        << "  frames:                  " << frames.size() << "\n"
+        << "  sync time (us):          median " << percentile(syncTimes, 0.5)
+        << ", p95 " << percentile(syncTimes, 0.95)
+        << ", max " << percentile(syncTimes, 1) << "\n"
+        << "  render time (us):        median " << percentile(renderTimes, 0.5)
+        << ", p95 " << percentile(renderTimes, 0.95) << "\n"
+        << "  updatePaintNode (us):    " << updateTime / count << " per frame\n"
+        << "  vertices generated:      " << vertices / count << " per frame\n"
+        << "  chunks built:            " << chunksBuilt << "\n"
+        << "  textures uploaded:       " << texturesUploaded
+        << ", max latency " << uploadLatency << " ms\n"
+        << "  nodes created/destroyed: " << nodesCreated << " / " << nodesDestroyed << "\n"
+        << "  live nodes:              " << Mana::RenderStatistics::instance()->liveNodes() << "\n"
+        << "  allocations:             " << allocationCount / count << " per frame\n";
+    out.flush();
+}
+
+typedef void (*VertexGenerator)(QSGGeometry::TexturedPoint2D *,
+                                const Mana::TileData *, int,
+                                const QRectF &, float, float);
+
+/**
+ * Returns the average time in nanoseconds per tile taken by the given vertex
+ * \a generator.
+ */
+static double timeVertexGeneration(VertexGenerator generator,
+                                   QVector<QSGGeometry::TexturedPoint2D> &vertices,
+                                   const QVector<Mana::TileData> &tiles,
+                                   int iterations)
+{
+    const QRectF subRect(0.25, 0.5, 0.5, 0.25);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    for (int i = 0; i < iterations; ++i) {
+        generator(vertices.data(), tiles.constData(), tiles.size(),
+                  subRect, 1.f / 1024, 1.f / 2048);
+    }
+
+    return double(timer.nsecsElapsed()) / iterations / tiles.size();
+}
+
+/**
+ * Compares the SIMD vertex generation of TilesNode against the scalar
+ * version, using a full node worth of tiles.
+ */
+static int runVertexBenchmark(QTextStream &out, int iterations)
+{
+    QVector<Mana::TileData> tiles(Mana::TilesNode::MAX_TILES);
+    for (int i = 0; i < tiles.size(); ++i) {
+        Mana::TileData &tile = tiles[i];
+        tile.x = (i % 128) * 32;
+        tile.y = (i / 128) * 32;
+        tile.width = 32;
+        tile.height = 32 + (i % 3) * 16;
+        tile.tx = (i % 16) * 32;
+        tile.ty = (i % 7) * 32;
+    }
+
+    QVector<QSGGeometry::TexturedPoint2D> scalar(tiles.size() * 4);
+    QVector<QSGGeometry::TexturedPoint2D> simd(tiles.size() * 4);
+
+    // Warm up and check that both versions give the same result
+    timeVertexGeneration(Mana::generateTileVerticesScalar, scalar, tiles, 1);
+    timeVertexGeneration(Mana::generateTileVertices, simd, tiles, 1);
+
+    for (int i = 0; i < scalar.size(); ++i) {
+        const QSGGeometry::TexturedPoint2D &a = scalar.at(i);
+        const QSGGeometry::TexturedPoint2D &b = simd.at(i);
+        if (!qFuzzyCompare(a.x + 1, b.x + 1) || !qFuzzyCompare(a.y + 1, b.y + 1) ||
+                !qFuzzyCompare(a.tx + 1, b.tx + 1) || !qFuzzyCompare(a.ty + 1, b.ty + 1)) {
+            qWarning() << "Vertex" << i << "differs between scalar and SIMD version";
+            return 1;
+        }
+    }
+
+    const double scalarTime = timeVertexGeneration(Mana::generateTileVerticesScalar,
+                                                   scalar, tiles, iterations);
+    const double simdTime = timeVertexGeneration(Mana::generateTileVertices,
+                                                 simd, tiles, iterations);
+
+    out << "vertex generation (" << tiles.size() << " tiles, "
+        << iterations << " iterations):\n"
+        << "  scalar:  " << scalarTime << " ns per tile\n"
+        << "  simd:    " << simdTime << " ns per tile\n"
+        << "  speedup: " << scalarTime / simdTime << "x\n";
+    out.flush();
+
+    return 0;
+}
+
+struct LayerDataFormatInfo
+{
+    const char *name;
+    Tiled::Map::LayerDataFormat format;
+    Tiled::CompressionMethod method;
+};
+
+static const LayerDataFormatInfo LAYER_DATA_FORMATS[] = {
+    { "csv", Tiled::Map::CSV, Tiled::Zlib },
+    { "base64", Tiled::Map::Base64, Tiled::Zlib },
+    { "zlib", Tiled::Map::Base64Zlib, Tiled::Zlib },
+    { "gzip", Tiled::Map::Base64Gzip, Tiled::Gzip },
+    { "zstd", Tiled::Map::Base64Zstandard, Tiled::Zstandard },
+    { "lz4", Tiled::Map::Base64LZ4, Tiled::LZ4 },
+};
+
+static void deleteMap(Tiled::Map *map)
+{
+    // The map does not own its tilesets
+    qDeleteAll(map->tilesets());
+    delete map;
+}
+
+/**
+ * Writes the map in each layer data format and measures how long it takes
+ * to read it back, which is mostly spent decoding the tile layers.
+ */
+static int runDecodeBenchmark(QTextStream &out, const QFileInfo &mapFile,
+                              int iterations)
+{
+    const QString path = mapFile.absolutePath();
+
+    Tiled::MapReader reader;
+    reader.setLazy(true);
+
+    Tiled::Map *map = reader.readMap(mapFile.absoluteFilePath());
+    if (!map) {
+        qWarning() << "Failed to load map:" << reader.errorString();
+        return 1;
+    }
+
+    qint64 cellBytes = 0;
+    foreach (const Tiled::TileLayer *layer, map->tileLayers())
+        cellBytes += qint64(layer->width()) * layer->height() * 4;
+
+    out << "layer decoding (" << mapFile.fileName() << ", "
+        << cellBytes / 1024 << " KiB of tile data, "
+        << iterations << " iterations):\n";
+
+    for (const LayerDataFormatInfo &info : LAYER_DATA_FORMATS) {
+        if (!Tiled::compressionSupported(info.method)) {
+            out << "  " << info.name << ": not supported by this build\n";
+            continue;
+        }
+
+        QBuffer buffer;
+        buffer.open(QIODevice::WriteOnly);
+
+        Tiled::MapWriter writer;
+        writer.setLayerDataFormat(info.format);
+        writer.writeMap(map, &buffer, path);
+        const QByteArray data = buffer.data();
+
+        QElapsedTimer timer;
+        timer.start();
+
+        for (int i = 0; i < iterations; ++i) {
+            QBuffer input;
+            input.setData(data);
+            input.open(QIODevice::ReadOnly);
+
+            Tiled::MapReader decodeReader;
+            decodeReader.setLazy(true);
+
+            Tiled::Map *decoded = decodeReader.readMap(&input, path);
+            if (!decoded) {
+                qWarning() << "Failed to read map as" << info.name << ":"
+                           << decodeReader.errorString();
+                deleteMap(map);
+                return 1;
+            }
+            deleteMap(decoded);
+        }
+
+        const double msPerRead = double(timer.nsecsElapsed()) / iterations / 1000000;
+
+        out << "  " << info.name << ":\t" << data.size() / 1024 << " KiB, "
+            << msPerRead << " ms per read, "
+            << cellBytes / 1024.0 / 1024.0 / (msPerRead / 1000) << " MiB/s\n";
+        out.flush();
+    }
+
+    deleteMap(map);
+    return 0;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication app(argc, argv);
+    app.setApplicationName("tales-benchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+                QGuiApplication::tr("Map rendering benchmark"));
+    parser.addHelpOption();
+    parser.addPositionalArgument("map", QGuiApplication::tr("The TMX file to load"));
+    parser.addOptions({
+        { "frames", QGuiApplication::tr("Render <count> frames per camera path"),
+          QGuiApplication::tr("count"), "300" },
+        { "size", QGuiApplication::tr("The viewport <size>"),
+          QGuiApplication::tr("size"), "1280x720" },
+        { "path", QGuiApplication::tr("Only run the camera <path> (pan, circle or zoom)"),
+          QGuiApplication::tr("path") },
+        { "lod-threshold", QGuiApplication::tr("The <scale> below which chunks are drawn from downscaled images, 0 to disable"),
+          QGuiApplication::tr("scale"), "0.5" },
+        { "vertices", QGuiApplication::tr("Benchmark the vertex generation over <count> iterations instead"),
+          QGuiApplication::tr("count") },
+        { "decode", QGuiApplication::tr("Benchmark reading the map in each layer data format over <count> iterations instead"),
+          QGuiApplication::tr("count") },
+    });
+    parser.process(app);
+
+    if (parser.isSet("vertices")) {
+        QTextStream out(stdout);
+        return runVertexBenchmark(out, qMax(1, parser.value("vertices").toInt()));
+    }
+
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    const QFileInfo mapFile(parser.positionalArguments().first());
+    const int frameCount = qMax(1, parser.value("frames").toInt());
+    const QStringList sizeParts = parser.value("size").split(QLatin1Char('x'));
+    const QSize viewportSize(sizeParts.value(0).toInt(), sizeParts.value(1).toInt());
+
+    if (!mapFile.exists()) {
+        qWarning() << "Map file not found:" << mapFile.filePath();
+        return 1;
+    }
+
+    if (parser.isSet("decode")) {
+        QTextStream out(stdout);
+        return runDecodeBenchmark(out, mapFile, qMax(1, parser.value("decode").toInt()));
+    }
+
+    if (viewportSize.isEmpty()) {
+        qWarning() << "Invalid viewport size:" << parser.value("size");
+        return 1;
+    }
+
+    // Resources referenced by the map are resolved relative to its directory
+    Mana::ResourceManager resourceManager;
+    resourceManager.setDataUrl(QUrl::fromLocalFile(mapFile.absolutePath() + QLatin1Char('/')).toString());
+
+    Mana::RenderStatistics statistics;
+    statistics.setEnabled(true);
+
+    Mana::TextureUploadQueue uploadQueue;
+
+    Renderer renderer(viewportSize);
+    if (!renderer.isValid()) {
+        qWarning() << "Failed to create an OpenGL context";
+        return 1;
+    }
+
+    Mana::MapResource *mapResource =
+            new Mana::MapResource(QUrl::fromLocalFile(mapFile.absoluteFilePath()),
+                                  mapFile.fileName(), &resourceManager);
+
+    QElapsedTimer loadTimer;
+    loadTimer.start();
+    while (mapResource->status() == Mana::Resource::Loading)
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 100);
+
+    if (mapResource->status() != Mana::Resource::Ready) {
+        qWarning() << "Failed to load map:" << mapFile.filePath();
+        return 1;
+    }
+
+    QTextStream out(stdout);
+    const Tiled::Map *map = mapResource->map();
+    out << mapFile.fileName() << ": " << map->width() << "x" << map->height()
+        << " tiles, " << map->layerCount() << " layers, loaded in "
+        << loadTimer.elapsed() << " ms\n\n";
+
+    // The camera item applies the scale and position, like the Viewport
+    QQuickItem *camera = new QQuickItem(renderer.contentItem());
+    camera->setTransformOrigin(QQuickItem::TopLeft);
+
+    Mana::MapItem *mapItem = new Mana::MapItem(camera);
+    mapItem->setMergeLayers(true);
+    mapItem->setLodThreshold(parser.value("lod-threshold").toDouble());
+    mapItem->setMapResource(mapResource);
+
+    const QSizeF mapSize(mapItem->implicitWidth(), mapItem->implicitHeight());
+
+    for (const PathInfo &info : PATHS) {
+        if (parser.isSet("path") && parser.value("path") != QLatin1String(info.name))
+            continue;
+
+        QVector<FrameResult> frames;
+        frames.reserve(frameCount);
+
+        for (int frame = 0; frame < frameCount; ++frame) {
+            const Camera c = info.path(qreal(frame) / frameCount, mapSize);
+
+            const QSizeF visibleSize(viewportSize.width() / c.scale,
+                                     viewportSize.height() / c.scale);
+            const QPointF topLeft(c.center.x() - visibleSize.width() / 2,
+                                  c.center.y() - visibleSize.height() / 2);
+
+            camera->setScale(c.scale);
+            mapItem->setPosition(-topLeft);
+            mapItem->setVisibleArea(QRectF(topLeft, visibleSize));
+
+            frames.append(renderer.renderFrame());
+        }
+
+        report(out, info.name, frames);
+    }
+
+    delete camera;
+    return 0;
+}
@@ -5,6 +5,7 @@ Item {
     id: spriteContainer;
 
     property QtObject being: null
+    property SpriteBatch batch: null
 
     property alias sprites: repeater.model;
 
@@ -31,6 +32,7 @@ Item {
             action: spriteContainer.action;
             z: model.slot;
             spriteReference: model.sprite;
+            batch: spriteContainer.batch;
 
             anchors.horizontalCenter: spriteContainer.horizontalCenter;
             anchors.bottom: spriteContainer.bottom;
@@ -72,6 +72,7 @@ Rectangle {
     TileMap {
         id: map;
         mapResource: gameClient.currentMapResource;
+        mergeLayers: true;
 
         visible: status == TileMap.Ready
         visibleArea: Qt.rect(-map.x,
@@ -108,6 +109,13 @@ Rectangle {
             }
         }
 
+        // Draws the sprites of all beings, using the tile height as row
+        // height to stack correctly with the fringe layer
+        SpriteBatch {
+            id: spriteBatch;
+            rowHeight: map.tileHeight;
+        }
+
         Repeater {
             model: gameClient.beingListModel;
             delegate: Item {
@@ -118,6 +126,7 @@ Rectangle {
                 CompoundSprite {
                     id: sprite;
                     being: model.being
+                    batch: spriteBatch;
                 }
 
                 MouseArea {
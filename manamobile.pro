@@ -32,6 +32,7 @@ CONFIG += ordered
 
 SUBDIRS += src
 !tizen:SUBDIRS += example
+!tizen:!android:SUBDIRS += benchmark
 
 OTHER_FILES += \
     android/AndroidManifest.xml \
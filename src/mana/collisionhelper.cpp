@@ -33,12 +33,10 @@ static bool freeSpace(const Tiled::TileLayer *collisionLayer,
     if (bottom >= collisionLayer->height())
         return false;
 
-    for (int x = left; x <= right; ++x)
-        for (int y = top; y <= bottom; ++y)
-            if (!collisionLayer->cellAt(x, y).isEmpty())
-                return false;
-
-    return true;
+    Tiled::TileLayer::CellIterator iterator(collisionLayer,
+                                            QRect(QPoint(left, top),
+                                                  QPoint(right, bottom)));
+    return !iterator.next();
 }
 
 namespace Mana {
@@ -531,6 +531,9 @@ void GameClient::playerPositionChanged()
     // TODO: Rate-limit these calls
     const Being *ch = player();
     walkTo(ch->x(), ch->y());
+
+    // Streamed maps load the regions around the player
+    mMapResource->setFocus(ch->position());
 }
 
 void GameClient::restoreWalkingSpeed()
@@ -649,6 +652,7 @@ void GameClient::handlePlayerMapChanged(MessageIn &message)
         mMapResource->decRef();
 
     mMapResource = ResourceManager::instance()->requestMap(mCurrentMap);
+    mMapResource->setFocus(QPointF(mPlayerStartX, mPlayerStartY));
 
     // Reset the player being before it gets deleted
     if (mPlayerCharacter) {
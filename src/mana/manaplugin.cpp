@@ -30,13 +30,16 @@
 #include "gameclient.h"
 #include "inventorylistmodel.h"
 #include "mapitem.h"
+#include "renderstatistics.h"
 #include "resourcelistmodel.h"
 #include "resourcemanager.h"
 #include "settings.h"
 #include "shoplistmodel.h"
+#include "spritebatchitem.h"
 #include "spriteitem.h"
 #include "spritelistmodel.h"
 #include "questloglistmodel.h"
+#include "textureuploadqueue.h"
 
 #include "resource/abilitydb.h"
 #include "resource/attributedb.h"
@@ -60,6 +63,8 @@ void ManaPlugin::initializeEngine(QQmlEngine *engine, const char *uri)
     Q_UNUSED(uri)
 
     Mana::ResourceManager *resourceManager = new Mana::ResourceManager(engine);
+    Mana::RenderStatistics *renderStatistics = new Mana::RenderStatistics(engine);
+    Mana::TextureUploadQueue *textureUploadQueue = new Mana::TextureUploadQueue(engine);
     Mana::AbilityDB *abilityDB = new Mana::AbilityDB(engine);
     Mana::AttributeDB *attributeDB = new Mana::AttributeDB(engine);
     Mana::HairDB *hairDB = new Mana::HairDB(engine);
@@ -70,6 +75,8 @@ void ManaPlugin::initializeEngine(QQmlEngine *engine, const char *uri)
 
     QQmlContext *context = engine->rootContext();
     context->setContextProperty("resourceManager", resourceManager);
+    context->setContextProperty("renderStatistics", renderStatistics);
+    context->setContextProperty("textureUploadQueue", textureUploadQueue);
     context->setContextProperty("abilityDB", abilityDB);
     context->setContextProperty("attributeDB", attributeDB);
     context->setContextProperty("hairDB", hairDB);
@@ -96,6 +103,7 @@ void ManaPlugin::registerTypes(const char *uri)
     qmlRegisterType<Mana::GameClient>(uri, 1, 0, "GameClient");
     qmlRegisterType<Mana::Settings>(uri, 1, 0, "Settings");
     qmlRegisterType<Mana::SpriteItem>(uri, 1, 0, "Sprite");
+    qmlRegisterType<Mana::SpriteBatchItem>(uri, 1, 0, "SpriteBatch");
     qmlRegisterUncreatableType<Mana::Action>(uri, 1, 0, "Action",
                                              "Only exposed for direction enum");
 
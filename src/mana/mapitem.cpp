@@ -19,25 +19,73 @@
 #include "mapitem.h"
 
 #include "resourcemanager.h"
+#include "textureuploadqueue.h"
 #include "tilelayeritem.h"
 
 #include "tiled/isometricrenderer.h"
 #include "tiled/map.h"
 #include "tiled/orthogonalrenderer.h"
+#include "tiled/staggeredrenderer.h"
 #include "tiled/tilelayer.h"
 
+#include "mana/resource/imageresource.h"
 #include "mana/resource/mapresource.h"
 
 #include <cmath>
 
 using namespace Mana;
 
+namespace {
+
+/**
+ * The number of rows around the visible area for which the fringe layer
+ * items are kept alive, to avoid recreating them when moving back and forth.
+ */
+static const int FRINGE_ROW_MARGIN = 4;
+
+/**
+ * The highest level of detail used for the tile layers, at which chunks are
+ * drawn from images at 1/8th of their size.
+ */
+static const int MAX_LOD_LEVEL = 3;
+
+/**
+ * Returns whether the given \a row of the \a layer contains at least one
+ * tile.
+ */
+static bool isRowUsed(const Tiled::TileLayer *layer, int row)
+{
+    Tiled::TileLayer::CellIterator iterator(layer,
+                                            QRect(0, row, layer->width(), 1));
+    return iterator.next();
+}
+
+/**
+ * Returns which rows of the given \a layer contain at least one tile.
+ */
+static QBitArray usedRows(const Tiled::TileLayer *layer)
+{
+    QBitArray rows(layer->height());
+
+    for (int y = 0; y < layer->height(); ++y)
+        rows.setBit(y, isRowUsed(layer, y));
+
+    return rows;
+}
+
+} // anonymous namespace
+
 MapItem::MapItem(QQuickItem *parent)
     : QQuickItem(parent)
     , mMapResource(0)
     , mHideCollisionLayer(true)
+    , mMergeLayers(false)
+    , mLodThreshold(0.5)
+    , mLodLevel(0)
     , mRenderer(0)
     , mFringeLayer(0)
+    , mFirstFringeRow(0)
+    , mLastFringeRow(-1)
 {
 }
 
@@ -56,6 +104,8 @@ void MapItem::setMapResource(MapResource *map)
     if (mMapResource) {
         connect(mMapResource, SIGNAL(statusChanged(Resource::Status)),
                 SLOT(mapStatusChanged()));
+        connect(mMapResource, SIGNAL(cellsChanged()),
+                SLOT(updateChangedTiles()));
     }
 
     refresh();
@@ -66,9 +116,24 @@ MapItem::Status MapItem::status() const
     return mMapResource ? static_cast<Status>(mMapResource->status()) : Null;
 }
 
+/**
+ * Returns the tile height of the map, or 0 while the map is not ready.
+ */
+int MapItem::tileHeight() const
+{
+    if (status() != Ready)
+        return 0;
+    return mMapResource->map()->tileHeight();
+}
+
 void MapItem::setVisibleArea(const QRectF &visibleArea)
 {
     mVisibleArea = visibleArea;
+
+    // The visible area changes along with the scale, so this is where the
+    // level of detail is chosen
+    updateLodLevel();
+
     emit visibleAreaChanged();
 
     updateFringeLayer();
@@ -78,7 +143,8 @@ void MapItem::setVisibleArea(const QRectF &visibleArea)
  * Determines the rectangle of visible tiles of the given tile \a layer, based
  * on the visible area of this MapItem instance.
  *
- * Only works for orthogonal maps.
+ * For isometric and staggered maps, this is the bounding rectangle in tile
+ * coordinates of the visible area, which includes tiles that are not visible.
  */
 QRect MapItem::visibleTileArea(const Tiled::TileLayer *layer) const
 {
@@ -96,12 +162,40 @@ QRect MapItem::visibleTileArea(const Tiled::TileLayer *layer) const
                                          drawMargins.left(),
                                          drawMargins.top());
 
-    int startX = qMax((int) rect.x() / tileWidth, 0);
-    int startY = qMax((int) rect.y() / tileHeight, 0);
-    int endX = qMin((int) std::ceil(rect.right()) / tileWidth, layer->width() - 1);
-    int endY = qMin((int) std::ceil(rect.bottom()) / tileHeight, layer->height() - 1);
+    if (map->orientation() == Tiled::Map::Orthogonal) {
+        int startX = qMax((int) rect.x() / tileWidth, 0);
+        int startY = qMax((int) rect.y() / tileHeight, 0);
+        int endX = qMin((int) std::ceil(rect.right()) / tileWidth, layer->width() - 1);
+        int endY = qMin((int) std::ceil(rect.bottom()) / tileHeight, layer->height() - 1);
+
+        return QRect(QPoint(startX, startY), QPoint(endX, endY));
+    }
+
+    // Map the corners of the visible area to tile coordinates
+    const QPointF corners[] = {
+        mRenderer->pixelToTileCoords(rect.topLeft()),
+        mRenderer->pixelToTileCoords(rect.topRight()),
+        mRenderer->pixelToTileCoords(rect.bottomLeft()),
+        mRenderer->pixelToTileCoords(rect.bottomRight())
+    };
+
+    qreal minX = corners[0].x(), maxX = corners[0].x();
+    qreal minY = corners[0].y(), maxY = corners[0].y();
+    for (int i = 1; i < 4; ++i) {
+        minX = qMin(minX, corners[i].x());
+        maxX = qMax(maxX, corners[i].x());
+        minY = qMin(minY, corners[i].y());
+        maxY = qMax(maxY, corners[i].y());
+    }
+
+    // One extra tile on each side, since the tiles are not aligned with the
+    // visible area
+    const QRect tiles(QPoint((int) std::floor(minX) - 1 - layer->x(),
+                             (int) std::floor(minY) - 1 - layer->y()),
+                      QPoint((int) std::ceil(maxX) + 1 - layer->x(),
+                             (int) std::ceil(maxY) + 1 - layer->y()));
 
-    return QRect(QPoint(startX, startY), QPoint(endX, endY));
+    return tiles & QRect(0, 0, layer->width(), layer->height());
 }
 
 void MapItem::setHideCollisionLayer(bool hideCollisionLayer)
@@ -115,6 +209,63 @@ void MapItem::setHideCollisionLayer(bool hideCollisionLayer)
     emit hideCollisionLayerChanged();
 }
 
+/**
+ * Sets whether consecutive tile layers should be combined into a single item.
+ * The layers below the fringe layer are merged, as well as the ones above it.
+ * Only layers with the same bounds can be merged, and layers with tiles that
+ * are drawn outside of their cells are kept separate.
+ *
+ * This reduces the number of nodes in the scene graph, since tiles from
+ * different layers can share the same geometry.
+ */
+void MapItem::setMergeLayers(bool mergeLayers)
+{
+    if (mMergeLayers == mergeLayers)
+        return;
+
+    mMergeLayers = mergeLayers;
+    refresh();
+
+    emit mergeLayersChanged();
+}
+
+/**
+ * Sets the scale below which the tile layers are drawn from downscaled
+ * images of their chunks rather than tile by tile. A threshold of 0 disables
+ * this. Only orthogonal maps support this.
+ */
+void MapItem::setLodThreshold(qreal lodThreshold)
+{
+    if (mLodThreshold == lodThreshold)
+        return;
+
+    mLodThreshold = lodThreshold;
+    updateLodLevel();
+
+    emit lodThresholdChanged();
+}
+
+/**
+ * Returns a decoded copy of the image of the given \a tileset, used for
+ * drawing the downscaled chunk images. The images are kept while the level
+ * of detail is in use.
+ */
+QImage MapItem::lodTilesetImage(Tiled::Tileset *tileset) const
+{
+    QHash<Tiled::Tileset*, QImage>::const_iterator it =
+            mLodTilesetImages.constFind(tileset);
+    if (it != mLodTilesetImages.constEnd())
+        return it.value();
+
+    QImage image;
+    if (const ImageResource *imageResource = mMapResource->tilesetImage(tileset))
+        if (imageResource->isReady())
+            image = imageResource->decodedImage();
+
+    mLodTilesetImages.insert(tileset, image);
+    return image;
+}
+
 QRectF MapItem::boundingRect() const
 {
     if (!mRenderer)
@@ -130,6 +281,17 @@ void MapItem::componentComplete()
         refresh();
 }
 
+void MapItem::itemChange(ItemChange change, const ItemChangeData &value)
+{
+    // Have the textures of the map and its sprites uploaded for our window
+    if (change == ItemSceneChange && value.window) {
+        if (TextureUploadQueue *queue = TextureUploadQueue::instance())
+            queue->setWindow(value.window);
+    }
+
+    QQuickItem::itemChange(change, value);
+}
+
 void MapItem::mapStatusChanged()
 {
     if (mMapResource->status() == Resource::Ready)
@@ -146,11 +308,15 @@ void MapItem::refresh()
     // Clean up ourselves (maybe wait until the map is available?)
     qDeleteAll(mTileLayerItems);
     mTileLayerItems.clear();
+    mLodTilesetImages.clear();
+    mLodLevel = 0;
 
-    qDeleteAll(mTileItems);
-    mTileItems.clear();
+    qDeleteAll(mFringeRowItems);
+    mFringeRowItems.clear();
+    mFringeRowsUsed.clear();
     mFringeLayer = 0;
-    mVisibleFringeTiles = QRect();
+    mFirstFringeRow = 0;
+    mLastFringeRow = -1;
 
     delete mRenderer;
     mRenderer = 0;
@@ -164,65 +330,211 @@ void MapItem::refresh()
     case Tiled::Map::Isometric:
         mRenderer = new Tiled::IsometricRenderer(map);
         break;
+    case Tiled::Map::Staggered:
+        mRenderer = new Tiled::StaggeredRenderer(map);
+        break;
     default:
         mRenderer = new Tiled::OrthogonalRenderer(map);
         break;
     }
 
+    QList<Tiled::TileLayer*> layers;
+    bool mergeable = false;
+
     foreach (Tiled::Layer *layer, map->layers()) {
         if (Tiled::TileLayer *tl = layer->asTileLayer()) {
-            if (mHideCollisionLayer)
-                if (tl->name().compare(QLatin1String("collision"), Qt::CaseInsensitive) == 0)
-                    continue;
+            const bool hidden = mHideCollisionLayer &&
+                    tl->name().compare(QLatin1String("collision"), Qt::CaseInsensitive) == 0;
+
+            // Record changes to the displayed layers for updateChangedTiles()
+            tl->setChangeTracking(!hidden);
+            tl->takeDirtyRegion();
+
+            if (hidden)
+                continue;
 
             if (!mFringeLayer) {
                 if (tl->name().compare(QLatin1String("fringe"), Qt::CaseInsensitive) == 0) {
+                    createTileLayerItem(layers);
+                    layers.clear();
+
                     mFringeLayer = tl;
+                    mFringeRowsUsed = usedRows(tl);
                     continue;
                 }
             }
 
-            TileLayerItem *layerItem = new TileLayerItem(tl, mRenderer, this);
-            if (mFringeLayer)
-                layerItem->setZ(65536);
-            mTileLayerItems.append(layerItem);
+            // The tiles of a layer that reach into the neighbouring chunks
+            // would be drawn over by the next chunk of any merged layer
+            const bool exceedsCells = TileLayerItem::tilesExceedCells(tl);
+
+            if (!layers.isEmpty()) {
+                if (!mergeable || exceedsCells ||
+                        layers.first()->bounds() != tl->bounds()) {
+                    createTileLayerItem(layers);
+                    layers.clear();
+                }
+            }
+
+            layers.append(tl);
+            mergeable = mMergeLayers && !exceedsCells;
         }
     }
 
+    createTileLayerItem(layers);
+
     updateFringeLayer();
+    updateLodLevel();
 
     const QSize size = mRenderer->mapSize();
     setImplicitSize(size.width(), size.height());
 }
 
+/**
+ * Updates the parts of the map of which the cells have changed since the
+ * last update. Should be called after changing any of the tile layers of
+ * the map.
+ */
+void MapItem::updateChangedTiles()
+{
+    if (!mRenderer)
+        return;
+
+    // Merged layers need to be separated once they have tiles that are drawn
+    // outside of their cells
+    foreach (TileLayerItem *layerItem, mTileLayerItems) {
+        if (layerItem->layers().size() < 2)
+            continue;
+
+        foreach (Tiled::TileLayer *layer, layerItem->layers()) {
+            if (TileLayerItem::tilesExceedCells(layer)) {
+                refresh();
+                return;
+            }
+        }
+    }
+
+    foreach (TileLayerItem *layerItem, mTileLayerItems) {
+        QRegion region;
+        foreach (Tiled::TileLayer *layer, layerItem->layers())
+            region += layer->takeDirtyRegion();
+
+        if (!region.isEmpty())
+            layerItem->invalidateTiles(region);
+    }
+
+    if (!mFringeLayer)
+        return;
+
+    const QRegion region = mFringeLayer->takeDirtyRegion();
+    if (region.isEmpty())
+        return;
+
+    // Rows may have become empty or gotten their first tile
+    foreach (const QRect &rect, region.rects()) {
+        for (int row = rect.top(); row <= rect.bottom(); ++row) {
+            const bool used = isRowUsed(mFringeLayer, row);
+            mFringeRowsUsed.setBit(row, used);
+
+            if (TileLayerItem *rowItem = mFringeRowItems.value(row)) {
+                if (used) {
+                    rowItem->invalidateTiles(region);
+                } else {
+                    delete rowItem;
+                    mFringeRowItems.remove(row);
+                }
+            }
+        }
+    }
+
+    // Force creating the items for rows that came into use
+    mFirstFringeRow = 0;
+    mLastFringeRow = -1;
+    updateFringeLayer();
+}
+
+void MapItem::createTileLayerItem(const QList<Tiled::TileLayer*> &layers)
+{
+    if (layers.isEmpty())
+        return;
+
+    TileLayerItem *layerItem = new TileLayerItem(layers, mRenderer, this);
+    if (mFringeLayer)
+        layerItem->setZ(65536);
+    mTileLayerItems.append(layerItem);
+}
+
+/**
+ * Chooses the level of detail based on the scale at which the map is shown,
+ * with each level halving the resolution of the chunk images.
+ */
+void MapItem::updateLodLevel()
+{
+    int level = 0;
+
+    if (mRenderer && mMapResource->map()->orientation() == Tiled::Map::Orthogonal) {
+        const qreal scale = mapRectToScene(QRectF(0, 0, 1, 1)).width();
+
+        if (scale > 0 && scale < mLodThreshold) {
+            level = qBound(1, int(std::floor(std::log(1 / scale) / std::log(2.0))),
+                           MAX_LOD_LEVEL);
+        }
+    }
+
+    if (level == mLodLevel)
+        return;
+
+    mLodLevel = level;
+
+    if (mLodLevel == 0)
+        mLodTilesetImages.clear();
+
+    // The fringe layer rows are always drawn tile by tile
+    foreach (TileLayerItem *layerItem, mTileLayerItems)
+        layerItem->setLodLevel(mLodLevel);
+}
+
 void MapItem::updateFringeLayer()
 {
     if (!mFringeLayer)
         return;
 
     const QRect tileArea = visibleTileArea(mFringeLayer);
-    if (mVisibleFringeTiles == tileArea)
+
+    int firstRow = 0;
+    int lastRow = -1;
+    if (!tileArea.isEmpty()) {
+        firstRow = qMax(0, tileArea.top() - FRINGE_ROW_MARGIN);
+        lastRow = qMin(mFringeLayer->height() - 1,
+                       tileArea.bottom() + FRINGE_ROW_MARGIN);
+    }
+
+    if (firstRow == mFirstFringeRow && lastRow == mLastFringeRow)
         return;
 
-    // Remove no longer visible fringe tiles
-    for (int i = mTileItems.size() - 1; i >= 0; --i) {
-        if (!tileArea.contains(mTileItems.at(i)->position())) {
-            delete mTileItems.at(i);
-            mTileItems.removeAt(i);
+    // Remove the rows that have moved too far out of view
+    QMutableMapIterator<int, TileLayerItem*> it(mFringeRowItems);
+    while (it.hasNext()) {
+        it.next();
+        if (it.key() < firstRow || it.key() > lastRow) {
+            delete it.value();
+            it.remove();
         }
     }
 
-    // Create tile items for the newly visible area
-    const QRegion n = QRegion(tileArea).subtracted(mVisibleFringeTiles);
-    foreach (const QRect &r, n.rects()) {
-        for (int y = r.top(); y <= r.bottom(); ++y) {
-            for (int x = r.left(); x <= r.right(); ++x) {
-                const Tiled::Cell &cell = mFringeLayer->cellAt(x, y);
-                if (!cell.isEmpty())
-                    mTileItems.append(new TileItem(cell, QPoint(x, y), this));
-            }
-        }
+    // Create items for the rows that came into view
+    const int tileHeight = mMapResource->map()->tileHeight();
+    const QList<Tiled::TileLayer*> layers = QList<Tiled::TileLayer*>() << mFringeLayer;
+
+    for (int row = firstRow; row <= lastRow; ++row) {
+        if (!mFringeRowsUsed.testBit(row) || mFringeRowItems.contains(row))
+            continue;
+
+        TileLayerItem *rowItem = new TileLayerItem(layers, mRenderer, this, row);
+        rowItem->setZ(row * tileHeight);
+        mFringeRowItems.insert(row, rowItem);
     }
 
-    mVisibleFringeTiles = tileArea;
+    mFirstFringeRow = firstRow;
+    mLastFringeRow = lastRow;
 }
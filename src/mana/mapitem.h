@@ -19,6 +19,10 @@
 #ifndef MAPITEM_H
 #define MAPITEM_H
 
+#include <QBitArray>
+#include <QHash>
+#include <QImage>
+#include <QMap>
 #include <QQuickItem>
 
 namespace Tiled {
@@ -32,7 +36,6 @@ namespace Mana {
 
 class ImageResource;
 class MapResource;
-class TileItem;
 class TileLayerItem;
 
 /**
@@ -45,8 +48,11 @@ class MapItem : public QQuickItem
 
     Q_PROPERTY(Mana::MapResource *mapResource READ mapResource WRITE setMapResource NOTIFY mapChanged)
     Q_PROPERTY(Status status READ status NOTIFY statusChanged)
+    Q_PROPERTY(int tileHeight READ tileHeight NOTIFY statusChanged)
     Q_PROPERTY(QRectF visibleArea READ visibleArea WRITE setVisibleArea NOTIFY visibleAreaChanged)
     Q_PROPERTY(bool hideCollisionLayer READ hideCollisionLayer WRITE setHideCollisionLayer NOTIFY hideCollisionLayerChanged)
+    Q_PROPERTY(bool mergeLayers READ mergeLayers WRITE setMergeLayers NOTIFY mergeLayersChanged)
+    Q_PROPERTY(qreal lodThreshold READ lodThreshold WRITE setLodThreshold NOTIFY lodThresholdChanged)
 
 public:
     enum Status {
@@ -62,6 +68,7 @@ public:
     void setMapResource(MapResource *mapResource);
 
     Status status() const;
+    int tileHeight() const;
 
     const QRectF &visibleArea() const;
     void setVisibleArea(const QRectF &visibleArea);
@@ -70,15 +77,31 @@ public:
     bool hideCollisionLayer() const;
     void setHideCollisionLayer(bool hideCollisionLayer);
 
+    bool mergeLayers() const;
+    void setMergeLayers(bool mergeLayers);
+
+    qreal lodThreshold() const;
+    void setLodThreshold(qreal lodThreshold);
+
+    QImage lodTilesetImage(Tiled::Tileset *tileset) const;
+
     QRectF boundingRect() const;
 
     void componentComplete();
 
+protected:
+    void itemChange(ItemChange change, const ItemChangeData &value);
+
+public slots:
+    void updateChangedTiles();
+
 signals:
     void mapChanged();
     void statusChanged();
     void visibleAreaChanged();
     void hideCollisionLayerChanged();
+    void mergeLayersChanged();
+    void lodThresholdChanged();
 
 private slots:
     void mapStatusChanged();
@@ -86,17 +109,25 @@ private slots:
 private:
     void setStatus(Status status);
     void refresh();
+    void createTileLayerItem(const QList<Tiled::TileLayer*> &layers);
     void updateFringeLayer();
+    void updateLodLevel();
 
     MapResource *mMapResource;
     QRectF mVisibleArea;
-    QRect mVisibleFringeTiles;
     bool mHideCollisionLayer;
+    bool mMergeLayers;
+    qreal mLodThreshold;
+    int mLodLevel;
+    mutable QHash<Tiled::Tileset*, QImage> mLodTilesetImages;
 
     Tiled::MapRenderer *mRenderer;
     Tiled::TileLayer *mFringeLayer;
     QList<TileLayerItem*> mTileLayerItems;
-    QList<TileItem*> mTileItems;
+    QBitArray mFringeRowsUsed;
+    int mFirstFringeRow;
+    int mLastFringeRow;
+    QMap<int, TileLayerItem*> mFringeRowItems;
 };
 
 inline const QRectF &MapItem::visibleArea() const
@@ -105,6 +136,12 @@ inline const QRectF &MapItem::visibleArea() const
 inline bool MapItem::hideCollisionLayer() const
 { return mHideCollisionLayer; }
 
+inline bool MapItem::mergeLayers() const
+{ return mMergeLayers; }
+
+inline qreal MapItem::lodThreshold() const
+{ return mLodThreshold; }
+
 inline MapResource *MapItem::mapResource() const
 { return mMapResource; }
 
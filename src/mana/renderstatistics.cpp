@@ -0,0 +1,161 @@
+/*
+ * Mana Mobile
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "renderstatistics.h"
+
+#include <QDebug>
+#include <QMutexLocker>
+#include <QQuickWindow>
+
+using namespace Mana;
+
+namespace {
+
+/**
+ * The upper bounds of the histogram buckets for the update time per frame,
+ * in microseconds. The last bucket collects everything above.
+ */
+static const int HISTOGRAM_BOUNDS[] = { 100, 250, 500, 1000, 2000, 4000, 8000 };
+static const int HISTOGRAM_BUCKETS =
+        sizeof(HISTOGRAM_BOUNDS) / sizeof(HISTOGRAM_BOUNDS[0]) + 1;
+
+static int histogramBucket(int time)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; ++i)
+        if (time < HISTOGRAM_BOUNDS[i])
+            return i;
+    return HISTOGRAM_BUCKETS - 1;
+}
+
+} // anonymous namespace
+
+RenderStatistics *RenderStatistics::mInstance;
+
+RenderStatistics::RenderStatistics(QObject *parent)
+    : QObject(parent)
+    , mEnabled(false)
+    , mLogging(false)
+    , mLiveNodes(0)
+    , mRenderedFrames(0)
+    , mHistogram(HISTOGRAM_BUCKETS)
+    , mHistogramFrames(0)
+    , mPublishedFrames(0)
+    , mPublishedLiveNodes(0)
+{
+    Q_ASSERT(!mInstance);
+    mInstance = this;
+
+    for (int i = 0; i < CounterCount; ++i) {
+        mFrameCounters[i] = 0;
+        mPublishedCounters[i] = 0;
+    }
+}
+
+RenderStatistics::~RenderStatistics()
+{
+    mInstance = 0;
+}
+
+void RenderStatistics::setEnabled(bool enabled)
+{
+    if (this->enabled() == enabled)
+        return;
+
+    mEnabled.store(enabled);
+    emit enabledChanged();
+}
+
+void RenderStatistics::setLogging(bool logging)
+{
+    if (this->logging() == logging)
+        return;
+
+    mLogging.store(logging);
+    emit loggingChanged();
+}
+
+void RenderStatistics::watchWindow(QQuickWindow *window)
+{
+    if (mWindow == window)
+        return;
+
+    if (mWindow)
+        mWindow->disconnect(this);
+
+    mWindow = window;
+
+    if (mWindow) {
+        connect(mWindow, SIGNAL(afterRendering()),
+                this, SLOT(frameRendered()), Qt::DirectConnection);
+    }
+}
+
+/**
+ * Called on the render thread after each frame. Takes the counters of the
+ * frame and schedules them to be published on the GUI thread.
+ */
+void RenderStatistics::frameRendered()
+{
+    QMutexLocker locker(&mMutex);
+
+    for (int i = 0; i < CounterCount; ++i)
+        mFrameCounters[i] = mCounters[i].fetchAndStoreRelaxed(0);
+
+    ++mRenderedFrames;
+
+    if (mLogging.load()) {
+        ++mHistogram[histogramBucket(mFrameCounters[UpdateTime])];
+
+        if (++mHistogramFrames == LOG_INTERVAL)
+            logHistogram();
+    }
+
+    QMetaObject::invokeMethod(this, "publish", Qt::QueuedConnection);
+}
+
+void RenderStatistics::publish()
+{
+    {
+        QMutexLocker locker(&mMutex);
+
+        for (int i = 0; i < CounterCount; ++i)
+            mPublishedCounters[i] = mFrameCounters[i];
+
+        mPublishedFrames = mRenderedFrames;
+        mPublishedLiveNodes = mLiveNodes.load();
+    }
+
+    emit updated();
+}
+
+void RenderStatistics::logHistogram()
+{
+    QString line;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (i < HISTOGRAM_BUCKETS - 1)
+            line += QString(QLatin1String("<%1us: %2  ")).arg(HISTOGRAM_BOUNDS[i]).arg(mHistogram[i]);
+        else
+            line += QString(QLatin1String(">=%1us: %2")).arg(HISTOGRAM_BOUNDS[i - 1]).arg(mHistogram[i]);
+    }
+
+    qDebug() << "updatePaintNode time over the last" << mHistogramFrames
+             << "frames:" << qPrintable(line);
+
+    mHistogram.fill(0);
+    mHistogramFrames = 0;
+}
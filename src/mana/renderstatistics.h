@@ -0,0 +1,237 @@
+/*
+ * Mana Mobile
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RENDERSTATISTICS_H
+#define RENDERSTATISTICS_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QObject>
+#include <QPointer>
+#include <QVector>
+
+class QQuickWindow;
+
+namespace Mana {
+
+/**
+ * Collects statistics about the scene graph side of the items provided by
+ * this library, like the number of nodes created and the time spent in
+ * updatePaintNode, and makes them available per frame.
+ *
+ * The counters are increased on the render thread. At the end of each frame
+ * they are published to the GUI thread, where they can be read from QML.
+ * Nothing is collected unless the statistics are enabled, except for the
+ * number of live nodes, which would otherwise be off when the statistics
+ * get enabled while nodes exist.
+ *
+ * When logging is enabled, a histogram of the update time per frame is
+ * written to the log every LOG_INTERVAL frames.
+ */
+class RenderStatistics : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(bool enabled READ enabled WRITE setEnabled NOTIFY enabledChanged)
+    Q_PROPERTY(bool logging READ logging WRITE setLogging NOTIFY loggingChanged)
+
+    Q_PROPERTY(int frames READ frames NOTIFY updated)
+    Q_PROPERTY(int nodesCreated READ nodesCreated NOTIFY updated)
+    Q_PROPERTY(int nodesDestroyed READ nodesDestroyed NOTIFY updated)
+    Q_PROPERTY(int liveNodes READ liveNodes NOTIFY updated)
+    Q_PROPERTY(int vertices READ vertices NOTIFY updated)
+    Q_PROPERTY(int bytesUploaded READ bytesUploaded NOTIFY updated)
+    Q_PROPERTY(int chunksBuilt READ chunksBuilt NOTIFY updated)
+    Q_PROPERTY(int texturesUploaded READ texturesUploaded NOTIFY updated)
+    Q_PROPERTY(int uploadLatency READ uploadLatency NOTIFY updated)
+    Q_PROPERTY(int updateTime READ updateTime NOTIFY updated)
+
+public:
+    enum Counter {
+        NodesCreated,
+        NodesDestroyed,
+        Vertices,
+        BytesUploaded,
+        ChunksBuilt,
+        TexturesUploaded,
+        UploadLatency,  // in milliseconds, longest wait of an uploaded texture
+        UpdateTime,     // in microseconds
+        CounterCount
+    };
+
+    /**
+     * The number of frames covered by each logged histogram.
+     */
+    static const int LOG_INTERVAL = 300;
+
+    explicit RenderStatistics(QObject *parent = 0);
+    ~RenderStatistics();
+
+    static RenderStatistics *instance();
+
+    static bool isEnabled();
+    static void add(Counter counter, int value);
+
+    bool enabled() const;
+    void setEnabled(bool enabled);
+
+    bool logging() const;
+    void setLogging(bool logging);
+
+    int frames() const;
+    int nodesCreated() const;
+    int nodesDestroyed() const;
+    int liveNodes() const;
+    int vertices() const;
+    int bytesUploaded() const;
+    int chunksBuilt() const;
+    int texturesUploaded() const;
+    int uploadLatency() const;
+    int updateTime() const;
+
+    /**
+     * Makes sure the statistics are collected for each frame rendered by
+     * the given \a window. Called from the render thread.
+     */
+    void watchWindow(QQuickWindow *window);
+
+signals:
+    void enabledChanged();
+    void loggingChanged();
+    void updated();
+
+private slots:
+    void frameRendered();
+    void publish();
+
+private:
+    void logHistogram();
+
+    // Set on the GUI thread and read on the render thread
+    QAtomicInt mEnabled;
+    QAtomicInt mLogging;
+    QPointer<QQuickWindow> mWindow;
+
+    QAtomicInt mCounters[CounterCount];
+    QAtomicInt mLiveNodes;
+
+    // Written on the render thread, protected by mMutex
+    QMutex mMutex;
+    int mFrameCounters[CounterCount];
+    int mRenderedFrames;
+    QVector<int> mHistogram;
+    int mHistogramFrames;
+
+    // Read from the GUI thread
+    int mPublishedCounters[CounterCount];
+    int mPublishedFrames;
+    int mPublishedLiveNodes;
+
+    static RenderStatistics *mInstance;
+};
+
+/**
+ * Measures the time spent in its scope and adds it to the update time of the
+ * current frame. Meant to be used at the start of updatePaintNode.
+ */
+class RenderTimer
+{
+public:
+    explicit RenderTimer(QQuickWindow *window)
+        : mActive(RenderStatistics::isEnabled())
+    {
+        if (mActive) {
+            RenderStatistics::instance()->watchWindow(window);
+            mTimer.start();
+        }
+    }
+
+    ~RenderTimer()
+    {
+        if (mActive) {
+            RenderStatistics::add(RenderStatistics::UpdateTime,
+                                  mTimer.nsecsElapsed() / 1000);
+        }
+    }
+
+private:
+    bool mActive;
+    QElapsedTimer mTimer;
+};
+
+
+inline RenderStatistics *RenderStatistics::instance()
+{ return mInstance; }
+
+inline bool RenderStatistics::isEnabled()
+{ return mInstance && mInstance->mEnabled.load(); }
+
+inline void RenderStatistics::add(Counter counter, int value)
+{
+    if (!mInstance)
+        return;
+
+    if (counter == NodesCreated)
+        mInstance->mLiveNodes.fetchAndAddRelaxed(value);
+    else if (counter == NodesDestroyed)
+        mInstance->mLiveNodes.fetchAndAddRelaxed(-value);
+
+    if (mInstance->mEnabled.load())
+        mInstance->mCounters[counter].fetchAndAddRelaxed(value);
+}
+
+inline bool RenderStatistics::enabled() const
+{ return mEnabled.load(); }
+
+inline bool RenderStatistics::logging() const
+{ return mLogging.load(); }
+
+inline int RenderStatistics::frames() const
+{ return mPublishedFrames; }
+
+inline int RenderStatistics::nodesCreated() const
+{ return mPublishedCounters[NodesCreated]; }
+
+inline int RenderStatistics::nodesDestroyed() const
+{ return mPublishedCounters[NodesDestroyed]; }
+
+inline int RenderStatistics::liveNodes() const
+{ return mPublishedLiveNodes; }
+
+inline int RenderStatistics::vertices() const
+{ return mPublishedCounters[Vertices]; }
+
+inline int RenderStatistics::bytesUploaded() const
+{ return mPublishedCounters[BytesUploaded]; }
+
+inline int RenderStatistics::chunksBuilt() const
+{ return mPublishedCounters[ChunksBuilt]; }
+
+inline int RenderStatistics::texturesUploaded() const
+{ return mPublishedCounters[TexturesUploaded]; }
+
+inline int RenderStatistics::uploadLatency() const
+{ return mPublishedCounters[UploadLatency]; }
+
+inline int RenderStatistics::updateTime() const
+{ return mPublishedCounters[UpdateTime]; }
+
+} // namespace Mana
+
+#endif // RENDERSTATISTICS_H
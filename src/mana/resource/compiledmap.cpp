@@ -0,0 +1,719 @@
+/*
+ * Mana QML plugin
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compiledmap.h"
+
+#include "tiled/imagelayer.h"
+#include "tiled/map.h"
+#include "tiled/mapobject.h"
+#include "tiled/objectgroup.h"
+#include "tiled/terrain.h"
+#include "tiled/tile.h"
+#include "tiled/tilelayer.h"
+#include "tiled/tileset.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QImage>
+#include <QRect>
+#include <QSaveFile>
+#include <QScopedPointer>
+#include <QSysInfo>
+#include <QUrl>
+#include <QVector>
+
+using namespace Tiled;
+using namespace Mana;
+
+namespace {
+
+static const quint32 MAGIC = 0x4d4d4150; // "MMAP"
+
+/**
+ * Needs to be increased whenever the format changes, which makes existing
+ * compiled maps get parsed from TMX again.
+ */
+static const quint32 VERSION = 1;
+
+static const quint32 FlippedHorizontallyFlag   = 0x80000000;
+static const quint32 FlippedVerticallyFlag     = 0x40000000;
+static const quint32 FlippedAntiDiagonallyFlag = 0x20000000;
+static const quint32 FlagsMask = FlippedHorizontallyFlag |
+                                 FlippedVerticallyFlag |
+                                 FlippedAntiDiagonallyFlag;
+
+/**
+ * Maps cells to the global tile IDs used in the compiled map, which are
+ * assigned by the order of the tilesets in the map.
+ */
+class CellWriter
+{
+public:
+    explicit CellWriter(const Map *map)
+    {
+        quint32 firstGid = 1;
+        foreach (const Tileset *tileset, map->tilesets()) {
+            mFirstGids.insert(tileset, firstGid);
+            firstGid += tileset->tileCount();
+        }
+    }
+
+    bool cellToGid(const Cell &cell, quint32 &gid) const
+    {
+        if (cell.isEmpty()) {
+            gid = 0;
+            return true;
+        }
+
+        QHash<const Tileset*, quint32>::const_iterator it =
+                mFirstGids.find(cell.tile->tileset());
+        if (it == mFirstGids.end())
+            return false;
+
+        gid = it.value() + cell.tile->id();
+        if (cell.flippedHorizontally)
+            gid |= FlippedHorizontallyFlag;
+        if (cell.flippedVertically)
+            gid |= FlippedVerticallyFlag;
+        if (cell.flippedAntiDiagonally)
+            gid |= FlippedAntiDiagonallyFlag;
+        return true;
+    }
+
+private:
+    QHash<const Tileset*, quint32> mFirstGids;
+};
+
+/**
+ * Maps the global tile IDs of a compiled map back to cells, using a flat
+ * lookup table instead of searching the tileset for each tile.
+ *
+ * The global tile IDs are based on the number of tiles each tileset had when
+ * the map was compiled, given by \a tileCounts. Tiles that no longer exist
+ * map to empty cells.
+ */
+class CellReader
+{
+public:
+    CellReader(const QList<Tileset*> &tilesets,
+               const QVector<int> &tileCounts)
+    {
+        mTiles.append(0);
+        for (int i = 0; i < tilesets.size(); ++i)
+            for (int id = 0; id < tileCounts.at(i); ++id)
+                mTiles.append(tilesets.at(i)->tileAt(id));
+    }
+
+    bool gidToCell(quint32 gid, Cell &cell) const
+    {
+        const quint32 index = gid & ~FlagsMask;
+        if (index >= quint32(mTiles.size()))
+            return false;
+
+        cell.tile = mTiles.at(index);
+        cell.flippedHorizontally = gid & FlippedHorizontallyFlag;
+        cell.flippedVertically = gid & FlippedVerticallyFlag;
+        cell.flippedAntiDiagonally = gid & FlippedAntiDiagonallyFlag;
+        return true;
+    }
+
+private:
+    QVector<Tile*> mTiles;
+};
+
+static void writeProperties(QDataStream &out, const Object *object)
+{
+    out << static_cast<const QMap<QString, QString> &>(object->properties());
+}
+
+static void readProperties(QDataStream &in, Object *object)
+{
+    Properties properties;
+    in >> static_cast<QMap<QString, QString> &>(properties);
+    object->setProperties(properties);
+}
+
+/**
+ * Pads the stream with zeros up to the next multiple of four bytes.
+ */
+static void writePadding(QDataStream &out)
+{
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    const qint64 pos = out.device()->pos();
+    if (pos % 4)
+        out.writeRawData(zeros, 4 - pos % 4);
+}
+
+static bool writeTileset(QDataStream &out, const Tileset *tileset)
+{
+    out << tileset->fileName()
+        << qint32(tileset->tileCount());
+
+    // External tilesets are loaded separately, but the number of tiles in
+    // use is needed to replace them later on
+    if (tileset->isExternal())
+        return true;
+
+    out << tileset->name()
+        << qint32(tileset->tileWidth())
+        << qint32(tileset->tileHeight())
+        << qint32(tileset->tileSpacing())
+        << qint32(tileset->margin())
+        << tileset->tileOffset()
+        << tileset->imageSource()
+        << tileset->transparentColor();
+    writeProperties(out, tileset);
+
+    out << qint32(tileset->terrainCount());
+    foreach (const Terrain *terrain, tileset->terrains()) {
+        out << terrain->name() << qint32(terrain->imageTileId());
+        writeProperties(out, terrain);
+    }
+
+    foreach (const Tile *tile, tileset->tiles()) {
+        // Tile images are only loaded when not using an image source
+        if (!tile->image().isNull())
+            return false;
+
+        out << quint32(tile->terrain()) << tile->terrainProbability();
+        writeProperties(out, tile);
+    }
+
+    return true;
+}
+
+static Tileset *readTileset(QDataStream &in)
+{
+    QString fileName;
+    qint32 tileCount;
+    in >> fileName >> tileCount;
+
+    if (in.status() != QDataStream::Ok || tileCount < 0)
+        return 0;
+
+    if (!fileName.isEmpty()) {
+        Tileset *tileset = new Tileset(QString(), 0, 0);
+        tileset->setFileName(fileName);
+        tileset->resize(tileCount);
+        return tileset;
+    }
+
+    QString name;
+    qint32 tileWidth, tileHeight, tileSpacing, margin;
+    QPoint tileOffset;
+    QString imageSource;
+    QColor transparentColor;
+    in >> name >> tileWidth >> tileHeight >> tileSpacing >> margin
+       >> tileOffset >> imageSource >> transparentColor;
+
+    if (in.status() != QDataStream::Ok ||
+            tileWidth < 0 || tileHeight < 0 || tileSpacing < 0 || margin < 0)
+        return 0;
+
+    Tileset *tileset = new Tileset(name, tileWidth, tileHeight,
+                                   tileSpacing, margin);
+    tileset->setTileOffset(tileOffset);
+    tileset->setImageSource(imageSource);
+    tileset->setTransparentColor(transparentColor);
+    readProperties(in, tileset);
+
+    qint32 terrainCount;
+    in >> terrainCount;
+    for (int i = 0; i < terrainCount && in.status() == QDataStream::Ok; ++i) {
+        QString terrainName;
+        qint32 imageTileId;
+        in >> terrainName >> imageTileId;
+        readProperties(in, tileset->addTerrain(terrainName, imageTileId));
+    }
+
+    tileset->resize(tileCount);
+    foreach (Tile *tile, tileset->tiles()) {
+        quint32 terrain;
+        float probability;
+        in >> terrain >> probability;
+        tile->setTerrain(terrain);
+        tile->setTerrainProbability(probability);
+        readProperties(in, tile);
+    }
+
+    return tileset;
+}
+
+static bool writeLayer(QDataStream &out, const Layer *layer,
+                       const CellWriter &cells)
+{
+    out << quint8(layer->layerType())
+        << layer->name()
+        << qint32(layer->x())
+        << qint32(layer->y())
+        << qint32(layer->width())
+        << qint32(layer->height())
+        << layer->opacity()
+        << layer->isVisible();
+    writeProperties(out, layer);
+
+    switch (layer->layerType()) {
+    case Layer::TileLayerType: {
+        const TileLayer *tileLayer = static_cast<const TileLayer*>(layer);
+        QVector<quint32> gids(tileLayer->width() * tileLayer->height());
+        quint32 *gid = gids.data();
+
+        for (int y = 0; y < tileLayer->height(); ++y)
+            for (int x = 0; x < tileLayer->width(); ++x)
+                if (!cells.cellToGid(tileLayer->cellAt(x, y), *gid++))
+                    return false;
+
+        writePadding(out);
+        out.writeRawData(reinterpret_cast<const char*>(gids.constData()),
+                         gids.size() * sizeof(quint32));
+        break;
+    }
+    case Layer::ObjectGroupType: {
+        const ObjectGroup *objectGroup = static_cast<const ObjectGroup*>(layer);
+        out << objectGroup->color() << qint32(objectGroup->objectCount());
+
+        foreach (const MapObject *object, objectGroup->objects()) {
+            quint32 gid;
+            if (!cells.cellToGid(object->cell(), gid))
+                return false;
+
+            out << object->name()
+                << object->type()
+                << object->position()
+                << object->size()
+                << object->polygon()
+                << qint32(object->shape())
+                << gid
+                << object->rotation()
+                << object->isVisible();
+            writeProperties(out, object);
+        }
+        break;
+    }
+    case Layer::ImageLayerType: {
+        const ImageLayer *imageLayer = static_cast<const ImageLayer*>(layer);
+        out << imageLayer->imageSource() << imageLayer->transparentColor();
+        break;
+    }
+    }
+
+    return out.status() == QDataStream::Ok;
+}
+
+/**
+ * Reads a layer, except for the cells of tile layers. For those, the offset
+ * of their global tile IDs within the \a data is stored in \a cellOffset.
+ */
+static Layer *readLayer(QDataStream &in, const QByteArray &data,
+                        const CellReader &cells, qint64 &cellOffset)
+{
+    quint8 type;
+    QString name;
+    qint32 x, y, width, height;
+    float opacity;
+    bool visible;
+    in >> type >> name >> x >> y >> width >> height >> opacity >> visible;
+
+    if (in.status() != QDataStream::Ok || width < 0 || height < 0)
+        return 0;
+
+    Layer *layer = 0;
+
+    switch (type) {
+    case Layer::TileLayerType: {
+        // Check the size against the remaining data before allocating the
+        // layer, so that a corrupt file does not cause a huge allocation
+        const qint64 remaining = data.size() - in.device()->pos();
+        if (qint64(width) * height > remaining / qint64(sizeof(quint32)))
+            return 0;
+
+        const qint64 bytes = qint64(width) * height * sizeof(quint32);
+
+        // The layer stays empty until its cells are read, which may only
+        // happen region by region when the map is streamed
+        TileLayer *tileLayer = new TileLayer(name, x, y, width, height,
+                                             TileLayer::SparseStorage);
+        layer = tileLayer;
+        readProperties(in, layer);
+
+        const qint64 pos = in.device()->pos();
+        const int padding = pos % 4 ? 4 - pos % 4 : 0;
+
+        if (pos + padding + bytes > data.size()) {
+            delete layer;
+            return 0;
+        }
+
+        cellOffset = pos + padding;
+        in.skipRawData(padding + bytes);
+        break;
+    }
+    case Layer::ObjectGroupType: {
+        ObjectGroup *objectGroup = new ObjectGroup(name, x, y, width, height);
+        layer = objectGroup;
+        readProperties(in, layer);
+
+        QColor color;
+        qint32 objectCount;
+        in >> color >> objectCount;
+        objectGroup->setColor(color);
+
+        for (int i = 0; i < objectCount && in.status() == QDataStream::Ok; ++i) {
+            QString objectName, objectType;
+            QPointF position;
+            QSizeF size;
+            QPolygonF polygon;
+            qint32 shape;
+            quint32 gid;
+            qreal rotation;
+            bool objectVisible;
+            in >> objectName >> objectType >> position >> size >> polygon
+               >> shape >> gid >> rotation >> objectVisible;
+
+            Cell cell;
+            if (!cells.gidToCell(gid, cell)) {
+                delete layer;
+                return 0;
+            }
+
+            MapObject *object = new MapObject(objectName, objectType,
+                                              position, size);
+            object->setPolygon(polygon);
+            object->setShape(static_cast<MapObject::Shape>(shape));
+            object->setCell(cell);
+            object->setRotation(rotation);
+            object->setVisible(objectVisible);
+            readProperties(in, object);
+            objectGroup->addObject(object);
+        }
+        break;
+    }
+    case Layer::ImageLayerType: {
+        ImageLayer *imageLayer = new ImageLayer(name, x, y, width, height);
+        layer = imageLayer;
+        readProperties(in, layer);
+
+        QString source;
+        QColor transparentColor;
+        in >> source >> transparentColor;
+        imageLayer->setTransparentColor(transparentColor);
+
+        // Image layers are not lazy, same as with Tiled::MapReader
+        if (!imageLayer->loadFromImage(QImage(source), source)) {
+            delete layer;
+            return 0;
+        }
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    layer->setOpacity(opacity);
+    layer->setVisible(visible);
+
+    if (in.status() != QDataStream::Ok) {
+        delete layer;
+        return 0;
+    }
+
+    return layer;
+}
+
+} // anonymous namespace
+
+CompiledMap::CompiledMap(const QString &fileName)
+    : mFile(fileName)
+    , mMap(0)
+{
+}
+
+/**
+ * Reads the compiled map, leaving its tile layers empty. Returns 0 when the
+ * file does not exist, was written by an incompatible version or is corrupt.
+ *
+ * The empty tile layers are stored sparsely, so that streamed layers never
+ * allocate a dense grid. Layers of which all cells are read are switched to
+ * dense storage by readCells().
+ *
+ * The returned map is owned by the caller, but needs to stay around for as
+ * long as readCells() is used.
+ */
+Map *CompiledMap::readMap()
+{
+    if (!mFile.open(QFile::ReadOnly))
+        return 0;
+
+    uchar *mapped = mFile.map(0, mFile.size());
+    if (!mapped)
+        return 0;
+
+    mData = QByteArray::fromRawData(reinterpret_cast<const char*>(mapped),
+                                    mFile.size());
+    QDataStream in(mData);
+    in.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version;
+    quint8 byteOrder;
+    in >> magic >> version >> byteOrder;
+
+    if (in.status() != QDataStream::Ok || magic != MAGIC ||
+            version != VERSION || byteOrder != QSysInfo::ByteOrder)
+        return 0;
+
+    qint32 orientation, width, height, tileWidth, tileHeight;
+    QColor backgroundColor;
+    in >> orientation >> width >> height >> tileWidth >> tileHeight
+       >> backgroundColor;
+
+    if (in.status() != QDataStream::Ok)
+        return 0;
+
+    Map *map = new Map(static_cast<Map::Orientation>(orientation),
+                       width, height, tileWidth, tileHeight);
+    map->setBackgroundColor(backgroundColor);
+    readProperties(in, map);
+
+    // The map does not own its tilesets
+    QList<Tileset*> tilesets;
+    bool ok = true;
+
+    qint32 tilesetCount;
+    in >> tilesetCount;
+    for (int i = 0; i < tilesetCount && ok; ++i) {
+        if (Tileset *tileset = readTileset(in)) {
+            tilesets.append(tileset);
+            mTileCounts.append(tileset->tileCount());
+            map->addTileset(tileset);
+        } else {
+            ok = false;
+        }
+    }
+
+    const CellReader cells(tilesets, mTileCounts);
+
+    qint32 layerCount;
+    in >> layerCount;
+    for (int i = 0; i < layerCount && ok; ++i) {
+        qint64 cellOffset = -1;
+        if (Layer *layer = readLayer(in, mData, cells, cellOffset)) {
+            map->addLayer(layer);
+            if (cellOffset != -1)
+                mCellOffsets.insert(static_cast<TileLayer*>(layer), cellOffset);
+        } else {
+            ok = false;
+        }
+    }
+
+    if (!ok || in.status() != QDataStream::Ok) {
+        qDeleteAll(tilesets);
+        delete map;
+        mCellOffsets.clear();
+        return 0;
+    }
+
+    mMap = map;
+    return map;
+}
+
+/**
+ * Reads the cells of the given tile \a layers within \a rect, which is in
+ * map tile coordinates. The layers need to be part of the map returned by
+ * readMap(). Returns false when the cells refer to unknown tiles.
+ */
+bool CompiledMap::readCells(const QList<TileLayer*> &layers, const QRect &rect)
+{
+    // External tilesets may have been replaced since the map was read
+    const CellReader cells(mMap->tilesets(), mTileCounts);
+
+    foreach (TileLayer *layer, layers) {
+        const qint64 cellOffset = mCellOffsets.value(layer, -1);
+        if (cellOffset == -1)
+            continue;
+
+        const QRect layerRect(0, 0, layer->width(), layer->height());
+        const QRect area = rect.translated(-layer->position()) & layerRect;
+        if (area.isEmpty())
+            continue;
+
+        // Layers that are read completely are filled in the dense grid
+        if (area == layerRect && layer->isSparse())
+            layer->setSparse(false);
+
+        // Sparse layers are a lot faster to change in bulk, so their cells
+        // are collected in a separate layer first
+        QScopedPointer<TileLayer> buffer;
+        TileLayer *target = layer;
+        QPoint origin;
+
+        if (layer->isSparse()) {
+            buffer.reset(new TileLayer(QString(), 0, 0,
+                                       area.width(), area.height()));
+            target = buffer.data();
+            origin = area.topLeft();
+        }
+
+        // The cells are read straight from the mapped file
+        const quint32 *gids = reinterpret_cast<const quint32*>(
+                    mData.constData() + cellOffset);
+
+        for (int y = area.top(); y <= area.bottom(); ++y) {
+            const quint32 *gid = gids + y * layer->width() + area.left();
+
+            for (int x = area.left(); x <= area.right(); ++x, ++gid) {
+                if (!*gid)
+                    continue;
+
+                Cell cell;
+                if (!cells.gidToCell(*gid, cell))
+                    return false;
+
+                target->setCell(x - origin.x(), y - origin.y(), cell);
+            }
+        }
+
+        if (buffer)
+            layer->setCells(area.x(), area.y(), buffer.data());
+    }
+
+    return true;
+}
+
+/**
+ * Reads all cells of the given tile \a layers.
+ */
+bool CompiledMap::readCells(const QList<TileLayer*> &layers)
+{
+    QRect bounds;
+    foreach (const TileLayer *layer, layers)
+        bounds |= layer->bounds();
+
+    return readCells(layers, bounds);
+}
+
+/**
+ * Returns the name of the compiled map file within \a location for the map
+ * at \a url. The \a validator identifies the version of the map, for example
+ * by its HTTP entity tag.
+ *
+ * The name starts with a hash of the URL, followed by a hash of the
+ * validator, so that the files of other versions of the same map can be
+ * found.
+ */
+QString CompiledMap::fileName(const QString &location,
+                              const QUrl &url,
+                              const QByteArray &validator)
+{
+    const QByteArray urlHash =
+            QCryptographicHash::hash(url.toEncoded(), QCryptographicHash::Sha1);
+    const QByteArray validatorHash =
+            QCryptographicHash::hash(validator, QCryptographicHash::Sha1);
+
+    return location + QLatin1Char('/') +
+            QString::fromLatin1(urlHash.toHex()) + QLatin1Char('-') +
+            QString::fromLatin1(validatorHash.toHex()) +
+            QLatin1String(".map");
+}
+
+/**
+ * Removes the compiled map files of the other versions of the map that is
+ * compiled to \a fileName, since they would otherwise stay around forever.
+ * Files that are still in use may fail to be removed on some platforms, in
+ * which case they are removed after the next version has been written.
+ */
+void CompiledMap::removeOtherVersions(const QString &fileName)
+{
+    const QFileInfo fileInfo(fileName);
+    const QString baseName = fileInfo.fileName();
+    const int separator = baseName.indexOf(QLatin1Char('-'));
+    if (separator == -1)
+        return;
+
+    const QStringList filters(baseName.left(separator + 1) + QLatin1String("*.map"));
+    QDir dir = fileInfo.dir();
+
+    foreach (const QString &name, dir.entryList(filters, QDir::Files))
+        if (name != baseName)
+            dir.remove(name);
+}
+
+/**
+ * Reads the compiled map from the given file. Returns 0 when the file does
+ * not exist, was written by an incompatible version or is corrupt.
+ */
+Map *CompiledMap::read(const QString &fileName)
+{
+    CompiledMap compiledMap(fileName);
+    Map *map = compiledMap.readMap();
+    if (!map)
+        return 0;
+
+    if (!compiledMap.readCells(map->tileLayers())) {
+        qDeleteAll(map->tilesets());
+        delete map;
+        return 0;
+    }
+
+    return map;
+}
+
+/**
+ * Writes the given \a map to a compiled map file. Returns whether the map
+ * could be written, which is not the case when it uses features that are not
+ * supported by the format, like tile images.
+ */
+bool CompiledMap::write(const Map *map, const QString &fileName)
+{
+    QSaveFile file(fileName);
+    if (!file.open(QFile::WriteOnly))
+        return false;
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_0);
+
+    out << MAGIC << VERSION << quint8(QSysInfo::ByteOrder);
+
+    out << qint32(map->orientation())
+        << qint32(map->width())
+        << qint32(map->height())
+        << qint32(map->tileWidth())
+        << qint32(map->tileHeight())
+        << map->backgroundColor();
+    writeProperties(out, map);
+
+    out << qint32(map->tilesetCount());
+    foreach (const Tileset *tileset, map->tilesets())
+        if (!writeTileset(out, tileset))
+            return false;
+
+    const CellWriter cells(map);
+
+    out << qint32(map->layerCount());
+    foreach (const Layer *layer, map->layers())
+        if (!writeLayer(out, layer, cells))
+            return false;
+
+    if (out.status() != QDataStream::Ok)
+        return false;
+
+    return file.commit();
+}
@@ -0,0 +1,83 @@
+/*
+ * Mana QML plugin
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MANA_COMPILEDMAP_H
+#define MANA_COMPILEDMAP_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+class QRect;
+class QUrl;
+
+namespace Tiled {
+class Map;
+class TileLayer;
+}
+
+namespace Mana {
+
+/**
+ * Reads and writes maps in a compact binary format, used to cache maps after
+ * they have been parsed from TMX once.
+ *
+ * The file starts with a header, followed by the map attributes, the tileset
+ * table and the layers. The cells of tile layers are stored as aligned arrays
+ * of global tile IDs in native byte order, which are read straight from the
+ * memory-mapped file.
+ *
+ * Only maps as read by a lazy Tiled::MapReader are supported, so external
+ * tilesets are stored by their file name and tileset images by their source.
+ *
+ * Large maps can be streamed. In that case, readMap() leaves the tile layers
+ * empty and keeps the file mapped, so that the cells of regions of the map
+ * can be read with readCells() when they are needed.
+ */
+class CompiledMap
+{
+public:
+    explicit CompiledMap(const QString &fileName);
+
+    Tiled::Map *readMap();
+    bool readCells(const QList<Tiled::TileLayer*> &layers,
+                   const QRect &rect);
+    bool readCells(const QList<Tiled::TileLayer*> &layers);
+
+    static QString fileName(const QString &location,
+                            const QUrl &url,
+                            const QByteArray &validator);
+    static void removeOtherVersions(const QString &fileName);
+
+    static Tiled::Map *read(const QString &fileName);
+    static bool write(const Tiled::Map *map, const QString &fileName);
+
+private:
+    QFile mFile;
+    QByteArray mData;
+    Tiled::Map *mMap;
+    QVector<int> mTileCounts;
+    QHash<const Tiled::TileLayer*, qint64> mCellOffsets;
+};
+
+} // namespace Mana
+
+#endif // MANA_COMPILEDMAP_H
@@ -32,6 +32,8 @@ ImageResource::ImageResource(const QUrl &url, QObject *parent)
     : Resource(url, parent)
     , mImage(0)
     , mTexture(0)
+    , mUploadAhead(false)
+    , mUploadQueued(false)
 {
     QString path = url.path(QUrl::FullyDecoded);
 
@@ -55,23 +57,132 @@ ImageResource::ImageResource(const QUrl &url, QObject *parent)
 
 ImageResource::~ImageResource()
 {
+    if (TextureUploadQueue *queue = TextureUploadQueue::instance())
+        queue->remove(this);
+
     delete mImage;
 
     if (mTexture)
         mTexture->deleteLater();
 }
 
+/**
+ * Returns the decoded image. Once the texture has been created the decoded
+ * image is released, so calling this function may need to decode it again.
+ */
+const QImage *ImageResource::image() const
+{
+    if (!mImage && !mData.isEmpty()) {
+        mImage = new QImage;
+        mImage->loadFromData(mData);
+    }
+
+    return mImage;
+}
+
+/**
+ * Returns a copy of the decoded image, without keeping the decoded image
+ * around when it had been released.
+ */
+QImage ImageResource::decodedImage() const
+{
+    if (mImage)
+        return *mImage;
+
+    return QImage::fromData(mData);
+}
+
+/**
+ * Releases the decoded image, when it can be decoded again.
+ */
+void ImageResource::releaseImage()
+{
+    if (mData.isEmpty())
+        return;
+
+    delete mImage;
+    mImage = 0;
+}
+
 /**
  * Returns the image as a scene graph texture.
  */
 QSGTexture *ImageResource::texture(const QQuickWindow *window) const
 {
-    if (!mTexture && mImage)
-        mTexture = window->createTextureFromImage(*mImage);
+    if (!mTexture && isReady()) {
+        createTexture(window);
+
+        // Needed before the upload queue got to it
+        if (TextureUploadQueue *queue = TextureUploadQueue::instance())
+            queue->remove(const_cast<ImageResource*>(this));
+    }
 
     return mTexture;
 }
 
+/**
+ * Has the texture uploaded by the TextureUploadQueue ahead of the image being
+ * drawn, right away or once the image has loaded.
+ *
+ * This is not done for every image, since tileset images that end up in the
+ * tileset atlas of a map do not need their own texture.
+ */
+void ImageResource::uploadAhead()
+{
+    mUploadAhead = true;
+
+    if (isReady())
+        enqueueUpload();
+}
+
+void ImageResource::enqueueUpload()
+{
+    if (mTexture || mUploadQueued)
+        return;
+
+    if (TextureUploadQueue *queue = TextureUploadQueue::instance()) {
+        queue->enqueue(this, 0, mSize.width() * mSize.height() * 4);
+        mUploadQueued = true;
+    }
+}
+
+QSGTexture *ImageResource::uploadTexture(int, QQuickWindow *window)
+{
+    if (!mTexture && isReady())
+        createTexture(window);
+
+    return mTexture;
+}
+
+/**
+ * Returns the number of bytes used by the encoded and decoded image.
+ */
+qint64 ImageResource::memoryUsage() const
+{
+    qint64 bytes = mData.size();
+    if (mImage)
+        bytes += mImage->byteCount();
+    return bytes;
+}
+
+qint64 ImageResource::textureMemoryUsage() const
+{
+    return mTexture ? qint64(mSize.width()) * mSize.height() * 4 : 0;
+}
+
+/**
+ * Creates the texture and releases the decoded image, which the texture
+ * keeps around by itself until it has been uploaded.
+ */
+void ImageResource::createTexture(const QQuickWindow *window) const
+{
+    mTexture = window->createTextureFromImage(*image());
+    mUploadQueued = false;
+
+    delete mImage;
+    mImage = 0;
+}
+
 void ImageResource::imageFinished()
 {
     QNetworkReply *reply = static_cast<QNetworkReply*>(sender());
@@ -84,7 +195,22 @@ void ImageResource::imageFinished()
         return;
     }
 
+    // The encoded data is kept, to be able to decode the image again after
+    // it has been released
+    mData = reply->readAll();
     mImage = new QImage;
-    bool success = mImage->loadFromData(reply->readAll());
+    bool success = mImage->loadFromData(mData);
+
+    if (success) {
+        mSize = mImage->size();
+
+        if (mUploadAhead)
+            enqueueUpload();
+    } else {
+        mData.clear();
+        delete mImage;
+        mImage = 0;
+    }
+
     setStatus(success ? Ready : Error);
 }
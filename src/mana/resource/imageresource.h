@@ -21,13 +21,18 @@
 
 #include "resource.h"
 
+#include "mana/textureuploadqueue.h"
+
+#include <QByteArray>
+#include <QSize>
+
 class QImage;
 class QQuickWindow;
 class QSGTexture;
 
 namespace Mana {
 
-class ImageResource : public Resource
+class ImageResource : public Resource, public TextureUploadQueue::Source
 {
     Q_OBJECT
 public:
@@ -35,15 +40,32 @@ public:
 
     ~ImageResource();
 
-    const QImage *image() const { return mImage; }
+    const QImage *image() const;
+    QImage decodedImage() const;
+    void releaseImage();
+    QSize size() const { return mSize; }
     QSGTexture *texture(const QQuickWindow *window) const;
 
+    void uploadAhead();
+
+    QSGTexture *uploadTexture(int index, QQuickWindow *window);
+
+    qint64 memoryUsage() const;
+    qint64 textureMemoryUsage() const;
+
 private slots:
     void imageFinished();
 
 private:
-    QImage *mImage;
+    void createTexture(const QQuickWindow *window) const;
+    void enqueueUpload();
+
+    QByteArray mData;
+    QSize mSize;
+    mutable QImage *mImage;
     mutable QSGTexture *mTexture;
+    bool mUploadAhead;
+    mutable bool mUploadQueued;
 };
 
 }
@@ -39,6 +39,7 @@ ImageSet::ImageSet(const QString &path,
     , mHeight(height)
 {
     mImage = ResourceManager::instance()->requestImage(path);
+    mImage->uploadAhead();
 }
 
 ImageSet::~ImageSet()
@@ -48,7 +49,7 @@ ImageSet::~ImageSet()
 
 QRectF ImageSet::clip(int index) const
 {
-    const int framesPerRow = mImage->image()->width() / mWidth;
+    const int framesPerRow = mImage->size().width() / mWidth;
     const int x = (index % framesPerRow) * mWidth;
     const int y = (index / framesPerRow) * mHeight;
     return QRectF(x, y, mWidth, mHeight);
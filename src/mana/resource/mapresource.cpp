@@ -20,33 +20,431 @@
 
 #include "mana/resourcemanager.h"
 
+#include "mana/resource/compiledmap.h"
 #include "mana/resource/imageresource.h"
+#include "mana/resource/tilesetresource.h"
 
 #include "tiled/map.h"
+#include "tiled/mapobject.h"
 #include "tiled/mapreader.h"
+#include "tiled/objectgroup.h"
 #include "tiled/tilelayer.h"
 #include "tiled/tileset.h"
 
+#include <QBuffer>
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QFileInfo>
+#include <QMutex>
 #include <QNetworkReply>
+#include <QPainter>
+#include <QQuickWindow>
+#include <QRunnable>
+#include <QScopedPointer>
+#include <QSet>
+#include <QSGTexture>
+#include <QtMath>
+
+#include <algorithm>
 
 namespace Mana {
 
+/**
+ * The maximum width and height of a tileset atlas texture. Tileset images
+ * that are larger than this keep using their own texture.
+ */
+static const int ATLAS_SIZE = 2048;
+
+/**
+ * The spacing between the tileset images in the atlas, to avoid texture
+ * sampling from neighbouring tilesets.
+ */
+static const int ATLAS_SPACING = 1;
+
+/**
+ * The number of cells from which on the tile layers of a map are streamed
+ * from the compiled map, rather than being kept in memory as a whole.
+ */
+static const int STREAMING_CELLS = 256 * 256;
+
+/**
+ * The width and height of the regions in which streamed maps are loaded.
+ */
+static const int REGION_SIZE = 32;
+
+/**
+ * The distance in tiles from the focus up to which the regions of streamed
+ * maps are loaded.
+ */
+static const int LOAD_DISTANCE = 40;
+
+/**
+ * The additional distance in tiles before loaded regions are unloaded again,
+ * to avoid repeatedly loading regions while moving back and forth.
+ */
+static const int UNLOAD_MARGIN = 32;
+
+/**
+ * The thread pool priority of parsing maps that are prefetched, which is
+ * lower than that of the maps that are needed right away.
+ */
+static const int PREFETCH_PRIORITY = -1;
+
+/**
+ * The maximum number of maps prefetched for the warps of a map.
+ */
+static const int MAX_PREFETCHED_MAPS = 8;
+
+/**
+ * The fraction of the memory budget of the resource manager beyond which no
+ * more maps are prefetched, leaving the rest for the resources in use.
+ */
+static const qreal PREFETCH_MEMORY_FRACTION = 0.5;
+
+static bool isCollisionLayer(const Tiled::Layer *layer)
+{
+    return layer->name().compare(QLatin1String("collision"),
+                                 Qt::CaseInsensitive) == 0;
+}
+
+static bool isWarp(const Tiled::MapObject *object)
+{
+    return object->type().compare(QLatin1String("warp"),
+                                  Qt::CaseInsensitive) == 0 ||
+            object->type().compare(QLatin1String("portal"),
+                                   Qt::CaseInsensitive) == 0;
+}
+
+static bool isStreamed(const Tiled::Map *map)
+{
+    return map->width() * map->height() >= STREAMING_CELLS;
+}
+
+/**
+ * The fraction of non-empty cells below which a tile layer is stored
+ * sparsely.
+ */
+static const qreal SPARSE_LAYER_FILL = 0.25;
+
+/**
+ * Switches the tile layers of the given \a map that are mostly empty to the
+ * sparse storage, which saves memory and lets drawing skip the empty parts.
+ */
+static void storeSparseLayers(Tiled::Map *map)
+{
+    foreach (Tiled::TileLayer *layer, map->tileLayers()) {
+        const int cellCount = layer->width() * layer->height();
+        const int maxUsed = cellCount * SPARSE_LAYER_FILL;
+        int used = 0;
+
+        Tiled::TileLayer::CellIterator iterator(layer, QRect(0, 0,
+                                                             layer->width(),
+                                                             layer->height()));
+        while (used <= maxUsed && iterator.next())
+            ++used;
+
+        if (used <= maxUsed)
+            layer->setSparse(true);
+    }
+}
+
+/**
+ * Lets the threads parsing maps know whether the MapResource they are
+ * parsing for still exists, and holds the parsed results until the GUI
+ * thread picks them up.
+ */
+class MapParseGuard
+{
+public:
+    struct Result
+    {
+        Tiled::Map *map;
+        CompiledMap *compiledMap;
+        QString error;
+    };
+
+    explicit MapParseGuard(MapResource *resource) : resource(resource) {}
+
+    QMutex mutex;
+    MapResource *resource;
+    QList<Result> results;
+};
+
+/**
+ * Parses a map on a thread of the global thread pool.
+ *
+ * When a compiled map location is set, maps are read from the compiled map
+ * cache when possible, and otherwise written to it after parsing. Large maps
+ * are streamed from the compiled map.
+ */
+class MapParseJob : public QRunnable
+{
+public:
+    MapParseJob(const QSharedPointer<MapParseGuard> &guard,
+                const QByteArray &data,
+                const QString &path)
+        : mGuard(guard)
+        , mData(data)
+        , mPath(path)
+    {}
+
+    void setCompiledMap(const QString &location,
+                        const QUrl &url,
+                        const QByteArray &validator);
+
+    void run();
+
+private:
+    Tiled::Map *readMap(QString &error, CompiledMap *&compiledMap);
+    Tiled::Map *readCompiledMap(const QString &fileName,
+                                CompiledMap *&compiledMap);
+
+    QSharedPointer<MapParseGuard> mGuard;
+    QByteArray mData;
+    QString mPath;
+
+    QString mCompiledMapLocation;
+    QUrl mUrl;
+    QByteArray mValidator;
+};
+
+void MapParseJob::setCompiledMap(const QString &location,
+                                 const QUrl &url,
+                                 const QByteArray &validator)
+{
+    mCompiledMapLocation = location;
+    mUrl = url;
+    mValidator = validator;
+}
+
+/**
+ * Reads the map, either from the compiled map cache or by parsing it. When
+ * the map is streamed, \a compiledMap is set to the compiled map from which
+ * its regions are read.
+ */
+Tiled::Map *MapParseJob::readMap(QString &error, CompiledMap *&compiledMap)
+{
+    QString compiledFileName;
+
+    if (!mCompiledMapLocation.isEmpty()) {
+        // Without a validator, the map is identified by its contents
+        QByteArray validator = mValidator;
+        if (validator.isEmpty())
+            validator = QCryptographicHash::hash(mData, QCryptographicHash::Sha1);
+
+        compiledFileName = CompiledMap::fileName(mCompiledMapLocation,
+                                                 mUrl, validator);
+
+        if (Tiled::Map *map = readCompiledMap(compiledFileName, compiledMap))
+            return map;
+    }
+
+    QBuffer buffer(&mData);
+    buffer.open(QIODevice::ReadOnly);
+
+    Tiled::MapReader reader;
+    reader.setLazy(true); // Don't have it load external resources immediately
+
+    Tiled::Map *map = reader.readMap(&buffer, mPath);
+    if (!map) {
+        error = reader.errorString();
+        return 0;
+    }
+
+    if (compiledFileName.isEmpty() ||
+            !CompiledMap::write(map, compiledFileName))
+        return map;
+
+    CompiledMap::removeOtherVersions(compiledFileName);
+
+    // Continue with the compiled map, so that the parsed cells do not need
+    // to stay in memory
+    if (isStreamed(map)) {
+        if (Tiled::Map *compiled = readCompiledMap(compiledFileName,
+                                                   compiledMap)) {
+            qDeleteAll(map->tilesets());
+            delete map;
+            map = compiled;
+        }
+    }
+
+    return map;
+}
+
+/**
+ * Reads the map from the compiled map cache. For streamed maps, only the
+ * collision layer is read completely and \a compiledMap is set.
+ */
+Tiled::Map *MapParseJob::readCompiledMap(const QString &fileName,
+                                         CompiledMap *&compiledMap)
+{
+    QScopedPointer<CompiledMap> compiled(new CompiledMap(fileName));
+    Tiled::Map *map = compiled->readMap();
+    if (!map)
+        return 0;
+
+    const bool streamed = isStreamed(map);
+    QList<Tiled::TileLayer*> layers;
+
+    foreach (Tiled::TileLayer *layer, map->tileLayers())
+        if (!streamed || isCollisionLayer(layer))
+            layers.append(layer);
+
+    if (!compiled->readCells(layers)) {
+        qDeleteAll(map->tilesets());
+        delete map;
+        return 0;
+    }
+
+    if (streamed)
+        compiledMap = compiled.take();
+
+    return map;
+}
+
+void MapParseJob::run()
+{
+    MapParseGuard::Result result;
+    result.compiledMap = 0;
+    result.map = readMap(result.error, result.compiledMap);
+    if (result.map)
+        storeSparseLayers(result.map);
+
+    QMutexLocker locker(&mGuard->mutex);
+    if (mGuard->resource) {
+        mGuard->results.append(result);
+        QMetaObject::invokeMethod(mGuard->resource, "parseFinished",
+                                  Qt::QueuedConnection);
+    } else {
+        if (result.map)
+            qDeleteAll(result.map->tilesets());
+        delete result.map;
+        delete result.compiledMap;
+    }
+}
+
 MapResource::MapResource(const QUrl &url,
                          const QString &path,
-                         QObject *parent)
+                         QObject *parent,
+                         bool prefetch)
     : Resource(url, parent)
     , mPath(QFileInfo(path).path())
+    , mPrefetch(prefetch)
     , mMap(0)
     , mCollisionLayer(0)
+    , mCompiledMap(0)
+    , mRegionColumns(0)
+    , mHasFocus(false)
+    , mPendingParses(0)
+    , mParseGuard(new MapParseGuard(this))
+    , mPrefetchRefs(0)
 {
     ResourceManager *resourceManager = ResourceManager::instance();
-    QNetworkReply *reply = resourceManager->requestFile(url);
+    QNetworkReply *reply = resourceManager->requestFile(
+                url, prefetch ? QNetworkRequest::LowPriority
+                              : QNetworkRequest::NormalPriority);
     connect(reply, SIGNAL(finished()), this, SLOT(mapFinished()));
+    connect(this, SIGNAL(refCountChanged()), this, SLOT(checkInUse()));
     setStatus(Loading);
 }
 
+MapResource::~MapResource()
+{
+    // Results that are still being parsed are dropped
+    {
+        QMutexLocker locker(&mParseGuard->mutex);
+        mParseGuard->resource = 0;
+
+        foreach (const MapParseGuard::Result &result, mParseGuard->results) {
+            if (result.map)
+                qDeleteAll(result.map->tilesets());
+            delete result.map;
+            delete result.compiledMap;
+        }
+        mParseGuard->results.clear();
+    }
+
+    delete mCompiledMap;
+
+    // The map owns its inline tilesets and the placeholders of external
+    // tilesets that were not replaced, but the external tilesets are shared
+    if (mMap) {
+        QSet<Tiled::Tileset*> sharedTilesets;
+        foreach (TilesetResource *tilesetResource, mTilesetResources)
+            sharedTilesets.insert(tilesetResource->tileset());
+
+        QList<Tiled::Tileset*> ownedTilesets;
+        foreach (Tiled::Tileset *tileset, mMap->tilesets())
+            if (!sharedTilesets.contains(tileset))
+                ownedTilesets.append(tileset);
+
+        delete mMap;
+        qDeleteAll(ownedTilesets);
+    }
+
+    if (TextureUploadQueue *queue = TextureUploadQueue::instance())
+        queue->remove(this);
+
+    foreach (QSGTexture *texture, mAtlasTextures)
+        if (texture)
+            texture->deleteLater();
+
+    // Each tileset holds a reference to its image
+    foreach (ImageResource *imageResource, mImageResources)
+        imageResource->decRef();
+
+    // The external tilesets are shared with other maps
+    foreach (TilesetResource *tilesetResource, mTilesetResources)
+        tilesetResource->decRef();
+
+    releasePrefetchedMaps();
+}
+
+/**
+ * Returns the given \a atlas as a scene graph texture.
+ */
+QSGTexture *MapResource::atlasTexture(int atlas, const QQuickWindow *window) const
+{
+    if (!mAtlasTextures.at(atlas)) {
+        createAtlasTexture(atlas, window);
+
+        // Needed before the upload queue got to it
+        if (TextureUploadQueue *queue = TextureUploadQueue::instance())
+            queue->remove(const_cast<MapResource*>(this), atlas);
+    }
+
+    return mAtlasTextures.at(atlas);
+}
+
+/**
+ * Returns the number of bytes used by the atlas images that have not been
+ * turned into a texture yet.
+ */
+qint64 MapResource::memoryUsage() const
+{
+    qint64 bytes = 0;
+    foreach (const QImage &image, mAtlasImages)
+        bytes += image.byteCount();
+
+    if (mMap)
+        foreach (const Tiled::TileLayer *layer, mMap->tileLayers())
+            bytes += layer->cellMemoryUsage();
+
+    return bytes;
+}
+
+qint64 MapResource::textureMemoryUsage() const
+{
+    qint64 bytes = 0;
+    foreach (const QSGTexture *texture, mAtlasTextures) {
+        if (texture) {
+            const QSize size = texture->textureSize();
+            bytes += qint64(size.width()) * size.height() * 4;
+        }
+    }
+    return bytes;
+}
+
 void MapResource::mapFinished()
 {
     QNetworkReply *reply = static_cast<QNetworkReply*>(sender());
@@ -59,76 +457,210 @@ void MapResource::mapFinished()
         return;
     }
 
-    Tiled::MapReader reader;
-    reader.setLazy(true); // Don't have it load external resources immediately
+    // The entity tag or modification time identifies the version of the map
+    // in the compiled map cache
+    QByteArray validator = reply->rawHeader("ETag");
+    if (validator.isEmpty())
+        validator = reply->rawHeader("Last-Modified");
+
+    // Parsing large maps takes a while, so it is done off the GUI thread
+    MapParseJob *job = new MapParseJob(mParseGuard, reply->readAll(),
+                                       mPath);
+    job->setCompiledMap(ResourceManager::instance()->compiledMapLocation(),
+                        url(), validator);
+    startParse(job);
+}
+
+/**
+ * Sets the \a position in pixels around which the regions of streamed maps
+ * are loaded, usually the position of the player. Regions that are far away
+ * from it are unloaded again.
+ */
+void MapResource::setFocus(const QPointF &position)
+{
+    mFocus = position;
+    mHasFocus = true;
+    updateStreamedRegions();
+}
 
-    mMap = reader.readMap(reply, mPath);
+/**
+ * Sets whether this map is only prefetched. Once a prefetched map is needed,
+ * its textures are uploaded and the maps its warps lead to are prefetched in
+ * turn.
+ */
+void MapResource::setPrefetch(bool prefetch)
+{
+    if (mPrefetch != prefetch) {
+        mPrefetch = prefetch;
+
+        if (!mPrefetch && isReady())
+            enqueueTextures();
+    }
+
+    // A map that is needed again prefetches the maps it had released
+    if (!mPrefetch && isReady())
+        prefetchWarpDestinations();
+}
+
+/**
+ * Returns whether this map is referenced by more than just the maps that
+ * prefetched it.
+ */
+bool MapResource::isInUse() const
+{
+    return refCount() > mPrefetchRefs;
+}
+
+/**
+ * Releases the prefetched maps once this map is no longer in use. Otherwise
+ * maps connected by warps would keep each other alive.
+ */
+void MapResource::checkInUse()
+{
+    if (!isInUse())
+        releasePrefetchedMaps();
+}
+
+/**
+ * Continues loading the map once it has been parsed. For streamed maps, the
+ * \a compiledMap is given from which the regions are read.
+ */
+void MapResource::mapParsed(Tiled::Map *map,
+                            CompiledMap *compiledMap,
+                            const QString &error)
+{
+    mMap = map;
     if (!mMap) {
-        qDebug() << "Failed to load map:" << reply->url() << "\n"
-                 << reader.errorString();
+        qDebug() << "Failed to load map:" << url() << "\n"
+                 << error;
         setStatus(Error);
         return;
     }
 
     foreach (Tiled::Layer *layer, mMap->layers()) {
         if (Tiled::TileLayer *tl = dynamic_cast<Tiled::TileLayer*>(layer)) {
-            if (tl->name().compare(QLatin1String("collision"), Qt::CaseInsensitive) == 0) {
+            if (isCollisionLayer(tl)) {
                 mCollisionLayer = tl;
                 continue;
             }
         }
     }
 
-    // Request the external tilesets that were not loaded yet
+    // Remember where the warps lead, to prefetch those maps once ready
+    foreach (const Tiled::ObjectGroup *objectGroup, mMap->objectGroups()) {
+        foreach (const Tiled::MapObject *object, objectGroup->objects()) {
+            if (!isWarp(object))
+                continue;
+
+            const QString destination =
+                    object->property(QLatin1String("DEST_MAP"));
+
+            if (!destination.isEmpty() &&
+                    !mWarpDestinations.contains(destination))
+                mWarpDestinations.append(destination);
+        }
+    }
+
+    if (compiledMap) {
+        mCompiledMap = compiledMap;
+
+        foreach (Tiled::TileLayer *layer, mMap->tileLayers())
+            if (!isCollisionLayer(layer))
+                mStreamedLayers.append(layer);
+
+        mRegionColumns = (mMap->width() + REGION_SIZE - 1) / REGION_SIZE;
+        const int regionRows = (mMap->height() + REGION_SIZE - 1) / REGION_SIZE;
+        mLoadedRegions.resize(mRegionColumns * regionRows);
+
+        updateStreamedRegions();
+    }
+
+    // Request the external tilesets, which are only placeholders so far
     foreach (Tiled::Tileset *tileset, mMap->tilesets()) {
-        if (!tileset->fileName().isEmpty()) {
-            ResourceManager *rm = ResourceManager::instance();
-            QNetworkReply *reply = rm->requestFile(tileset->fileName());
-            mPendingResources.append(reply);
-            connect(reply, SIGNAL(finished()), this, SLOT(tilesetFinished()));
-        } else if (!tileset->imageSource().isEmpty()) {
+        if (!tileset->fileName().isEmpty())
+            requestTileset(tileset);
+        else if (!tileset->imageSource().isEmpty())
             requestTilesetImage(tileset);
-        }
     }
 
     checkReady();
 }
 
-void MapResource::tilesetFinished()
+/**
+ * Requests the shared external tileset for the given \a placeholder, which
+ * is replaced once the tileset has been loaded.
+ */
+void MapResource::requestTileset(Tiled::Tileset *placeholder)
 {
-    QNetworkReply *reply = finishReply();
-    if (!mMap) // Ignore request when we already changed map again
-        return;
+    ResourceManager *rm = ResourceManager::instance();
+    TilesetResource *tilesetResource = rm->requestTileset(placeholder->fileName());
+    mTilesetResources.append(tilesetResource);
 
-    const QNetworkRequest request = reply->request();
-    const QString tilesetFilePath =
-            request.attribute(ResourceManager::requestedFileAttribute()).toString();
-    Q_ASSERT(!tilesetFilePath.isEmpty());
+    if (tilesetResource->status() == Resource::Loading) {
+        mPendingTilesets.insert(placeholder, tilesetResource);
+        connect(tilesetResource, SIGNAL(statusChanged(Resource::Status)),
+                this, SLOT(tilesetStatusChanged()), Qt::UniqueConnection);
+    } else {
+        tilesetLoaded(placeholder, tilesetResource);
+    }
+}
 
-    const int lastSlashPos = tilesetFilePath.lastIndexOf(QLatin1Char('/'));
-    const QString tilesetPath = tilesetFilePath.left(lastSlashPos);
+void MapResource::tilesetStatusChanged()
+{
+    TilesetResource *tilesetResource = static_cast<TilesetResource*>(sender());
+    tilesetResource->disconnect(this);
 
-    Tiled::MapReader reader;
-    reader.setLazy(true); // Don't have it load the tileset images immediately
+    // The same tileset may be referenced more than once
+    QMutableHashIterator<Tiled::Tileset*, TilesetResource*> it(mPendingTilesets);
+    while (it.hasNext()) {
+        it.next();
+        if (it.value() == tilesetResource) {
+            Tiled::Tileset *placeholder = it.key();
+            it.remove();
+            tilesetLoaded(placeholder, tilesetResource);
+        }
+    }
 
-    Tiled::Tileset *tileset = reader.readTileset(reply, tilesetPath);
+    checkReady();
+}
+
+/**
+ * Replaces the given \a placeholder by the shared tileset of the
+ * \a tilesetResource. When the tileset failed to load, the placeholder is
+ * kept.
+ */
+void MapResource::tilesetLoaded(Tiled::Tileset *placeholder,
+                                TilesetResource *tilesetResource)
+{
+    Tiled::Tileset *tileset = tilesetResource->tileset();
     if (!tileset) {
-        qDebug() << "Error reading tileset:" << tilesetFilePath << "\n"
-                 << reader.errorString();
-    } else {
-        if (!tileset->imageSource().isEmpty())
-            requestTilesetImage(tileset);
+        qDebug() << "Error loading tileset:" << tilesetResource->url();
+        return;
+    }
 
-        foreach (Tiled::Tileset *ts, mMap->tilesets()) {
-            if (ts->fileName() == tilesetFilePath) {
-                mMap->replaceTileset(ts, tileset);
-                delete ts;
-                break;
-            }
-        }
+    mMap->replaceTileset(placeholder, tileset);
+    delete placeholder;
+
+    if (!tileset->imageSource().isEmpty() && !mImageResources.contains(tileset))
+        requestTilesetImage(tileset);
+}
+
+/**
+ * Picks up the results of the parse jobs that have finished, in the order
+ * in which they finished.
+ */
+void MapResource::parseFinished()
+{
+    QList<MapParseGuard::Result> results;
+    {
+        QMutexLocker locker(&mParseGuard->mutex);
+        results.swap(mParseGuard->results);
     }
 
-    checkReady();
+    foreach (const MapParseGuard::Result &result, results) {
+        --mPendingParses;
+        mapParsed(result.map, result.compiledMap, result.error);
+    }
 }
 
 void MapResource::imageStatusChanged()
@@ -142,19 +674,80 @@ void MapResource::imageStatusChanged()
     checkReady();
 }
 
-QNetworkReply *MapResource::finishReply()
+/**
+ * Loads the regions of a streamed map around the focus and unloads the ones
+ * that are far away from it.
+ */
+void MapResource::updateStreamedRegions()
 {
-    QNetworkReply *reply = static_cast<QNetworkReply*>(sender());
-    reply->deleteLater();
-    mPendingResources.removeOne(reply);
-    return reply;
+    if (!mCompiledMap || !mHasFocus)
+        return;
+
+    const int focusX = qFloor(mFocus.x() / mMap->tileWidth());
+    const int focusY = qFloor(mFocus.y() / mMap->tileHeight());
+    const QRect loadArea(focusX - LOAD_DISTANCE, focusY - LOAD_DISTANCE,
+                         LOAD_DISTANCE * 2 + 1, LOAD_DISTANCE * 2 + 1);
+
+    if (loadArea == mLoadArea)
+        return;
+
+    mLoadArea = loadArea;
+    const QRect keepArea = loadArea.adjusted(-UNLOAD_MARGIN, -UNLOAD_MARGIN,
+                                             UNLOAD_MARGIN, UNLOAD_MARGIN);
+    bool changed = false;
+
+    for (int i = 0; i < mLoadedRegions.size(); ++i) {
+        const QRect region((i % mRegionColumns) * REGION_SIZE,
+                           (i / mRegionColumns) * REGION_SIZE,
+                           REGION_SIZE, REGION_SIZE);
+        const bool loaded = mLoadedRegions.testBit(i);
+
+        if (!loaded && region.intersects(loadArea)) {
+            if (!mCompiledMap->readCells(mStreamedLayers, region))
+                qWarning() << "Corrupt region in compiled map" << url();
+
+            mLoadedRegions.setBit(i);
+            changed = true;
+        } else if (loaded && !region.intersects(keepArea)) {
+            foreach (Tiled::TileLayer *layer, mStreamedLayers)
+                layer->erase(region.translated(-layer->position()));
+
+            mLoadedRegions.clearBit(i);
+            changed = true;
+        }
+    }
+
+    if (changed)
+        emit cellsChanged();
+}
+
+/**
+ * Starts the given parse \a job, normally on the global thread pool. The
+ * result is handed back to the GUI thread through parseFinished().
+ */
+void MapResource::startParse(MapParseJob *job)
+{
+    ++mPendingParses;
+    const int priority = mPrefetch ? PREFETCH_PRIORITY : 0;
+    ResourceManager::instance()->startParseJob(job, priority);
 }
 
 void MapResource::checkReady()
 {
     if (status() == Loading) {
-        if (mPendingResources.isEmpty() && mPendingImageResources.isEmpty())
+        if (mPendingTilesets.isEmpty() && mPendingParses == 0 &&
+                mPendingImageResources.isEmpty()) {
+            buildTilesetAtlas();
+
+            // Prefetched maps upload their textures once they are needed
+            if (!mPrefetch)
+                enqueueTextures();
+
             setStatus(Ready);
+
+            if (!mPrefetch)
+                prefetchWarpDestinations();
+        }
     }
 }
 
@@ -173,4 +766,187 @@ void MapResource::requestTilesetImage(Tiled::Tileset *tileset)
     }
 }
 
+static bool higherImage(const ImageResource *a, const ImageResource *b)
+{
+    return a->size().height() > b->size().height();
+}
+
+/**
+ * Packs the loaded tileset images into one or more atlas images, so that
+ * tiles from different tilesets can be drawn using the same texture.
+ */
+void MapResource::buildTilesetAtlas()
+{
+    QList<ImageResource*> images;
+
+    foreach (ImageResource *imageResource, mImageResources) {
+        if (!imageResource->isReady())
+            continue;
+
+        const QSize size = imageResource->size();
+        if (size.width() > ATLAS_SIZE || size.height() > ATLAS_SIZE)
+            continue;
+
+        // Several tilesets may share the same image
+        if (!images.contains(imageResource))
+            images.append(imageResource);
+    }
+
+    // An atlas only helps when there are multiple tileset images
+    if (images.size() < 2)
+        return;
+
+    // Place the images on shelves, starting with the highest images
+    std::sort(images.begin(), images.end(), higherImage);
+
+    QHash<const ImageResource*, AtlasLocation> imageLocations;
+    QVector<QSize> atlasSizes;
+    int x = 0;
+    int y = 0;
+    int shelfHeight = 0;
+
+    foreach (const ImageResource *image, images) {
+        const QSize size = image->size();
+
+        if (atlasSizes.isEmpty() || x + size.width() > ATLAS_SIZE) {
+            x = 0;
+            y += shelfHeight;
+            shelfHeight = 0;
+        }
+
+        if (atlasSizes.isEmpty() || y + size.height() > ATLAS_SIZE) {
+            atlasSizes.append(QSize());
+            x = 0;
+            y = 0;
+            shelfHeight = 0;
+        }
+
+        AtlasLocation location;
+        location.atlas = atlasSizes.size() - 1;
+        location.rect = QRect(QPoint(x, y), size);
+        imageLocations.insert(image, location);
+
+        QSize &atlasSize = atlasSizes.last();
+        atlasSize = atlasSize.expandedTo(QSize(x + size.width(),
+                                               y + size.height()));
+
+        x += size.width() + ATLAS_SPACING;
+        shelfHeight = qMax(shelfHeight, size.height() + ATLAS_SPACING);
+    }
+
+    mAtlasImages.resize(atlasSizes.size());
+    mAtlasTextures.fill(0, atlasSizes.size());
+
+    for (int i = 0; i < atlasSizes.size(); ++i) {
+        mAtlasImages[i] = QImage(atlasSizes.at(i),
+                                 QImage::Format_ARGB32_Premultiplied);
+        mAtlasImages[i].fill(Qt::transparent);
+    }
+
+    // The textures of the tileset images in the atlas are not needed, so
+    // they are not uploaded and their decoded images are released
+    foreach (ImageResource *image, images) {
+        const AtlasLocation &location = imageLocations[image];
+
+        QPainter painter(&mAtlasImages[location.atlas]);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.drawImage(location.rect.topLeft(), *image->image());
+        painter.end();
+
+        image->releaseImage();
+    }
+
+    QHashIterator<Tiled::Tileset*, ImageResource*> tilesets(mImageResources);
+    while (tilesets.hasNext()) {
+        tilesets.next();
+        const ImageResource *image = tilesets.value();
+        if (imageLocations.contains(image))
+            mAtlasLocations.insert(tilesets.key(), imageLocations.value(image));
+    }
+}
+
+/**
+ * Has the atlas textures and the textures of the tileset images that are not
+ * part of an atlas uploaded ahead of time.
+ */
+void MapResource::enqueueTextures()
+{
+    QHashIterator<Tiled::Tileset*, ImageResource*> tilesets(mImageResources);
+    while (tilesets.hasNext()) {
+        tilesets.next();
+        if (!mAtlasLocations.contains(tilesets.key()))
+            tilesets.value()->uploadAhead();
+    }
+
+    TextureUploadQueue *queue = TextureUploadQueue::instance();
+    if (!queue)
+        return;
+
+    for (int i = 0; i < mAtlasImages.size(); ++i)
+        if (!mAtlasTextures.at(i))
+            queue->enqueue(this, i, mAtlasImages.at(i).byteCount());
+}
+
+/**
+ * Prefetches the maps that the warps on this map lead to, so that using a
+ * warp does not need to wait for the next map to load. The prefetched maps
+ * are kept around as long as this map is in use.
+ */
+void MapResource::prefetchWarpDestinations()
+{
+    if (!isInUse() || !mPrefetchedMaps.isEmpty())
+        return;
+
+    ResourceManager *rm = ResourceManager::instance();
+    const qint64 budget = rm->memoryBudget() * PREFETCH_MEMORY_FRACTION;
+
+    foreach (const QString &destination, mWarpDestinations) {
+        if (mPrefetchedMaps.size() >= MAX_PREFETCHED_MAPS ||
+                rm->memoryUsage() >= budget)
+            break;
+
+        MapResource *map = rm->requestMap(destination, true);
+        if (map == this) {
+            map->decRef();
+            continue;
+        }
+
+        ++map->mPrefetchRefs;
+        mPrefetchedMaps.append(map);
+    }
+}
+
+void MapResource::releasePrefetchedMaps()
+{
+    // Releasing a map may release the maps it prefetched in turn
+    const QList<QPointer<MapResource> > maps = mPrefetchedMaps;
+    mPrefetchedMaps.clear();
+
+    // Prefetched maps may have been deleted already on shutdown
+    foreach (MapResource *map, maps) {
+        if (map) {
+            --map->mPrefetchRefs;
+            map->decRef();
+        }
+    }
+}
+
+QSGTexture *MapResource::uploadTexture(int index, QQuickWindow *window)
+{
+    if (!mAtlasTextures.at(index))
+        createAtlasTexture(index, window);
+
+    return mAtlasTextures.at(index);
+}
+
+/**
+ * Creates the texture for the given \a atlas and releases the atlas image,
+ * which the texture keeps around by itself until it has been uploaded.
+ */
+void MapResource::createAtlasTexture(int atlas, const QQuickWindow *window) const
+{
+    mAtlasTextures[atlas] = window->createTextureFromImage(mAtlasImages.at(atlas));
+    mAtlasImages[atlas] = QImage();
+}
+
 } // namespace Mana
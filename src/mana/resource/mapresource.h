@@ -21,10 +21,21 @@
 
 #include "resource.h"
 
+#include "mana/textureuploadqueue.h"
+
+#include <QBitArray>
 #include <QHash>
+#include <QImage>
+#include <QPointF>
+#include <QPointer>
+#include <QRect>
 #include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QVector>
 
-class QNetworkReply;
+class QQuickWindow;
+class QSGTexture;
 
 namespace Tiled {
 class Map;
@@ -34,38 +45,112 @@ class Tileset;
 
 namespace Mana {
 
+class CompiledMap;
 class ImageResource;
+class MapParseGuard;
+class MapParseJob;
+class TilesetResource;
 
-class MapResource : public Resource
+class MapResource : public Resource, public TextureUploadQueue::Source
 {
     Q_OBJECT
 
 public:
+    /**
+     * The location of a tileset image within one of the atlas textures.
+     */
+    struct AtlasLocation
+    {
+        AtlasLocation() : atlas(-1) {}
+
+        bool isNull() const { return atlas == -1; }
+
+        int atlas;
+        QRect rect;
+    };
+
     explicit MapResource(const QUrl &url,
                          const QString &path,
-                         QObject *parent = 0);
+                         QObject *parent = 0,
+                         bool prefetch = false);
+    ~MapResource();
 
     const Tiled::Map *map() const;
     const Tiled::TileLayer *collisionLayer() const;
     const ImageResource *tilesetImage(Tiled::Tileset *tileset) const;
 
+    AtlasLocation atlasLocation(Tiled::Tileset *tileset) const;
+    QSGTexture *atlasTexture(int atlas, const QQuickWindow *window) const;
+
+    QSGTexture *uploadTexture(int index, QQuickWindow *window);
+
+    qint64 memoryUsage() const;
+    qint64 textureMemoryUsage() const;
+
+    void setFocus(const QPointF &position);
+
+    bool isPrefetch() const;
+    void setPrefetch(bool prefetch);
+
+signals:
+    /**
+     * Emitted when regions of a streamed map have been loaded or unloaded.
+     * The changed cells are recorded by the tile layers that have change
+     * tracking enabled.
+     */
+    void cellsChanged();
+
 private slots:
     void mapFinished();
-    void tilesetFinished();
+    void parseFinished();
+    void tilesetStatusChanged();
     void imageStatusChanged();
+    void checkInUse();
 
 private:
-    QNetworkReply *finishReply();
+    void startParse(MapParseJob *job);
+    void mapParsed(Tiled::Map *map, CompiledMap *compiledMap,
+                   const QString &error);
+    void requestTileset(Tiled::Tileset *placeholder);
+    void tilesetLoaded(Tiled::Tileset *placeholder,
+                       TilesetResource *tilesetResource);
     void checkReady();
+    void updateStreamedRegions();
     void requestTilesetImage(Tiled::Tileset *tileset);
+    void buildTilesetAtlas();
+    void enqueueTextures();
+    bool isInUse() const;
+    void prefetchWarpDestinations();
+    void releasePrefetchedMaps();
+    void createAtlasTexture(int atlas, const QQuickWindow *window) const;
 
     QString mPath;
+    bool mPrefetch;
     Tiled::Map *mMap;
     Tiled::TileLayer *mCollisionLayer;
 
-    QList<QNetworkReply*> mPendingResources;
+    CompiledMap *mCompiledMap;
+    QList<Tiled::TileLayer*> mStreamedLayers;
+    QBitArray mLoadedRegions;
+    int mRegionColumns;
+    QPointF mFocus;
+    bool mHasFocus;
+    QRect mLoadArea;
+
+    int mPendingParses;
+    QSharedPointer<MapParseGuard> mParseGuard;
+    QList<TilesetResource*> mTilesetResources;
+    QHash<Tiled::Tileset*, TilesetResource*> mPendingTilesets;
     QSet<ImageResource*> mPendingImageResources;
     QHash<Tiled::Tileset*, ImageResource*> mImageResources;
+
+    QStringList mWarpDestinations;
+    QList<QPointer<MapResource> > mPrefetchedMaps;
+    int mPrefetchRefs;
+
+    QHash<Tiled::Tileset*, AtlasLocation> mAtlasLocations;
+    mutable QVector<QImage> mAtlasImages;
+    mutable QVector<QSGTexture*> mAtlasTextures;
 };
 
 inline const Tiled::Map *MapResource::map() const
@@ -74,9 +159,23 @@ inline const Tiled::Map *MapResource::map() const
 inline const Tiled::TileLayer *MapResource::collisionLayer() const
 { return mCollisionLayer; }
 
+/**
+ * Returns whether this map is only loaded ahead of time, because a warp on
+ * another map leads to it.
+ */
+inline bool MapResource::isPrefetch() const
+{ return mPrefetch; }
+
 inline const ImageResource *MapResource::tilesetImage(Tiled::Tileset *tileset) const
 { return mImageResources.value(tileset); }
 
+/**
+ * Returns the location of the image of the given \a tileset within the atlas
+ * textures, or a null location when the tileset is not part of an atlas.
+ */
+inline MapResource::AtlasLocation MapResource::atlasLocation(Tiled::Tileset *tileset) const
+{ return mAtlasLocations.value(tileset); }
+
 } // namespace Mana
 
 Q_DECLARE_METATYPE(Mana::MapResource*)
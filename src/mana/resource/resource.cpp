@@ -48,6 +48,11 @@ void Resource::setStatus(Status newStatus)
     if (newStatus != mStatus) {
         mStatus = newStatus;
         emit statusChanged(newStatus);
+
+        // A loaded resource may push the cache beyond its budget
+        if (mStatus == Ready)
+            if (ResourceManager *resourceManager = ResourceManager::instance())
+                resourceManager->scheduleEviction();
     }
 }
 
@@ -61,8 +66,10 @@ void Resource::decRef(OrphanPolicy orphanPolicy)
     if (mRefCount > 0)
         return;
 
-    if (orphanPolicy == DeleteLater)
+    if (orphanPolicy == DeleteLater) {
         mReleaseTime = QDateTime::currentMSecsSinceEpoch();
-    else
+        ResourceManager::instance()->scheduleEviction();
+    } else {
         ResourceManager::instance()->removeResource(this);
+    }
 }
@@ -66,6 +66,17 @@ public:
 
     bool isReady() const;
 
+    /**
+     * Returns the number of bytes of main memory used by this resource.
+     * Used by the ResourceManager to keep the cache within its budget.
+     */
+    virtual qint64 memoryUsage() const { return 0; }
+
+    /**
+     * Returns the number of bytes of texture memory used by this resource.
+     */
+    virtual qint64 textureMemoryUsage() const { return 0; }
+
 signals:
     void statusChanged(Resource::Status newStatus);
     void refCountChanged();
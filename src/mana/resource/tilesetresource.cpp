@@ -0,0 +1,175 @@
+/*
+ * Mana QML plugin
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tilesetresource.h"
+
+#include "mana/resourcemanager.h"
+
+#include "tiled/mapreader.h"
+#include "tiled/tile.h"
+#include "tiled/tileset.h"
+
+#include <QBuffer>
+#include <QDebug>
+#include <QFileInfo>
+#include <QMutex>
+#include <QNetworkReply>
+#include <QRunnable>
+
+namespace Mana {
+
+/**
+ * Lets the thread parsing a tileset know whether the TilesetResource it is
+ * parsing for still exists, and holds the parsed tileset until the GUI
+ * thread picks it up.
+ */
+class TilesetParseGuard
+{
+public:
+    explicit TilesetParseGuard(TilesetResource *resource)
+        : resource(resource)
+        , tileset(0)
+    {}
+
+    QMutex mutex;
+    TilesetResource *resource;
+    Tiled::Tileset *tileset;
+    QString error;
+};
+
+/**
+ * Parses an external tileset on a thread of the global thread pool.
+ */
+class TilesetParseJob : public QRunnable
+{
+public:
+    TilesetParseJob(const QSharedPointer<TilesetParseGuard> &guard,
+                    const QByteArray &data,
+                    const QString &path)
+        : mGuard(guard)
+        , mData(data)
+        , mPath(path)
+    {}
+
+    void run();
+
+private:
+    QSharedPointer<TilesetParseGuard> mGuard;
+    QByteArray mData;
+    QString mPath;
+};
+
+void TilesetParseJob::run()
+{
+    QBuffer buffer(&mData);
+    buffer.open(QIODevice::ReadOnly);
+
+    Tiled::MapReader reader;
+    reader.setLazy(true); // Don't have it load the tileset image immediately
+
+    Tiled::Tileset *tileset = reader.readTileset(&buffer, mPath);
+
+    QMutexLocker locker(&mGuard->mutex);
+    if (mGuard->resource) {
+        mGuard->tileset = tileset;
+        if (!tileset)
+            mGuard->error = reader.errorString();
+
+        QMetaObject::invokeMethod(mGuard->resource, "parseFinished",
+                                  Qt::QueuedConnection);
+    } else {
+        delete tileset;
+    }
+}
+
+TilesetResource::TilesetResource(const QUrl &url,
+                                 const QString &path,
+                                 QObject *parent)
+    : Resource(url, parent)
+    , mPath(QFileInfo(path).path())
+    , mTileset(0)
+    , mParseGuard(new TilesetParseGuard(this))
+{
+    ResourceManager *resourceManager = ResourceManager::instance();
+    QNetworkReply *reply = resourceManager->requestFile(url);
+    connect(reply, SIGNAL(finished()), this, SLOT(tilesetFinished()));
+    setStatus(Loading);
+}
+
+TilesetResource::~TilesetResource()
+{
+    // A tileset that is still being parsed is dropped
+    {
+        QMutexLocker locker(&mParseGuard->mutex);
+        mParseGuard->resource = 0;
+        delete mParseGuard->tileset;
+        mParseGuard->tileset = 0;
+    }
+
+    delete mTileset;
+}
+
+/**
+ * Returns an estimate of the number of bytes used by the tileset.
+ */
+qint64 TilesetResource::memoryUsage() const
+{
+    if (!mTileset)
+        return 0;
+
+    return sizeof(Tiled::Tileset)
+            + qint64(mTileset->tileCount()) * sizeof(Tiled::Tile);
+}
+
+void TilesetResource::tilesetFinished()
+{
+    QNetworkReply *reply = static_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+
+    if (reply->error() != QNetworkReply::NoError) {
+        qDebug() << "Failed to download tileset:" << reply->url() << "\n"
+                 << reply->errorString();
+        setStatus(Error);
+        return;
+    }
+
+    ResourceManager::instance()->startParseJob(
+                new TilesetParseJob(mParseGuard, reply->readAll(), mPath));
+}
+
+void TilesetResource::parseFinished()
+{
+    QString error;
+    {
+        QMutexLocker locker(&mParseGuard->mutex);
+        mTileset = mParseGuard->tileset;
+        mParseGuard->tileset = 0;
+        error = mParseGuard->error;
+    }
+
+    if (!mTileset) {
+        qDebug() << "Error reading tileset:" << url() << "\n"
+                 << error;
+        setStatus(Error);
+        return;
+    }
+
+    setStatus(Ready);
+}
+
+} // namespace Mana
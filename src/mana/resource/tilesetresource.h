@@ -0,0 +1,73 @@
+/*
+ * Mana QML plugin
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MANA_TILESETRESOURCE_H
+#define MANA_TILESETRESOURCE_H
+
+#include "resource.h"
+
+#include <QSharedPointer>
+
+namespace Tiled {
+class Tileset;
+}
+
+namespace Mana {
+
+class TilesetParseGuard;
+
+/**
+ * An external tileset, which is shared by all the maps that refer to it.
+ *
+ * The tileset is parsed on a thread of the global thread pool. Its image is
+ * not requested, since that is done by the maps using the tileset. Once
+ * ready, the tileset is not changed anymore.
+ */
+class TilesetResource : public Resource
+{
+    Q_OBJECT
+
+public:
+    explicit TilesetResource(const QUrl &url,
+                             const QString &path,
+                             QObject *parent = 0);
+    ~TilesetResource();
+
+    Tiled::Tileset *tileset() const;
+
+    qint64 memoryUsage() const;
+
+private slots:
+    void tilesetFinished();
+    void parseFinished();
+
+private:
+    QString mPath;
+    Tiled::Tileset *mTileset;
+    QSharedPointer<TilesetParseGuard> mParseGuard;
+};
+
+/**
+ * Returns the tileset, or 0 when it is not ready.
+ */
+inline Tiled::Tileset *TilesetResource::tileset() const
+{ return mTileset; }
+
+} // namespace Mana
+
+#endif // MANA_TILESETRESOURCE_H
@@ -20,19 +20,29 @@
 #include "resourcemanager.h"
 
 #include <QDateTime>
+#include <QDir>
+#include <QList>
 #include <QStandardPaths>
 #include <QNetworkConfigurationManager>
 #include <QNetworkDiskCache>
 #include <QNetworkReply>
 #include <QNetworkRequest>
+#include <QRunnable>
+#include <QThreadPool>
 #include <QDebug>
 
+#include <private/qguiapplication_p.h>
+#include <qpa/qplatformintegration.h>
+
 #include "mana/xmlreader.h"
 #include "mana/resourcelistmodel.h"
 
 #include "mana/resource/imageresource.h"
 #include "mana/resource/mapresource.h"
 #include "mana/resource/spritedef.h"
+#include "mana/resource/tilesetresource.h"
+
+#include <algorithm>
 
 using namespace Mana;
 
@@ -41,10 +51,27 @@ ResourceManager *ResourceManager::mInstance;
 // Time in milliseconds that an unused resource should stay in cache
 static const int CACHE_TIME = 30 * 1000;
 
+// Default amount of main and texture memory used by the resources, beyond
+// which unused resources are evicted from the cache
+static const int DEFAULT_MEMORY_BUDGET = 64 * 1024 * 1024;
+static const int DEFAULT_TEXTURE_MEMORY_BUDGET = 128 * 1024 * 1024;
+
+static bool releasedBefore(const Resource *a, const Resource *b)
+{
+    return a->releaseTime() < b->releaseTime();
+}
+
 ResourceManager::ResourceManager(QObject *parent)
     : QObject(parent)
     , mPathsLoaded(false)
     , mResourceListModel(new ResourceListModel(this))
+    , mMemoryBudget(DEFAULT_MEMORY_BUDGET)
+    , mTextureMemoryBudget(DEFAULT_TEXTURE_MEMORY_BUDGET)
+    , mEvictionScheduled(false)
+    , mThreadedParsing(false)
+    , mCacheHits(0)
+    , mCacheMisses(0)
+    , mEvictedResources(0)
 {
     // TODO: This takes about 400 ms on my system. Doing it here prevents
     // experiencing this hickup later on when the the network access manager is
@@ -58,16 +85,26 @@ ResourceManager::ResourceManager(QObject *parent)
             QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
 
     if (!cacheLocation.isEmpty()) {
-        cacheLocation += QLatin1String("/httpCache");
-
         QNetworkDiskCache *diskCache = new QNetworkDiskCache(this);
-        diskCache->setCacheDirectory(cacheLocation);
+        diskCache->setCacheDirectory(cacheLocation + QLatin1String("/httpCache"));
         mNetworkAccessManager.setCache(diskCache);
+
+        // Parsed maps are cached in a binary format to speed up loading
+        mCompiledMapLocation = cacheLocation + QLatin1String("/maps");
+        QDir().mkpath(mCompiledMapLocation);
     } else {
         qWarning() << "CacheLocation is not supported on this platform, "
                       "no disk cache is used!";
     }
 
+    // Parsing maps and tilesets creates pixmaps for the tiles, which not all
+    // platforms support outside of the GUI thread
+    if (QPlatformIntegration *integration =
+            QGuiApplicationPrivate::platformIntegration()) {
+        mThreadedParsing = integration->hasCapability(
+                    QPlatformIntegration::ThreadedPixmaps);
+    }
+
     Q_ASSERT(!mInstance);
     mInstance = this;
 }
@@ -76,13 +113,15 @@ ResourceManager::~ResourceManager()
 {
     QMutableHashIterator<QUrl, Resource *> iterator(mResources);
 
-    // Sprite definitions have to be cleaned before the images
+    // Sprite definitions and maps have to be cleaned before the tilesets
+    // and images
     while (iterator.hasNext()) {
         Resource *resource = iterator.next().value();
 
-        if (SpriteDefinition *s = dynamic_cast<SpriteDefinition*>(resource)) {
+        if (!qobject_cast<ImageResource*>(resource) &&
+                !qobject_cast<TilesetResource*>(resource)) {
             iterator.remove();
-            delete s;
+            delete resource;
         }
     }
 
@@ -161,11 +200,13 @@ QNetworkReply *ResourceManager::requestFile(const QString &fileName)
     return mNetworkAccessManager.get(request);
 }
 
-QNetworkReply *ResourceManager::requestFile(const QUrl &url)
+QNetworkReply *ResourceManager::requestFile(const QUrl &url,
+                                            QNetworkRequest::Priority priority)
 {
     QNetworkRequest request(url);
     request.setAttribute(QNetworkRequest::CacheLoadControlAttribute,
                          QNetworkRequest::PreferCache);
+    request.setPriority(priority);
 
     return mNetworkAccessManager.get(request);
 }
@@ -187,9 +228,139 @@ void ResourceManager::cleanUpResources()
     foreach (Resource *resource, mResources)
         if (resource->refCount() == 0 && resource->releaseTime() < releaseTime)
             removeResource(resource);
+
+    evictResources();
 }
 
-MapResource *ResourceManager::requestMap(const QString &path)
+void ResourceManager::setMemoryBudget(int bytes)
+{
+    if (mMemoryBudget == bytes)
+        return;
+
+    mMemoryBudget = bytes;
+    scheduleEviction();
+    emit memoryBudgetChanged();
+}
+
+void ResourceManager::setTextureMemoryBudget(int bytes)
+{
+    if (mTextureMemoryBudget == bytes)
+        return;
+
+    mTextureMemoryBudget = bytes;
+    scheduleEviction();
+    emit textureMemoryBudgetChanged();
+}
+
+/**
+ * Returns the fraction of resource requests that could be served by an
+ * already existing resource.
+ */
+qreal ResourceManager::cacheHitRate() const
+{
+    const int requests = mCacheHits + mCacheMisses;
+    return requests > 0 ? qreal(mCacheHits) / requests : 0;
+}
+
+qint64 ResourceManager::memoryUsage() const
+{
+    qint64 bytes = 0;
+    foreach (const Resource *resource, mResources)
+        bytes += resource->memoryUsage();
+    return bytes;
+}
+
+qint64 ResourceManager::textureMemoryUsage() const
+{
+    qint64 bytes = 0;
+    foreach (const Resource *resource, mResources)
+        bytes += resource->textureMemoryUsage();
+    return bytes;
+}
+
+/**
+ * Schedules a check of the memory used by the resources. Called when a
+ * resource is no longer used or when its memory usage may have grown.
+ */
+void ResourceManager::scheduleEviction()
+{
+    if (mEvictionScheduled)
+        return;
+
+    mEvictionScheduled = true;
+    QMetaObject::invokeMethod(this, "evictResources", Qt::QueuedConnection);
+}
+
+/**
+ * Starts the given parse \a job on the global thread pool. When the platform
+ * does not support creating pixmaps outside of the GUI thread, the job is
+ * run right away instead. Either way the job reports its result through a
+ * queued call.
+ */
+void ResourceManager::startParseJob(QRunnable *job, int priority)
+{
+    if (mThreadedParsing) {
+        QThreadPool::globalInstance()->start(job, priority);
+        return;
+    }
+
+    job->run();
+    if (job->autoDelete())
+        delete job;
+}
+
+/**
+ * Removes unused resources, least recently used first, until the memory
+ * they use fits within the budgets. Resources that are still in use are
+ * never evicted, so the budgets may still be exceeded.
+ */
+void ResourceManager::evictResources()
+{
+    mEvictionScheduled = false;
+
+    qint64 memory = memoryUsage();
+    qint64 textureMemory = textureMemoryUsage();
+    const int evictedBefore = mEvictedResources;
+
+    // Evicting a resource may release others, like the images of a sprite
+    while (memory > mMemoryBudget || textureMemory > mTextureMemoryBudget) {
+        QList<Resource*> unused;
+        foreach (Resource *resource, mResources)
+            if (resource->refCount() == 0 && resource->status() != Resource::Loading)
+                unused.append(resource);
+
+        if (unused.isEmpty())
+            break;
+
+        std::sort(unused.begin(), unused.end(), releasedBefore);
+
+        foreach (Resource *resource, unused) {
+            if (memory <= mMemoryBudget && textureMemory <= mTextureMemoryBudget)
+                break;
+
+            memory -= resource->memoryUsage();
+            textureMemory -= resource->textureMemoryUsage();
+            removeResource(resource);
+            ++mEvictedResources;
+        }
+
+        // Update the usage for the resources that have been released
+        memory = memoryUsage();
+        textureMemory = textureMemoryUsage();
+    }
+
+    if (mEvictedResources != evictedBefore)
+        emit cacheStatisticsChanged();
+}
+
+/**
+ * Requests the map located at \a path, relative from the maps directory.
+ *
+ * When \a prefetch is true, a map that is not loaded yet is loaded at low
+ * priority, since it is not needed right away. Requesting the map again
+ * without \a prefetch turns it into a regular map.
+ */
+MapResource *ResourceManager::requestMap(const QString &path, bool prefetch)
 {
     QString fullPath = QLatin1String("maps/");
     fullPath += path;
@@ -201,12 +372,16 @@ MapResource *ResourceManager::requestMap(const QString &path)
     const QUrl url = resolve(fullPath);
     MapResource *map = find<MapResource>(url);
     if (!map) {
-        map = new MapResource(url, fullPath, this);
+        map = new MapResource(url, fullPath, this, prefetch);
         mResources.insert(url, map);
         mResourceListModel->addResource(map);
     }
 
+    // The map needs to be in use before it prefetches its own warps
     map->incRef();
+    if (!prefetch)
+        map->setPrefetch(false);
+
     return map;
 }
 
@@ -241,3 +416,22 @@ ImageResource *ResourceManager::requestImage(const QString &path)
     image->incRef();
     return image;
 }
+
+/**
+ * Requests the external tileset located at \a path, relative from the data
+ * URL. The tileset is shared by all maps that refer to it.
+ */
+TilesetResource *ResourceManager::requestTileset(const QString &path)
+{
+    const QUrl url = resolve(path);
+
+    TilesetResource *tileset = find<TilesetResource>(url);
+    if (!tileset) {
+        tileset = new TilesetResource(url, path, this);
+        mResources.insert(url, tileset);
+        mResourceListModel->addResource(tileset);
+    }
+
+    tileset->incRef();
+    return tileset;
+}
@@ -24,6 +24,8 @@
 #include <QNetworkAccessManager>
 #include <QNetworkRequest>
 
+class QRunnable;
+
 namespace Mana {
 
 class ImageResource;
@@ -31,6 +33,7 @@ class MapResource;
 class Resource;
 class ResourceListModel;
 class SpriteDefinition;
+class TilesetResource;
 
 /**
  * This is meant to be a convenient abstraction on top of QNetworkAccessManager
@@ -46,6 +49,13 @@ class ResourceManager : public QObject
 
     Q_PROPERTY(Mana::ResourceListModel *resourceListModel READ resourceListModel CONSTANT)
 
+    Q_PROPERTY(int memoryBudget READ memoryBudget WRITE setMemoryBudget NOTIFY memoryBudgetChanged)
+    Q_PROPERTY(int textureMemoryBudget READ textureMemoryBudget WRITE setTextureMemoryBudget NOTIFY textureMemoryBudgetChanged)
+    Q_PROPERTY(int cacheHits READ cacheHits NOTIFY cacheStatisticsChanged)
+    Q_PROPERTY(int cacheMisses READ cacheMisses NOTIFY cacheStatisticsChanged)
+    Q_PROPERTY(qreal cacheHitRate READ cacheHitRate NOTIFY cacheStatisticsChanged)
+    Q_PROPERTY(int evictedResources READ evictedResources NOTIFY cacheStatisticsChanged)
+
 public:
     enum CustomAttribute {
         RequestedFile = QNetworkRequest::User
@@ -63,38 +73,66 @@ public:
 
     ResourceListModel *resourceListModel() const;
 
+    int memoryBudget() const;
+    void setMemoryBudget(int bytes);
+
+    int textureMemoryBudget() const;
+    void setTextureMemoryBudget(int bytes);
+
+    int cacheHits() const;
+    int cacheMisses() const;
+    qreal cacheHitRate() const;
+    int evictedResources() const;
+
+    Q_INVOKABLE qint64 memoryUsage() const;
+    Q_INVOKABLE qint64 textureMemoryUsage() const;
+
     QString path(const QString &key, const QString &value = QString()) const;
     QString spritePath() const;
     QString itemIconsPrefix() const;
 
     QUrl resolve(const QString &path) const;
 
+    QString compiledMapLocation() const;
+
     QNetworkReply *requestFile(const QString &fileName);
-    QNetworkReply *requestFile(const QUrl &url);
+    QNetworkReply *requestFile(const QUrl &url,
+                               QNetworkRequest::Priority priority =
+                                   QNetworkRequest::NormalPriority);
 
     void removeResource(Resource *resource);
 
     Q_INVOKABLE void cleanUpResources();
 
-    MapResource *requestMap(const QString &path);
+    void scheduleEviction();
+
+    void startParseJob(QRunnable *job, int priority = 0);
+
+    MapResource *requestMap(const QString &path, bool prefetch = false);
     SpriteDefinition *requestSpriteDefinition(const QString &path,
                                               int variant = 0);
 
     ImageResource *requestImage(const QString &path);
+    TilesetResource *requestTileset(const QString &path);
 
     static QNetworkRequest::Attribute requestedFileAttribute();
 
 signals:
     void dataUrlChanged();
     void pathsLoadedChanged();
+    void memoryBudgetChanged();
+    void textureMemoryBudgetChanged();
+    void cacheStatisticsChanged();
 
 private slots:
     void pathsFileFinished();
+    void evictResources();
 
 private:
     template <class R> R *find(const QUrl &url);
 
     QString mDataUrl;
+    QString mCompiledMapLocation;
     QNetworkAccessManager mNetworkAccessManager;
     QHash<QUrl, Resource *> mResources;
 
@@ -103,6 +141,14 @@ private:
 
     ResourceListModel *mResourceListModel;
 
+    int mMemoryBudget;
+    int mTextureMemoryBudget;
+    bool mEvictionScheduled;
+    bool mThreadedParsing;
+    int mCacheHits;
+    int mCacheMisses;
+    int mEvictedResources;
+
     static ResourceManager *mInstance;
 };
 
@@ -119,6 +165,21 @@ inline bool ResourceManager::pathsLoaded() const
 inline ResourceListModel *ResourceManager::resourceListModel() const
 { return mResourceListModel; }
 
+inline int ResourceManager::memoryBudget() const
+{ return mMemoryBudget; }
+
+inline int ResourceManager::textureMemoryBudget() const
+{ return mTextureMemoryBudget; }
+
+inline int ResourceManager::cacheHits() const
+{ return mCacheHits; }
+
+inline int ResourceManager::cacheMisses() const
+{ return mCacheMisses; }
+
+inline int ResourceManager::evictedResources() const
+{ return mEvictedResources; }
+
 inline QString ResourceManager::path(const QString &key,
                                      const QString &value) const
 { return mPaths.value(key, value); }
@@ -136,12 +197,29 @@ inline QString ResourceManager::itemIconsPrefix() const
 inline QUrl ResourceManager::resolve(const QString &path) const
 { return QUrl(mDataUrl).resolved(QUrl(path)); }
 
+/**
+ * Returns the directory in which compiled maps are cached, or an empty string
+ * when there is no cache location on this platform.
+ */
+inline QString ResourceManager::compiledMapLocation() const
+{ return mCompiledMapLocation; }
+
 inline QNetworkRequest::Attribute ResourceManager::requestedFileAttribute()
 { return static_cast<QNetworkRequest::Attribute>(RequestedFile); }
 
 template <class R>
 inline R *ResourceManager::find(const QUrl &url)
-{ return static_cast<R*>(mResources.value(url)); }
+{
+    R *resource = static_cast<R*>(mResources.value(url));
+
+    if (resource)
+        ++mCacheHits;
+    else
+        ++mCacheMisses;
+
+    emit cacheStatisticsChanged();
+    return resource;
+}
 
 } // namespace Mana
 
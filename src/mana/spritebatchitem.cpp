@@ -0,0 +1,292 @@
+/*
+ * Mana Mobile
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spritebatchitem.h"
+
+#include "mana/renderstatistics.h"
+#include "mana/spriteitem.h"
+#include "mana/tilesnode.h"
+
+#include "mana/resource/animation.h"
+#include "mana/resource/imageresource.h"
+
+#include <QHash>
+#include <QtMath>
+
+#include <algorithm>
+
+namespace Mana {
+
+/**
+ * A sprite frame as positioned within the batch.
+ */
+struct BatchedSprite
+{
+    const ImageResource *image;
+    TileData data;
+    qreal bottom;
+    int group;
+    qreal z;
+    int index;
+};
+
+/**
+ * Returns whether the two lists of sprites draw exactly the same.
+ */
+static bool drawSame(const QVector<BatchedSprite> &a,
+                     const QVector<BatchedSprite> &b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (int i = 0; i < a.size(); ++i) {
+        const BatchedSprite &sa = a.at(i);
+        const BatchedSprite &sb = b.at(i);
+
+        if (sa.image != sb.image ||
+                sa.data.x != sb.data.x || sa.data.y != sb.data.y ||
+                sa.data.width != sb.data.width ||
+                sa.data.height != sb.data.height ||
+                sa.data.tx != sb.data.tx || sa.data.ty != sb.data.ty)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Sprites are drawn by the bottom of the item they are part of, which keeps
+ * the layers of a compound sprite together when several of them share the
+ * same bottom. Within that item, they are drawn by their z value.
+ */
+static bool drawnBefore(const BatchedSprite &a, const BatchedSprite &b)
+{
+    if (a.bottom != b.bottom)
+        return a.bottom < b.bottom;
+    if (a.group != b.group)
+        return a.group < b.group;
+    if (a.z != b.z)
+        return a.z < b.z;
+    return a.index < b.index;
+}
+
+/**
+ * Draws the sprites that are part of a single row of a SpriteBatchItem.
+ */
+class SpriteBatchRow : public QQuickItem
+{
+public:
+    explicit SpriteBatchRow(QQuickItem *parent)
+        : QQuickItem(parent)
+    {
+        setFlag(ItemHasContents);
+    }
+
+    void setSprites(const QVector<BatchedSprite> &sprites)
+    {
+        if (drawSame(mSprites, sprites))
+            return;
+
+        mSprites = sprites;
+        update();
+    }
+
+    QSGNode *updatePaintNode(QSGNode *node, UpdatePaintNodeData *);
+
+private:
+    QVector<BatchedSprite> mSprites;
+};
+
+/**
+ * Updates the nodes drawing the sprites. The existing nodes are reused in
+ * order, so that moving and animating sprites only rewrites their vertices.
+ */
+QSGNode *SpriteBatchRow::updatePaintNode(QSGNode *node, UpdatePaintNodeData *)
+{
+    RenderTimer timer(window());
+
+    if (!node)
+        node = new QSGNode;
+
+    QSGNode *child = node->firstChild();
+
+    // Consecutive sprites using the same image are drawn by the same node
+    const ImageResource *image = 0;
+    QSGTexture *texture = 0;
+    QVector<TileData> tileData;
+
+    for (int i = 0; i <= mSprites.size(); ++i) {
+        const bool end = i == mSprites.size();
+
+        if (end || mSprites.at(i).image != image ||
+                tileData.size() == TilesNode::MAX_TILES) {
+            if (!tileData.isEmpty()) {
+                if (child) {
+                    TilesNode *tilesNode = static_cast<TilesNode*>(child);
+                    tilesNode->setTexture(texture);
+                    tilesNode->setTileData(tileData);
+                    child = child->nextSibling();
+                } else {
+                    node->appendChildNode(new TilesNode(texture, tileData));
+                }
+                tileData.clear();
+            }
+
+            if (end)
+                break;
+
+            image = mSprites.at(i).image;
+            texture = image->texture(window());
+        }
+
+        if (texture)
+            tileData.append(mSprites.at(i).data);
+    }
+
+    // Remove the nodes that are no longer needed
+    while (child) {
+        QSGNode *next = child->nextSibling();
+        node->removeChildNode(child);
+        delete child;
+        child = next;
+    }
+
+    return node;
+}
+
+
+SpriteBatchItem::SpriteBatchItem(QQuickItem *parent)
+    : QQuickItem(parent)
+    , mRowHeight(32)
+{
+}
+
+SpriteBatchItem::~SpriteBatchItem()
+{
+    qDeleteAll(mRows);
+}
+
+void SpriteBatchItem::setRowHeight(int rowHeight)
+{
+    rowHeight = qMax(1, rowHeight);
+    if (mRowHeight == rowHeight)
+        return;
+
+    mRowHeight = rowHeight;
+    polish();
+    emit rowHeightChanged();
+}
+
+void SpriteBatchItem::addSprite(SpriteItem *sprite)
+{
+    mSprites.append(sprite);
+    polish();
+}
+
+void SpriteBatchItem::removeSprite(SpriteItem *sprite)
+{
+    mSprites.removeOne(sprite);
+    polish();
+}
+
+void SpriteBatchItem::spriteChanged()
+{
+    polish();
+}
+
+/**
+ * Collects the current frame of all visible sprites and distributes them
+ * over the rows. Runs on the GUI thread right before the scene graph is
+ * synchronized.
+ */
+void SpriteBatchItem::updatePolish()
+{
+    QMap<int, QVector<BatchedSprite> > rows;
+    QHash<const QQuickItem*, int> groups;
+
+    for (int i = 0; i < mSprites.size(); ++i) {
+        SpriteItem *spriteItem = mSprites.at(i);
+        if (!spriteItem->isVisible())
+            continue;
+
+        const Frame *frame = spriteItem->currentFrame();
+        if (!frame)
+            continue;
+
+        const QPointF pos = spriteItem->mapToItem(this, QPointF());
+
+        // Sprites sharing a parent, like the equipment of a being, are
+        // grouped so that they are drawn together in the order of their slot
+        const QQuickItem *groupItem = spriteItem->parentItem();
+        if (!groupItem)
+            groupItem = spriteItem;
+
+        QHash<const QQuickItem*, int>::iterator group = groups.find(groupItem);
+        if (group == groups.end())
+            group = groups.insert(groupItem, groups.size());
+
+        const qreal groupBottom =
+                groupItem->mapToItem(this, QPointF(0, groupItem->height())).y();
+
+        BatchedSprite sprite;
+        sprite.image = frame->imageResource;
+        sprite.data.x = pos.x() + frame->offsetX;
+        sprite.data.y = pos.y() + frame->offsetY;
+        sprite.data.width = frame->clip.width();
+        sprite.data.height = frame->clip.height();
+        sprite.data.tx = frame->clip.x();
+        sprite.data.ty = frame->clip.y();
+        sprite.bottom = groupBottom;
+        sprite.group = group.value();
+        sprite.z = spriteItem->z();
+        sprite.index = i;
+
+        const int row = qFloor(sprite.bottom / mRowHeight);
+        rows[row].append(sprite);
+    }
+
+    // Remove the rows that no longer have any sprites
+    QMutableMapIterator<int, SpriteBatchRow*> it(mRows);
+    while (it.hasNext()) {
+        it.next();
+        if (!rows.contains(it.key())) {
+            delete it.value();
+            it.remove();
+        }
+    }
+
+    QMapIterator<int, QVector<BatchedSprite> > rowIt(rows);
+    while (rowIt.hasNext()) {
+        rowIt.next();
+
+        SpriteBatchRow *row = mRows.value(rowIt.key());
+        if (!row) {
+            row = new SpriteBatchRow(parentItem());
+            mRows.insert(rowIt.key(), row);
+        }
+
+        QVector<BatchedSprite> sprites = rowIt.value();
+        std::stable_sort(sprites.begin(), sprites.end(), drawnBefore);
+
+        row->setPosition(position());
+        row->setZ(rowIt.key() * mRowHeight + mRowHeight / 2.0);
+        row->setSprites(sprites);
+    }
+}
+
+} // namespace Mana
@@ -0,0 +1,87 @@
+/*
+ * Mana Mobile
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPRITEBATCHITEM_H
+#define SPRITEBATCHITEM_H
+
+#include <QList>
+#include <QMap>
+#include <QQuickItem>
+
+namespace Mana {
+
+class SpriteBatchRow;
+class SpriteItem;
+
+/**
+ * Draws the current frame of a number of SpriteItem instances using as few
+ * geometry nodes as possible.
+ *
+ * The sprites are sorted by the bottom of their parent item and divided into
+ * rows of rowHeight pixels. Sprites sharing a parent, like the layers of a
+ * compound sprite, stay together and are sorted by their z value. Each row is drawn by a separate item, which is created
+ * as a sibling of the batch and given a z value in the middle of the row.
+ * This keeps the sprites stacking correctly with other items depth-sorted by
+ * their y coordinate, like the fringe layer rows of a MapItem. Within a row,
+ * consecutive sprites sharing a texture are drawn by a single node.
+ *
+ * Only the position of the sprite items is taken into account. Their opacity
+ * and any other transformations are ignored.
+ */
+class SpriteBatchItem : public QQuickItem
+{
+    Q_OBJECT
+
+    Q_PROPERTY(int rowHeight READ rowHeight WRITE setRowHeight NOTIFY rowHeightChanged)
+
+public:
+    explicit SpriteBatchItem(QQuickItem *parent = 0);
+    ~SpriteBatchItem();
+
+    int rowHeight() const;
+    void setRowHeight(int rowHeight);
+
+    void addSprite(SpriteItem *sprite);
+    void removeSprite(SpriteItem *sprite);
+
+    /**
+     * Should be called when the frame, position or visibility of one of the
+     * sprites has changed. Schedules an update of the batch.
+     */
+    void spriteChanged();
+
+signals:
+    void rowHeightChanged();
+
+protected:
+    void updatePolish();
+
+private:
+    QList<SpriteItem*> mSprites;
+    QMap<int, SpriteBatchRow*> mRows;
+    int mRowHeight;
+};
+
+inline int SpriteBatchItem::rowHeight() const
+{
+    return mRowHeight;
+}
+
+} // namespace Mana
+
+#endif // SPRITEBATCHITEM_H
@@ -17,12 +17,16 @@
 
 #include "spriteitem.h"
 
+#include "mana/mapitem.h"
+#include "mana/renderstatistics.h"
 #include "mana/resourcemanager.h"
 
 #include "mana/resource/action.h"
 #include "mana/resource/animation.h"
 #include "mana/resource/imageresource.h"
 
+#include <QAbstractAnimation>
+#include <QCoreApplication>
 #include <QQuickWindow>
 #include <QSGGeometryNode>
 #include <QSGTextureMaterial>
@@ -35,6 +39,7 @@ class SubRectTextureNode : public QSGGeometryNode
 {
 public:
     SubRectTextureNode();
+    ~SubRectTextureNode();
 
     void setTexture(QSGTexture *texture);
     void setRects(const QRectF &rect, const QRectF &sourceRect);
@@ -55,6 +60,13 @@ SubRectTextureNode::SubRectTextureNode()
     setGeometry(&mGeometry);
     setMaterial(&mMaterial);
     setOpaqueMaterial(&mOpaqueMaterial);
+
+    RenderStatistics::add(RenderStatistics::NodesCreated, 1);
+}
+
+SubRectTextureNode::~SubRectTextureNode()
+{
+    RenderStatistics::add(RenderStatistics::NodesDestroyed, 1);
 }
 
 void SubRectTextureNode::setTexture(QSGTexture *texture)
@@ -84,6 +96,84 @@ void SubRectTextureNode::update()
     QSGTexture *texture = mMaterial.texture();
     QRectF sourceRect(texture->convertToNormalizedSourceRect(mSourceRect));
     QSGGeometry::updateTexturedRectGeometry(&mGeometry, mRect, sourceRect);
+
+    RenderStatistics::add(RenderStatistics::Vertices, 4);
+    RenderStatistics::add(RenderStatistics::BytesUploaded,
+                          4 * mGeometry.sizeOfVertex());
+}
+
+/**
+ * Advances all running sprites once per frame. Using a single clock keeps the
+ * sprites of a CompoundSprite in sync and avoids every running sprite having
+ * to schedule an update of itself each frame.
+ */
+class AnimationClock : public QAbstractAnimation
+{
+public:
+    static AnimationClock *instance();
+
+    int duration() const { return -1; }
+
+    void addSprite(SpriteItem *sprite);
+    void removeSprite(SpriteItem *sprite);
+
+protected:
+    void updateCurrentTime(int currentTime);
+
+private:
+    explicit AnimationClock(QObject *parent);
+
+    QList<SpriteItem*> mSprites;
+    int mLastTime;
+};
+
+AnimationClock::AnimationClock(QObject *parent)
+    : QAbstractAnimation(parent)
+    , mLastTime(0)
+{
+}
+
+AnimationClock *AnimationClock::instance()
+{
+    static QPointer<AnimationClock> clock;
+    if (!clock)
+        clock = new AnimationClock(QCoreApplication::instance());
+    return clock;
+}
+
+void AnimationClock::addSprite(SpriteItem *sprite)
+{
+    if (mSprites.contains(sprite))
+        return;
+
+    mSprites.append(sprite);
+
+    if (state() != Running) {
+        mLastTime = 0;
+        start();
+    }
+}
+
+void AnimationClock::removeSprite(SpriteItem *sprite)
+{
+    mSprites.removeOne(sprite);
+
+    if (mSprites.isEmpty())
+        stop();
+}
+
+void AnimationClock::updateCurrentTime(int currentTime)
+{
+    const int elapsed = currentTime - mLastTime;
+    mLastTime = currentTime;
+
+    if (elapsed <= 0)
+        return;
+
+    // Sprites may stop running while they are advanced
+    const QList<SpriteItem*> sprites = mSprites;
+    foreach (SpriteItem *sprite, sprites)
+        sprite->advance(elapsed);
 }
 
 } // anonymous namespace
@@ -100,6 +190,7 @@ SpriteItem::SpriteItem(QQuickItem *parent)
     , mFrameIndex(0)
     , mFrame(0)
     , mDisplayedFrame(0)
+    , mScheduledFrame(0)
     , mUnusedTime(0)
     , mRunning(false)
 {
@@ -108,6 +199,12 @@ SpriteItem::SpriteItem(QQuickItem *parent)
 
 SpriteItem::~SpriteItem()
 {
+    if (mRunning)
+        AnimationClock::instance()->removeSprite(this);
+
+    if (mBatch)
+        mBatch->removeSprite(this);
+
     if (mSprite)
         mSprite->decRef();
 }
@@ -142,13 +239,14 @@ void SpriteItem::reset()
     mFrameIndex = 0;
     mFrame = mAnimation->frame(0);
     mRunning = mAnimation->length() > 1;
+    mUnusedTime = 0;
 
-    if (mRunning) {
-        mTimer.start();
-        mUnusedTime = 0;
-    }
+    if (mRunning)
+        AnimationClock::instance()->addSprite(this);
+    else
+        AnimationClock::instance()->removeSprite(this);
 
-    update();
+    frameChanged();
 }
 
 void SpriteItem::setAction(const QString &actionName)
@@ -187,10 +285,16 @@ void SpriteItem::playAnimation(const Action *action)
 
 QSGNode *SpriteItem::updatePaintNode(QSGNode *node, UpdatePaintNodeData *)
 {
+    RenderTimer timer(window());
+
     SubRectTextureNode *n = static_cast<SubRectTextureNode *>(node);
 
-    if (mRunning)
-        advance();
+    // The batch takes care of drawing this sprite
+    if (mBatch) {
+        mDisplayedFrame = 0;
+        delete n;
+        return 0;
+    }
 
     if (mFrame != mDisplayedFrame) {
         mDisplayedFrame = mFrame;
@@ -215,9 +319,6 @@ QSGNode *SpriteItem::updatePaintNode(QSGNode *node, UpdatePaintNodeData *)
         n->setRects(rect, mFrame->clip);
     }
 
-    if (mRunning)
-        update();
-
     return n;
 }
 
@@ -236,6 +337,25 @@ void SpriteItem::setDirection(Action::SpriteDirection direction)
     emit directionChanged();
 }
 
+void SpriteItem::setBatch(SpriteBatchItem *batch)
+{
+    if (mBatch == batch)
+        return;
+
+    if (mBatch)
+        mBatch->removeSprite(this);
+
+    mBatch = batch;
+
+    if (mBatch)
+        mBatch->addSprite(this);
+
+    trackAncestors();
+    update();
+
+    emit batchChanged();
+}
+
 void SpriteItem::playAction(const QString &actionName)
 {
     setAction(actionName);
@@ -243,12 +363,54 @@ void SpriteItem::playAction(const QString &actionName)
         playAnimation(mAction);
 }
 
-void SpriteItem::advance()
+void SpriteItem::itemChange(ItemChange change, const ItemChangeData &value)
+{
+    if (change == ItemParentHasChanged && mBatch) {
+        trackAncestors();
+        notifyBatch();
+    }
+
+    QQuickItem::itemChange(change, value);
+}
+
+/**
+ * A batched sprite needs to let the batch know when it moved. Since there is
+ * no notification for changes to the position of parent items, the position
+ * and visibility of each item between this sprite and the batch is watched.
+ */
+void SpriteItem::trackAncestors()
 {
-    // TODO: Since every sprite item is keeping its own QElapsedTimer, there
-    // is a small chance that the frames of the sprites in a CompoundSprite
-    // will not match up.
-    mUnusedTime += mTimer.restart();
+    foreach (const QPointer<QQuickItem> &item, mTrackedItems)
+        if (item)
+            item->disconnect(this);
+    mTrackedItems.clear();
+
+    if (!mBatch)
+        return;
+
+    const QQuickItem *batchParent = mBatch->parentItem();
+
+    for (QQuickItem *item = this; item && item != batchParent;
+         item = item->parentItem()) {
+        connect(item, SIGNAL(xChanged()), SLOT(notifyBatch()));
+        connect(item, SIGNAL(yChanged()), SLOT(notifyBatch()));
+        connect(item, SIGNAL(visibleChanged()), SLOT(notifyBatch()));
+        mTrackedItems.append(item);
+    }
+
+    connect(this, SIGNAL(heightChanged()), SLOT(notifyBatch()));
+    connect(this, SIGNAL(zChanged()), SLOT(notifyBatch()));
+}
+
+void SpriteItem::notifyBatch()
+{
+    if (mBatch)
+        mBatch->spriteChanged();
+}
+
+void SpriteItem::advance(int elapsed)
+{
+    mUnusedTime += elapsed;
 
     while (mFrame->delay > 0 && mUnusedTime > mFrame->delay) {
         mUnusedTime -= mFrame->delay;
@@ -262,6 +424,52 @@ void SpriteItem::advance()
                 break;
         }
     }
+
+    // Sprites outside of the visible area of the map catch up on the first
+    // tick after they have become visible again
+    if (mFrame != mScheduledFrame && isOnScreen())
+        frameChanged();
+}
+
+/**
+ * Schedules the current frame to be drawn, either by this item or by its
+ * batch.
+ */
+void SpriteItem::frameChanged()
+{
+    mScheduledFrame = mFrame;
+
+    if (mBatch)
+        mBatch->spriteChanged();
+    else
+        update();
+}
+
+/**
+ * Returns whether the current frame intersects the visible area of the map
+ * this sprite is placed on. Sprites that are not on a map are always
+ * considered to be on screen.
+ */
+bool SpriteItem::isOnScreen() const
+{
+    if (!isVisible())
+        return false;
+
+    const MapItem *mapItem = 0;
+    for (QQuickItem *item = parentItem(); item && !mapItem;
+         item = item->parentItem()) {
+        mapItem = qobject_cast<MapItem*>(item);
+    }
+
+    if (!mapItem || mapItem->visibleArea().isEmpty())
+        return true;
+
+    const QRectF rect(mFrame->offsetX,
+                      mFrame->offsetY,
+                      mFrame->clip.width(),
+                      mFrame->clip.height());
+
+    return mapItem->visibleArea().intersects(mapRectToItem(mapItem, rect));
 }
 
 void SpriteItem::statusChanged(Resource::Status status)
@@ -21,9 +21,10 @@
 #include "mana/resource/action.h"
 #include "mana/resource/animation.h"
 #include "mana/resource/spritedef.h"
+#include "mana/spritebatchitem.h"
 
 #include <QQuickItem>
-#include <QElapsedTimer>
+#include <QPointer>
 
 namespace Mana {
 
@@ -34,6 +35,7 @@ class SpriteItem : public QQuickItem
     Q_PROPERTY(Mana::SpriteReference *spriteReference READ spriteRef WRITE setSpriteRef NOTIFY spriteRefChanged)
     Q_PROPERTY(QString action READ action WRITE setAction NOTIFY actionChanged)
     Q_PROPERTY(Mana::Action::SpriteDirection direction READ direction WRITE setDirection NOTIFY directionChanged)
+    Q_PROPERTY(Mana::SpriteBatchItem *batch READ batch WRITE setBatch NOTIFY batchChanged)
 
 public:
     explicit SpriteItem(QQuickItem *parent = 0);
@@ -51,22 +53,48 @@ public:
     void setDirection(Action::SpriteDirection direction);
     Action::SpriteDirection direction() const { return mDirection; }
 
+    /**
+     * When a batch is set, the sprite is drawn by the batch instead of
+     * creating its own geometry node.
+     */
+    void setBatch(SpriteBatchItem *batch);
+    SpriteBatchItem *batch() const { return mBatch; }
+
     Q_INVOKABLE void playAction(const QString &actionName);
 
+    /**
+     * Returns the frame that should currently be displayed. Used by
+     * SpriteBatchItem.
+     */
+    const Frame *currentFrame() const { return mFrame; }
+
+    /**
+     * Advances the animation by \a elapsed milliseconds. Called by the
+     * animation clock shared by all running sprites.
+     */
+    void advance(int elapsed);
+
     QSGNode *updatePaintNode(QSGNode *node, UpdatePaintNodeData *);
 
 signals:
     void spriteRefChanged();
     void actionChanged();
     void directionChanged();
+    void batchChanged();
+
+protected:
+    void itemChange(ItemChange change, const ItemChangeData &value);
 
 private slots:
-    void advance();
     void statusChanged(Resource::Status status);
+    void notifyBatch();
 
 private:
     void playAnimation(const Action *action);
     void updateSize();
+    void trackAncestors();
+    void frameChanged();
+    bool isOnScreen() const;
 
     SpriteReference *mSpriteRef;
     QString mActionName;
@@ -80,9 +108,12 @@ private:
     int mFrameIndex;
     const Frame *mFrame;
     const Frame *mDisplayedFrame;
-    QElapsedTimer mTimer;
-    qint64 mUnusedTime;
+    const Frame *mScheduledFrame;
+    int mUnusedTime;
     bool mRunning;
+
+    QPointer<SpriteBatchItem> mBatch;
+    QList<QPointer<QQuickItem> > mTrackedItems;
 };
 
 } // namespace Mana
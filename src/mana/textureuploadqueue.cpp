@@ -0,0 +1,156 @@
+/*
+ * Mana Mobile
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "textureuploadqueue.h"
+
+#include "mana/renderstatistics.h"
+
+#include <QMutexLocker>
+#include <QQuickWindow>
+#include <QSGTexture>
+
+using namespace Mana;
+
+/**
+ * The default number of bytes uploaded per frame, which equals a 1024x1024
+ * texture with 32 bits per pixel.
+ */
+static const int DEFAULT_BUDGET = 4 * 1024 * 1024;
+
+TextureUploadQueue *TextureUploadQueue::mInstance;
+
+TextureUploadQueue::TextureUploadQueue(QObject *parent)
+    : QObject(parent)
+    , mBudget(DEFAULT_BUDGET)
+{
+    Q_ASSERT(!mInstance);
+    mInstance = this;
+}
+
+TextureUploadQueue::~TextureUploadQueue()
+{
+    mInstance = 0;
+}
+
+void TextureUploadQueue::setBudget(int budget)
+{
+    if (mBudget == budget)
+        return;
+
+    mBudget = budget;
+    emit budgetChanged();
+}
+
+void TextureUploadQueue::setWindow(QQuickWindow *window)
+{
+    if (mWindow == window)
+        return;
+
+    if (mWindow)
+        mWindow->disconnect(this);
+
+    mWindow = window;
+
+    if (mWindow) {
+        connect(mWindow, SIGNAL(beforeSynchronizing()),
+                this, SLOT(uploadPending()), Qt::DirectConnection);
+
+        if (pendingUploads() > 0)
+            mWindow->update();
+    }
+}
+
+/**
+ * Adds the texture with the given \a index of the \a source to the queue.
+ * The \a bytes are counted against the budget of the frame in which the
+ * texture is uploaded.
+ */
+void TextureUploadQueue::enqueue(Source *source, int index, int bytes)
+{
+    Upload upload;
+    upload.source = source;
+    upload.index = index;
+    upload.bytes = bytes;
+    upload.queued.start();
+
+    {
+        QMutexLocker locker(&mMutex);
+        mUploads.append(upload);
+    }
+
+    if (mWindow)
+        mWindow->update();
+}
+
+/**
+ * Removes the texture with the given \a index of the \a source from the
+ * queue, or all its textures when \a index is -1. Needs to be called when
+ * a source is deleted or has created the texture by itself.
+ */
+void TextureUploadQueue::remove(Source *source, int index)
+{
+    QMutexLocker locker(&mMutex);
+
+    QMutableListIterator<Upload> it(mUploads);
+    while (it.hasNext()) {
+        const Upload &upload = it.next();
+        if (upload.source == source && (index == -1 || upload.index == index))
+            it.remove();
+    }
+}
+
+int TextureUploadQueue::pendingUploads() const
+{
+    QMutexLocker locker(&mMutex);
+    return mUploads.size();
+}
+
+/**
+ * Called on the render thread before each frame is synchronized, with the
+ * OpenGL context current and the GUI thread blocked.
+ */
+void TextureUploadQueue::uploadPending()
+{
+    QMutexLocker locker(&mMutex);
+
+    int bytes = 0;
+    int uploads = 0;
+    qint64 latency = 0;
+
+    while (!mUploads.isEmpty() && (uploads == 0 || bytes < mBudget)) {
+        const Upload upload = mUploads.takeFirst();
+
+        if (QSGTexture *texture = upload.source->uploadTexture(upload.index, mWindow)) {
+            // Binding the texture makes sure it is uploaded right away
+            texture->bind();
+
+            bytes += upload.bytes;
+            ++uploads;
+            latency = qMax(latency, upload.queued.elapsed());
+        }
+    }
+
+    if (uploads > 0) {
+        RenderStatistics::add(RenderStatistics::TexturesUploaded, uploads);
+        RenderStatistics::add(RenderStatistics::UploadLatency, latency);
+    }
+
+    // Make sure the remaining textures are uploaded in the next frames
+    if (!mUploads.isEmpty())
+        QMetaObject::invokeMethod(mWindow, "update", Qt::QueuedConnection);
+}
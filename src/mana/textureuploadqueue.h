@@ -0,0 +1,119 @@
+/*
+ * Mana Mobile
+ * Copyright (C) 2013  The Mana Developers
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEXTUREUPLOADQUEUE_H
+#define TEXTUREUPLOADQUEUE_H
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QPointer>
+
+class QQuickWindow;
+class QSGTexture;
+
+namespace Mana {
+
+/**
+ * Creates and uploads the textures of resources ahead of them being needed,
+ * so that the first frame showing a new tileset or sprite sheet does not
+ * stall on uploading it.
+ *
+ * Resources add their textures to the queue once their images are loaded.
+ * Right before each frame is synchronized, the queue uploads textures until
+ * the budget of bytes per frame is used up. At least one texture is uploaded
+ * per frame, and another frame is scheduled while textures are pending.
+ *
+ * Textures that are needed before their turn are still created on demand by
+ * their resource, which then removes them from the queue.
+ */
+class TextureUploadQueue : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(int budget READ budget WRITE setBudget NOTIFY budgetChanged)
+
+public:
+    /**
+     * A resource owning textures that can be uploaded by the queue.
+     */
+    class Source
+    {
+    public:
+        virtual ~Source() {}
+
+        /**
+         * Returns the texture with the given \a index, creating it when
+         * necessary. Called on the render thread while the GUI thread is
+         * blocked.
+         */
+        virtual QSGTexture *uploadTexture(int index, QQuickWindow *window) = 0;
+    };
+
+    explicit TextureUploadQueue(QObject *parent = 0);
+    ~TextureUploadQueue();
+
+    static TextureUploadQueue *instance();
+
+    int budget() const;
+    void setBudget(int budget);
+
+    /**
+     * Sets the window for which the textures are uploaded.
+     */
+    void setWindow(QQuickWindow *window);
+
+    void enqueue(Source *source, int index, int bytes);
+    void remove(Source *source, int index = -1);
+
+    int pendingUploads() const;
+
+signals:
+    void budgetChanged();
+
+private slots:
+    void uploadPending();
+
+private:
+    struct Upload
+    {
+        Source *source;
+        int index;
+        int bytes;
+        QElapsedTimer queued;
+    };
+
+    int mBudget;
+    QPointer<QQuickWindow> mWindow;
+
+    mutable QMutex mMutex;
+    QList<Upload> mUploads;
+
+    static TextureUploadQueue *mInstance;
+};
+
+inline TextureUploadQueue *TextureUploadQueue::instance()
+{ return mInstance; }
+
+inline int TextureUploadQueue::budget() const
+{ return mBudget; }
+
+} // namespace Mana
+
+#endif // TEXTUREUPLOADQUEUE_H
@@ -24,15 +24,50 @@
 #include "tiled/maprenderer.h"
 
 #include "mana/mapitem.h"
+#include "mana/renderstatistics.h"
 #include "mana/resource/imageresource.h"
 #include "mana/resource/mapresource.h"
 #include "mana/tilesnode.h"
 
+#include <QHash>
+#include <QMargins>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPainter>
+#include <QRunnable>
+#include <QSGOpacityNode>
+#include <QSGSimpleTextureNode>
+#include <QThreadPool>
+#include <QtMath>
+
 using namespace Tiled;
 using namespace Mana;
 
+namespace Mana {
+
+/**
+ * Lets the threads rendering chunk images know whether the TileLayerItem
+ * they are rendering for still exists.
+ */
+class LodGuard
+{
+public:
+    explicit LodGuard(TileLayerItem *item) : item(item) {}
+
+    QMutex mutex;
+    TileLayerItem *item;
+};
+
+} // namespace Mana
+
 namespace {
 
+/**
+ * The number of chunks around the visible area for which the geometry is
+ * kept in memory after it scrolled out of view.
+ */
+static const int CHUNK_CACHE_MARGIN = 2;
+
 /**
  * Returns the texture of a given tileset, or 0 if the image has not been
  * loaded yet.
@@ -50,6 +85,9 @@ static inline QSGTexture *tilesetTexture(Tileset *tileset,
 /**
  * This helper class exists mainly to avoid redoing calculations that only need
  * to be done once per tileset.
+ *
+ * When the tileset image is part of one of the atlas textures of the map, the
+ * atlas texture is used and the texture coordinates are remapped into it.
  */
 struct TilesetHelper
 {
@@ -71,28 +109,41 @@ struct TilesetHelper
     void setTileset(Tileset *tileset)
     {
         mTileset = tileset;
-        mTexture = tilesetTexture(tileset, mMapItem, mWindow);
-        if (!mTexture)
-            return;
+        mOffset = QPoint();
+
+        const MapResource *mapResource = mMapItem->mapResource();
+        const MapResource::AtlasLocation location =
+                mapResource->atlasLocation(tileset);
+
+        QSize tilesetSize;
+
+        if (!location.isNull()) {
+            mTexture = mapResource->atlasTexture(location.atlas, mWindow);
+            mOffset = location.rect.topLeft();
+            tilesetSize = location.rect.size();
+        } else {
+            mTexture = tilesetTexture(tileset, mMapItem, mWindow);
+            if (!mTexture)
+                return;
+            tilesetSize = mTexture->textureSize();
+        }
 
         const int tileSpacing = tileset->tileSpacing();
         mMargin = tileset->margin();
         mTileHSpace = tileset->tileWidth() + tileSpacing;
         mTileVSpace = tileset->tileHeight() + tileSpacing;
 
-        const QSize tilesetSize = mTexture->textureSize();
         const int availableWidth = tilesetSize.width() + tileSpacing - mMargin;
         mTilesPerRow = availableWidth / mTileHSpace;
     }
 
-    void setTextureCoordinates(TileData &data, const Cell &cell) const
+    void setTextureCoordinates(TileData &data, int tileId) const
     {
-        const int tileId = cell.tile->id();
         const int column = tileId % mTilesPerRow;
         const int row = tileId / mTilesPerRow;
 
-        data.tx = column * mTileHSpace + mMargin;
-        data.ty = row * mTileVSpace + mMargin;
+        data.tx = column * mTileHSpace + mMargin + mOffset.x();
+        data.ty = row * mTileVSpace + mMargin + mOffset.y();
     }
 
 private:
@@ -100,6 +151,7 @@ private:
     QQuickWindow *mWindow;
     Tileset *mTileset;
     QSGTexture *mTexture;
+    QPoint mOffset;
     int mMargin;
     int mTileHSpace;
     int mTileVSpace;
@@ -107,82 +159,415 @@ private:
 };
 
 /**
- * Draws an orthogonal tile layer by adding nodes to the scene graph. As long
- * sequentially drawn tiles are using the same tileset, they will share a
- * single geometry node.
+ * Appends new TilesNodes for the given \a tileData to \a parent and clears
+ * the tile data. The tiles are split over several nodes when they exceed the
+ * maximum number of tiles per node.
+ */
+static void appendTilesNode(QSGNode *parent,
+                            QSGTexture *texture,
+                            QVector<TileData> &tileData)
+{
+    if (tileData.isEmpty())
+        return;
+
+    if (tileData.size() <= TilesNode::MAX_TILES) {
+        parent->appendChildNode(new TilesNode(texture, tileData));
+    } else {
+        for (int i = 0; i < tileData.size(); i += TilesNode::MAX_TILES) {
+            const QVector<TileData> part = tileData.mid(i, TilesNode::MAX_TILES);
+            parent->appendChildNode(new TilesNode(texture, part));
+        }
+    }
+
+    tileData.clear();
+}
+
+/**
+ * Returns the cells of the given tile \a rect in the order in which they
+ * need to be drawn. For isometric maps this is along the diagonals, which are
+ * the rows on the screen. Other orientations are drawn row by row.
+ */
+static QVector<QPoint> cellsInDrawOrder(const Map *map, const QRect &rect)
+{
+    QVector<QPoint> cells;
+    cells.reserve(rect.width() * rect.height());
+
+    if (map->orientation() == Map::Isometric) {
+        const int first = rect.left() + rect.top();
+        const int last = rect.right() + rect.bottom();
+
+        for (int sum = first; sum <= last; ++sum) {
+            const int startX = qMax(rect.left(), sum - rect.bottom());
+            const int endX = qMin(rect.right(), sum - rect.top());
+
+            for (int x = startX; x <= endX; ++x)
+                cells.append(QPoint(x, sum - x));
+        }
+    } else {
+        for (int y = rect.top(); y <= rect.bottom(); ++y)
+            for (int x = rect.left(); x <= rect.right(); ++x)
+                cells.append(QPoint(x, y));
+    }
+
+    return cells;
+}
+
+/**
+ * Returns the pixel position of the bottom-left corner of the given tile,
+ * which is where the tile images are aligned.
+ */
+static inline QPointF tileBottomLeft(const Map *map,
+                                     const MapRenderer *renderer,
+                                     int x, int y)
+{
+    QPointF pos = renderer->tileToPixelCoords(x, y);
+    if (map->orientation() == Map::Isometric)
+        pos.rx() -= map->tileWidth() / 2;
+    pos.ry() += map->tileHeight();
+    return pos;
+}
+
+/**
+ * Draws tile layers by adding nodes to the scene graph. As long
+ * sequentially drawn tiles are using the same texture, they will share a
+ * single geometry node. When the tilesets are packed into an atlas, this
+ * holds across tilesets.
+ *
+ * Tiles of consecutive layers can share a node as long as the layers have
+ * the same opacity. Layers that are not fully opaque are drawn below an
+ * opacity node.
+ *
+ * The tiles are positioned relative to \a origin, in map pixel coordinates.
  */
-static void drawTileLayer(QSGNode *parent,
-                          const MapItem *mapItem,
-                          const TileLayer *layer,
-                          const QRect &rect)
+static void drawTileLayers(QSGNode *parent,
+                           const MapItem *mapItem,
+                           const MapRenderer *renderer,
+                           const QList<TileLayer*> &layers,
+                           const QRect &rect,
+                           const QPointF &origin)
 {
     TilesetHelper helper(mapItem);
 
     const Map *map = mapItem->mapResource()->map();
-    const int tileWidth = map->tileWidth();
-    const int tileHeight = map->tileHeight();
+
+    // Other orientations are drawn row by row, which allows skipping the
+    // empty parts of sparse layers
+    const bool isometric = map->orientation() == Map::Isometric;
+    const QVector<QPoint> cells = isometric ? cellsInDrawOrder(map, rect)
+                                            : QVector<QPoint>();
 
     QVector<TileData> tileData;
+    QSGNode *target = parent;
+    float opacity = 1;
 
-    for (int y = rect.top(); y <= rect.bottom(); ++y) {
-        for (int x = rect.left(); x <= rect.right(); ++x) {
-            const Cell &cell = layer->cellAt(x, y);
-            if (cell.isEmpty())
-                continue;
+    foreach (const TileLayer *layer, layers) {
+        if (layer->opacity() != opacity) {
+            appendTilesNode(target, helper.texture(), tileData);
 
-            Tileset *tileset = cell.tile->tileset();
+            opacity = layer->opacity();
+            target = parent;
 
-            if (tileset != helper.tileset()) {
-                if (!tileData.isEmpty()) {
-                    parent->appendChildNode(new TilesNode(helper.texture(),
-                                                          tileData));
-                    tileData.clear();
-                }
+            if (opacity < 1) {
+                QSGOpacityNode *opacityNode = new QSGOpacityNode;
+                opacityNode->setOpacity(opacity);
+                parent->appendChildNode(opacityNode);
+                target = opacityNode;
+            }
+        }
+
+        // The tileset only needs to be looked up when the index changes
+        int tilesetIndex = -1;
+        Tileset *tileset = 0;
+
+        TileLayer::CellIterator iterator(layer, rect);
+        int index = 0;
+
+        for (;;) {
+            QPoint pos;
+            PackedCell cell;
 
+            if (isometric) {
+                if (index == cells.size())
+                    break;
+
+                pos = cells.at(index++);
+                cell = layer->packedCellAt(pos);
+                if (cell.isEmpty())
+                    continue;
+            } else {
+                if (!iterator.next())
+                    break;
+
+                pos = QPoint(iterator.x(), iterator.y());
+                cell = iterator.cell();
+            }
+
+            if (cell.tilesetIndex() != tilesetIndex) {
+                tilesetIndex = cell.tilesetIndex();
+                tileset = layer->tilesetAt(tilesetIndex);
+            }
+
+            if (tileset != helper.tileset()) {
+                QSGTexture *previousTexture = helper.texture();
                 helper.setTileset(tileset);
+
+                if (helper.texture() != previousTexture)
+                    appendTilesNode(target, previousTexture, tileData);
             }
 
             if (!helper.texture())
                 continue;
 
-            const QSize size = cell.tile->size();
             const QPoint offset = tileset->tileOffset();
+            const QPointF bottomLeft = tileBottomLeft(map, renderer,
+                                                      pos.x() + layer->x(),
+                                                      pos.y() + layer->y()) - origin;
 
             TileData data;
-            data.x = x * tileWidth + offset.x();
-            data.y = (y + 1) * tileHeight - tileset->tileHeight() + offset.y();
-            data.width = size.width();
-            data.height = size.height();
-            helper.setTextureCoordinates(data, cell);
+            data.x = bottomLeft.x() + offset.x();
+            data.y = bottomLeft.y() - tileset->tileHeight() + offset.y();
+            data.width = tileset->tileWidth();
+            data.height = tileset->tileHeight();
+            helper.setTextureCoordinates(data, cell.tileId());
             tileData.append(data);
         }
     }
 
-    if (!tileData.isEmpty())
-        parent->appendChildNode(new TilesNode(helper.texture(), tileData));
+    appendTilesNode(target, helper.texture(), tileData);
 }
 
+/**
+ * A tile to be drawn onto a chunk image.
+ */
+struct LodTile
+{
+    int image;
+    QRect source;
+    QPointF target;
+    qreal opacity;
+};
+
+/**
+ * Renders the downscaled image of a chunk in a background thread. The tiles
+ * to draw are collected on the GUI thread, along with copies of the tileset
+ * images they need.
+ */
+class LodJob : public QRunnable
+{
+public:
+    LodJob(const QSharedPointer<LodGuard> &guard,
+           int generation, int index,
+           const QSize &size, qreal scale)
+        : mGuard(guard)
+        , mGeneration(generation)
+        , mIndex(index)
+        , mSize(size)
+        , mScale(scale)
+    {}
+
+    void addTiles(const MapItem *mapItem,
+                  const Map *map,
+                  const MapRenderer *renderer,
+                  const QList<TileLayer*> &layers,
+                  const QRect &rect,
+                  const QPointF &origin);
+
+    void run();
+
+private:
+    QSharedPointer<LodGuard> mGuard;
+    int mGeneration;
+    int mIndex;
+    QSize mSize;
+    qreal mScale;
+    QVector<QImage> mImages;
+    QVector<LodTile> mTiles;
+};
+
+/**
+ * Adds the tiles of the given \a layers within \a rect, in drawing order.
+ * The tiles are positioned relative to \a origin, in map pixel coordinates.
+ */
+void LodJob::addTiles(const MapItem *mapItem,
+                      const Map *map,
+                      const MapRenderer *renderer,
+                      const QList<TileLayer*> &layers,
+                      const QRect &rect,
+                      const QPointF &origin)
+{
+    QHash<Tileset*, int> imageIndexes;
+
+    foreach (const TileLayer *layer, layers) {
+        int tilesetIndex = -1;
+        Tileset *tileset = 0;
+        QHash<Tileset*, int>::iterator it;
+
+        TileLayer::CellIterator iterator(layer, rect);
+        while (iterator.next()) {
+            const int x = iterator.x();
+            const int y = iterator.y();
+            const PackedCell cell = iterator.cell();
+
+            if (cell.tilesetIndex() != tilesetIndex) {
+                tilesetIndex = cell.tilesetIndex();
+                tileset = layer->tilesetAt(tilesetIndex);
+                it = imageIndexes.find(tileset);
+            }
+
+            if (it == imageIndexes.end()) {
+                const QImage image = mapItem->lodTilesetImage(tileset);
+                int index = -1;
+                if (!image.isNull()) {
+                    index = mImages.size();
+                    mImages.append(image);
+                }
+                it = imageIndexes.insert(tileset, index);
+            }
+
+            if (it.value() == -1)
+                continue;
+
+            const int tileSpacing = tileset->tileSpacing();
+            const int margin = tileset->margin();
+            const int tileHSpace = tileset->tileWidth() + tileSpacing;
+            const int tileVSpace = tileset->tileHeight() + tileSpacing;
+            const int imageWidth = mImages.at(it.value()).width();
+            const int tilesPerRow = (imageWidth + tileSpacing - margin) / tileHSpace;
+            if (tilesPerRow == 0)
+                continue;
+
+            const int tileId = cell.tileId();
+            const QPoint offset = tileset->tileOffset();
+            const QPointF bottomLeft = tileBottomLeft(map, renderer,
+                                                      x + layer->x(),
+                                                      y + layer->y()) - origin;
+
+            LodTile tile;
+            tile.image = it.value();
+            tile.source = QRect(QPoint(tileId % tilesPerRow * tileHSpace + margin,
+                                       tileId / tilesPerRow * tileVSpace + margin),
+                                tileset->tileSize());
+            tile.target = QPointF(bottomLeft.x() + offset.x(),
+                                  bottomLeft.y() - tileset->tileHeight() + offset.y());
+            tile.opacity = layer->opacity();
+            mTiles.append(tile);
+        }
+    }
+}
+
+void LodJob::run()
+{
+    QImage image(mSize, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    painter.scale(mScale, mScale);
+
+    foreach (const LodTile &tile, mTiles) {
+        painter.setOpacity(tile.opacity);
+        painter.drawImage(tile.target, mImages.at(tile.image), tile.source);
+    }
+
+    painter.end();
+
+    QMutexLocker locker(&mGuard->mutex);
+    if (mGuard->item) {
+        QMetaObject::invokeMethod(mGuard->item, "lodImageReady",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, mGeneration),
+                                  Q_ARG(int, mIndex),
+                                  Q_ARG(QImage, image));
+    }
+}
+
+/**
+ * Appends a node showing the downscaled \a image of a chunk in the given
+ * \a rect.
+ */
+static void appendLodImageNode(QSGNode *parent,
+                               QQuickWindow *window,
+                               const QImage &image,
+                               const QRectF &rect)
+{
+    QSGSimpleTextureNode *node = new QSGSimpleTextureNode;
+    node->setTexture(window->createTextureFromImage(image));
+    node->setOwnsTexture(true);
+    node->setFiltering(QSGTexture::Linear);
+    node->setRect(rect);
+    parent->appendChildNode(node);
+}
+
+/**
+ * The root node of a tile layer. It owns the geometry of all chunks that are
+ * currently cached, both the attached and the detached ones. The chunk nodes
+ * are not owned by their parent, since they need to survive being detached.
+ */
+class TileLayerNode : public QSGNode
+{
+public:
+    ~TileLayerNode()
+    {
+        removeAllChildNodes();
+        qDeleteAll(mChunks);
+    }
+
+    QSGNode *chunk(int index) const { return mChunks.value(index); }
+
+    QSGNode *createChunk(int index)
+    {
+        QSGNode *chunk = new QSGNode;
+        chunk->setFlag(QSGNode::OwnedByParent, false);
+        mChunks.insert(index, chunk);
+        return chunk;
+    }
+
+    QHash<int, QSGNode*> &chunks() { return mChunks; }
+
+private:
+    QHash<int, QSGNode*> mChunks;
+};
+
 } // anonymous namespace
 
 
-TileLayerItem::TileLayerItem(TileLayer *layer, MapRenderer *renderer,
-                             MapItem *parent)
+TileLayerItem::TileLayerItem(const QList<TileLayer*> &layers,
+                             MapRenderer *renderer,
+                             MapItem *parent,
+                             int row)
     : QQuickItem(parent)
-    , mLayer(layer)
+    , mLayers(layers)
     , mRenderer(renderer)
-    , mVisibleTiles(parent->visibleTileArea(layer))
+    , mRow(row)
+    , mChunkHeight(CHUNK_SIZE)
+    , mRebuildChunks(false)
+    , mLodLevel(0)
+    , mLodGeneration(0)
+    , mLodGuard(new LodGuard(this))
 {
     setFlag(ItemHasContents);
 
+    if (mRow != -1 || tilesExceedCells())
+        mChunkHeight = 1;
+
+    mVisibleChunks = visibleChunks();
+    mHiddenChunks = hiddenChunks(mVisibleChunks);
+
     connect(parent, SIGNAL(visibleAreaChanged()), SLOT(updateVisibleTiles()));
 
     syncWithTileLayer();
-    setOpacity(mLayer->opacity());
+}
+
+TileLayerItem::~TileLayerItem()
+{
+    // Chunk images that are still being rendered are dropped
+    QMutexLocker locker(&mLodGuard->mutex);
+    mLodGuard->item = 0;
 }
 
 void TileLayerItem::syncWithTileLayer()
 {
-    const QRectF boundingRect = mRenderer->boundingRect(mLayer->bounds());
+    const QRectF boundingRect = mRenderer->boundingRect(mLayers.first()->bounds());
     setPosition(boundingRect.topLeft());
     setSize(boundingRect.size());
 }
@@ -192,68 +577,366 @@ void TileLayerItem::syncWithTileLayer()
 QSGNode *TileLayerItem::updatePaintNode(QSGNode *node,
                                         QQuickItem::UpdatePaintNodeData *)
 {
+    RenderTimer timer(window());
+
     const MapItem *mapItem = static_cast<MapItem*>(parentItem());
 
-    if (!node) {
-        node = new QSGNode;
-        node->setFlag(QSGNode::OwnedByParent);
+    TileLayerNode *layerNode = static_cast<TileLayerNode*>(node);
+    if (!layerNode)
+        layerNode = new TileLayerNode;
+
+    const TileLayer *layer = mLayers.first();
+    const int chunkColumns = (layer->width() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    const QRect layerRect(0, 0, layer->width(), layer->height());
+    const QMargins margins = drawMargins();
+
+    // Drop all geometry when the level of detail changed
+    if (mRebuildChunks) {
+        qDeleteAll(layerNode->chunks());
+        layerNode->chunks().clear();
+        mRebuildChunks = false;
+    }
+
+    QRect cachedChunks;
+    if (!mVisibleChunks.isEmpty()) {
+        cachedChunks = mVisibleChunks.adjusted(-CHUNK_CACHE_MARGIN,
+                                               -CHUNK_CACHE_MARGIN,
+                                               CHUNK_CACHE_MARGIN,
+                                               CHUNK_CACHE_MARGIN);
+    }
+
+    // Detach the chunks that are no longer visible and drop the ones that
+    // have moved too far out of view or have changed
+    QMutableHashIterator<int, QSGNode*> it(layerNode->chunks());
+    while (it.hasNext()) {
+        it.next();
+        const QPoint chunkPos(it.key() % chunkColumns, it.key() / chunkColumns);
+        QSGNode *chunk = it.value();
+
+        if (!cachedChunks.contains(chunkPos) || mDirtyChunks.contains(it.key())) {
+            delete chunk;
+            it.remove();
+        } else if (chunk->parent() && !isChunkVisible(chunkPos, it.key())) {
+            layerNode->removeChildNode(chunk);
+        }
     }
 
-    node->removeAllChildNodes();
-    drawTileLayer(node, mapItem, mLayer, mVisibleTiles);
+    mDirtyChunks.clear();
+
+    // Attach the visible chunks, keeping them in drawing order. Only chunks
+    // that were not cached yet need their geometry to be created.
+    QSGNode *next = layerNode->firstChild();
+
+    for (int y = mVisibleChunks.top(); y <= mVisibleChunks.bottom(); ++y) {
+        for (int x = mVisibleChunks.left(); x <= mVisibleChunks.right(); ++x) {
+            const int index = x + y * chunkColumns;
+            if (mHiddenChunks.contains(index))
+                continue;
+
+            QSGNode *chunk = layerNode->chunk(index);
+
+            if (!chunk) {
+                chunk = layerNode->createChunk(index);
+
+                const QImage lodImage = mLodImages.value(index);
+                if (!lodImage.isNull()) {
+                    const QRectF bounds = chunkBounds(x, y, margins);
+                    appendLodImageNode(chunk, window(), lodImage,
+                                       bounds.translated(-position()));
+                } else {
+                    drawTileLayers(chunk, mapItem, mRenderer, mLayers,
+                                   chunkRect(x, y) & layerRect, position());
+                }
+
+                RenderStatistics::add(RenderStatistics::ChunksBuilt, 1);
+            }
+
+            if (chunk == next) {
+                next = next->nextSibling();
+                continue;
+            }
 
-    return node;
+            if (next)
+                layerNode->insertChildNodeBefore(chunk, next);
+            else
+                layerNode->appendChildNode(chunk);
+        }
+    }
+
+    return layerNode;
+}
+
+void TileLayerItem::invalidateTiles(const QRegion &region)
+{
+    const TileLayer *layer = mLayers.first();
+    const int chunkColumns = (layer->width() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    const int chunkHeight = this->chunkHeight();
+
+    QRect layerRect(0, 0, layer->width(), layer->height());
+    if (mRow != -1)
+        layerRect = QRect(0, mRow, layer->width(), 1);
+
+    bool changed = false;
+
+    foreach (const QRect &rect, region.rects()) {
+        const QRect tiles = rect & layerRect;
+        if (tiles.isEmpty())
+            continue;
+
+        for (int y = tiles.top() / chunkHeight; y <= tiles.bottom() / chunkHeight; ++y) {
+            for (int x = tiles.left() / CHUNK_SIZE; x <= tiles.right() / CHUNK_SIZE; ++x) {
+                const int index = x + y * chunkColumns;
+                mDirtyChunks.insert(index);
+                mLodImages.remove(index);
+                changed = true;
+            }
+        }
+    }
+
+    if (!changed)
+        return;
+
+    // Images that are still being rendered may show the old tiles
+    ++mLodGeneration;
+    mPendingLodImages.clear();
+
+    // Tiles larger than the grid may have been placed or removed, in which
+    // case the chunks are divided differently
+    if (mRow == -1) {
+        const int chunkHeight = tilesExceedCells() ? 1 : CHUNK_SIZE;
+        if (chunkHeight != mChunkHeight) {
+            mChunkHeight = chunkHeight;
+            mRebuildChunks = true;
+            resetLodImages();
+        }
+    }
+
+    // The changed tiles may have affected the draw margins
+    updateVisibleTiles();
+    requestLodImages();
+    update();
+}
+
+void TileLayerItem::setLodLevel(int level)
+{
+    // The fringe layer rows are too small to benefit
+    if (mRow != -1 || mLodLevel == level)
+        return;
+
+    mLodLevel = level;
+    mRebuildChunks = true;
+
+    resetLodImages();
+    requestLodImages();
+    update();
+}
+
+void TileLayerItem::lodImageReady(int generation, int index, const QImage &image)
+{
+    if (generation != mLodGeneration)
+        return;
+
+    mPendingLodImages.remove(index);
+    mLodImages.insert(index, image);
+
+    // Replace the tile by tile geometry of the chunk
+    mDirtyChunks.insert(index);
+    update();
 }
 
 void TileLayerItem::updateVisibleTiles()
 {
-    const MapItem *mapItem = static_cast<MapItem*>(parentItem());
-    const QRect rect = mapItem->visibleTileArea(mLayer);
+    const QRect chunks = visibleChunks();
+    const QSet<int> hidden = hiddenChunks(chunks);
 
-    if (mVisibleTiles != rect) {
-        mVisibleTiles = rect;
+    if (mVisibleChunks != chunks || mHiddenChunks != hidden) {
+        mVisibleChunks = chunks;
+        mHiddenChunks = hidden;
+        requestLodImages();
         update();
     }
 }
 
+QRect TileLayerItem::chunkRect(int x, int y) const
+{
+    return QRect(x * CHUNK_SIZE, y * chunkHeight(), CHUNK_SIZE, chunkHeight());
+}
 
-TileItem::TileItem(const Cell &cell, QPoint position, MapItem *parent)
-    : QQuickItem(parent)
-    , mCell(cell)
-    , mPosition(position)
+bool TileLayerItem::isChunkVisible(QPoint chunkPos, int index) const
 {
-    setFlag(ItemHasContents);
-    setZ(position.y() * parent->mapResource()->map()->tileHeight());
+    return mVisibleChunks.contains(chunkPos) && !mHiddenChunks.contains(index);
 }
 
-QSGNode *TileItem::updatePaintNode(QSGNode *node, QQuickItem::UpdatePaintNodeData *)
+/**
+ * Returns the rectangle of chunks that overlap with the visible tile area of
+ * any of the layers.
+ */
+QRect TileLayerItem::visibleChunks() const
 {
-    if (!node) {
-        const MapItem *mapItem = static_cast<MapItem*>(parent());
+    const MapItem *mapItem = static_cast<MapItem*>(parentItem());
+
+    QRect tiles;
+    foreach (const TileLayer *layer, mLayers) {
+        const QRect area = mapItem->visibleTileArea(layer);
+        if (!area.isEmpty())
+            tiles |= area;
+    }
+
+    if (mRow != -1) {
+        if (mRow < tiles.top() || mRow > tiles.bottom())
+            return QRect();
 
-        TilesetHelper helper(mapItem);
-        Tileset *tileset = mCell.tile->tileset();
-        helper.setTileset(tileset);
+        tiles.setTop(mRow);
+        tiles.setBottom(mRow);
+    }
+
+    if (tiles.isEmpty())
+        return QRect();
+
+    const int chunkHeight = this->chunkHeight();
+    return QRect(QPoint(tiles.left() / CHUNK_SIZE, tiles.top() / chunkHeight),
+                 QPoint(tiles.right() / CHUNK_SIZE, tiles.bottom() / chunkHeight));
+}
+
+/**
+ * For isometric and staggered maps, the rectangle of visible tiles covers a
+ * larger area than the visible area, since it is not aligned with the
+ * screen. Returns the chunks within the given rectangle of \a chunks that
+ * are nevertheless completely out of view.
+ */
+QSet<int> TileLayerItem::hiddenChunks(const QRect &chunks) const
+{
+    QSet<int> hidden;
 
-        if (!helper.texture())
-            return 0;
+    const MapItem *mapItem = static_cast<MapItem*>(parentItem());
+    const Map *map = mapItem->mapResource()->map();
+    if (map->orientation() == Map::Orthogonal || chunks.isEmpty())
+        return hidden;
 
-        const Map *map = mapItem->mapResource()->map();
-        const int tileWidth = map->tileWidth();
-        const int tileHeight = map->tileHeight();
+    const TileLayer *layer = mLayers.first();
+    const int chunkColumns = (layer->width() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    const QMargins margins = drawMargins();
+    const QRectF visibleArea = mapItem->visibleArea();
 
-        const QSize size = mCell.tile->size();
-        const QPoint offset = tileset->tileOffset();
+    for (int y = chunks.top(); y <= chunks.bottom(); ++y)
+        for (int x = chunks.left(); x <= chunks.right(); ++x)
+            if (!visibleArea.intersects(chunkBounds(x, y, margins)))
+                hidden.insert(x + y * chunkColumns);
 
-        QVector<TileData> data(1);
-        data[0].x = mPosition.x() * tileWidth + offset.x();
-        data[0].y = (mPosition.y() + 1) * tileHeight - tileset->tileHeight() + offset.y();
-        data[0].width = size.width();
-        data[0].height = size.height();
-        helper.setTextureCoordinates(data[0], mCell);
+    return hidden;
+}
 
-        node = new TilesNode(helper.texture(), data);
+/**
+ * Returns the margins around the tiles of the layers, which account for
+ * tiles that are larger than the grid.
+ */
+QMargins TileLayerItem::drawMargins() const
+{
+    QMargins margins;
+    foreach (const TileLayer *tileLayer, mLayers) {
+        const QMargins m = tileLayer->drawMargins();
+        margins.setLeft(qMax(margins.left(), m.left()));
+        margins.setTop(qMax(margins.top(), m.top()));
+        margins.setRight(qMax(margins.right(), m.right()));
+        margins.setBottom(qMax(margins.bottom(), m.bottom()));
     }
+    return margins;
+}
+
+bool TileLayerItem::tilesExceedCells(const TileLayer *layer)
+{
+    const Map *map = layer->map();
+    const QMargins m = layer->drawMargins();
+    return m.left() > 0 || m.bottom() > 0 ||
+            m.top() > map->tileHeight() || m.right() > map->tileWidth();
+}
 
-    return node;
+/**
+ * Returns whether any of the tiles of the layers are drawn outside of their
+ * cell.
+ */
+bool TileLayerItem::tilesExceedCells() const
+{
+    foreach (const TileLayer *tileLayer, mLayers)
+        if (tilesExceedCells(tileLayer))
+            return true;
+    return false;
+}
+
+/**
+ * Returns the area covered by the tiles of the given chunk, in map pixel
+ * coordinates.
+ */
+QRect TileLayerItem::chunkBounds(int x, int y, const QMargins &drawMargins) const
+{
+    const QRect tiles = chunkRect(x, y).translated(mLayers.first()->position());
+    return mRenderer->boundingRect(tiles) + drawMargins;
+}
+
+/**
+ * Starts rendering the images of the visible chunks for the current level of
+ * detail, for the chunks that do not have one yet. Also drops the images of
+ * the chunks that have moved too far out of view.
+ */
+void TileLayerItem::requestLodImages()
+{
+    if (mLodLevel == 0)
+        return;
+
+    const TileLayer *layer = mLayers.first();
+    const int chunkColumns = (layer->width() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    QRect cachedChunks;
+    if (!mVisibleChunks.isEmpty()) {
+        cachedChunks = mVisibleChunks.adjusted(-CHUNK_CACHE_MARGIN,
+                                               -CHUNK_CACHE_MARGIN,
+                                               CHUNK_CACHE_MARGIN,
+                                               CHUNK_CACHE_MARGIN);
+    }
+
+    QMutableHashIterator<int, QImage> it(mLodImages);
+    while (it.hasNext()) {
+        it.next();
+        const QPoint chunkPos(it.key() % chunkColumns, it.key() / chunkColumns);
+        if (!cachedChunks.contains(chunkPos))
+            it.remove();
+    }
+
+    const MapItem *mapItem = static_cast<MapItem*>(parentItem());
+    const Map *map = mapItem->mapResource()->map();
+    const QRect layerRect(0, 0, layer->width(), layer->height());
+    const QMargins margins = drawMargins();
+    const qreal scale = 1.0 / (1 << mLodLevel);
+
+    for (int y = mVisibleChunks.top(); y <= mVisibleChunks.bottom(); ++y) {
+        for (int x = mVisibleChunks.left(); x <= mVisibleChunks.right(); ++x) {
+            const int index = x + y * chunkColumns;
+            if (mHiddenChunks.contains(index) ||
+                    mLodImages.contains(index) ||
+                    mPendingLodImages.contains(index))
+                continue;
+
+            const QRect bounds = chunkBounds(x, y, margins);
+            const QSize size(qCeil(bounds.width() * scale),
+                             qCeil(bounds.height() * scale));
+
+            LodJob *job = new LodJob(mLodGuard, mLodGeneration, index,
+                                     size, scale);
+            job->addTiles(mapItem, map, mRenderer, mLayers,
+                          chunkRect(x, y) & layerRect, bounds.topLeft());
+
+            QThreadPool::globalInstance()->start(job);
+            mPendingLodImages.insert(index);
+        }
+    }
+}
+
+/**
+ * Discards the chunk images, including the ones still being rendered.
+ */
+void TileLayerItem::resetLodImages()
+{
+    ++mLodGeneration;
+    mLodImages.clear();
+    mPendingLodImages.clear();
 }
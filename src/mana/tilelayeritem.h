@@ -19,7 +19,11 @@
 #ifndef TILELAYERITEM_H
 #define TILELAYERITEM_H
 
+#include <QHash>
+#include <QImage>
 #include <QQuickItem>
+#include <QSet>
+#include <QSharedPointer>
 
 #include "tiled/tilelayer.h"
 
@@ -29,28 +33,74 @@ class MapRenderer;
 
 namespace Mana {
 
+class LodGuard;
 class MapItem;
 
 /**
- * A graphical item displaying a tile layer in a Qt Quick scene.
+ * A graphical item displaying one or more tile layers in a Qt Quick scene.
+ * When several layers are given, their tiles are combined into the same
+ * geometry, drawn in the order of the layers.
+ *
+ * The layer is divided into chunks of CHUNK_SIZE x CHUNK_SIZE tiles. The
+ * geometry of each chunk is created once and kept around while it is near
+ * the visible area, so that scrolling only attaches and detaches chunks.
+ * For isometric and staggered maps, chunks that fall outside of the visible
+ * area are culled based on their bounding rectangle on the screen.
+ *
+ * When cells of the layers change, only the chunks containing those cells
+ * are recreated (see invalidateTiles()).
+ *
+ * When the map is zoomed out far enough, a level of detail is set on the
+ * item. Each chunk is then drawn as a single quad showing a downscaled image
+ * of the chunk, which is rendered in a background thread. Until its image is
+ * ready, the chunk is drawn tile by tile.
+ *
+ * An item can also be restricted to a single row of tiles, which is used for
+ * the fringe layer so that the rows can be depth-sorted against the beings.
+ * In this case the chunks are CHUNK_SIZE tiles wide and one tile high.
+ *
+ * The same applies when the tiles of the layers are drawn outside of their
+ * cells, because they are larger than the grid or have an offset. Such tiles
+ * overlap the neighbouring chunks, and drawing the chunks row by row keeps
+ * them in the order in which the layers would be drawn as a whole.
  */
 class TileLayerItem : public QQuickItem
 {
     Q_OBJECT
 
 public:
+    /**
+     * The width and height of a chunk, in tiles.
+     */
+    static const int CHUNK_SIZE = 16;
+
     /**
      * Constructor.
      *
-     * @param layer    the tile layer to be displayed
-     * @param renderer the map renderer to use to render the layer
+     * @param layers   the tile layers to be displayed, which need to have the
+     *                 same bounds
+     * @param renderer the map renderer to use to render the layers
+     * @param row      the row of tiles to display, or -1 to display all rows
      */
-    TileLayerItem(Tiled::TileLayer *layer, Tiled::MapRenderer *renderer,
-                  MapItem *parent);
+    TileLayerItem(const QList<Tiled::TileLayer*> &layers,
+                  Tiled::MapRenderer *renderer,
+                  MapItem *parent,
+                  int row = -1);
+    ~TileLayerItem();
+
+    const QList<Tiled::TileLayer*> &layers() const;
+    int row() const;
+
+    /**
+     * Returns whether any of the tiles of the given \a layer are drawn
+     * outside of their cell, because they are larger than the grid or have
+     * an offset. Such tiles overlap the neighbouring chunks.
+     */
+    static bool tilesExceedCells(const Tiled::TileLayer *layer);
 
     /**
      * Updates the size and position of this item. Should be called when the
-     * size of either the tile layer or its associated map have changed.
+     * size of either the tile layers or their associated map have changed.
      *
      * Calling this function when the size of the map changes is necessary
      * because in certain map orientations this affects the layer position
@@ -58,39 +108,75 @@ public:
      */
     void syncWithTileLayer();
 
+    /**
+     * Marks the given \a region of cells as changed, so that the geometry of
+     * the chunks it overlaps is recreated. The region is in the local
+     * coordinates of the layers.
+     */
+    void invalidateTiles(const QRegion &region);
+
+    /**
+     * Sets the level of detail. At level 0 the tiles are drawn one by one,
+     * while at higher levels the chunks are drawn from images downscaled by
+     * a factor of 2 to the power of the level.
+     */
+    void setLodLevel(int level);
+    int lodLevel() const;
+
     QSGNode *updatePaintNode(QSGNode *node, UpdatePaintNodeData *);
 
 public slots:
     void updateVisibleTiles();
 
+private slots:
+    void lodImageReady(int generation, int index, const QImage &image);
+
 private:
-    Tiled::TileLayer *mLayer;
+    int chunkHeight() const;
+    QRect chunkRect(int x, int y) const;
+    bool isChunkVisible(QPoint chunkPos, int index) const;
+    QRect visibleChunks() const;
+    QSet<int> hiddenChunks(const QRect &chunks) const;
+    QMargins drawMargins() const;
+    bool tilesExceedCells() const;
+    QRect chunkBounds(int x, int y, const QMargins &drawMargins) const;
+    void requestLodImages();
+    void resetLodImages();
+
+    QList<Tiled::TileLayer*> mLayers;
     Tiled::MapRenderer *mRenderer;
-    QRect mVisibleTiles;
+    int mRow;
+    int mChunkHeight;
+    QRect mVisibleChunks;
+    QSet<int> mHiddenChunks;
+    QSet<int> mDirtyChunks;
+    bool mRebuildChunks;
+
+    int mLodLevel;
+    int mLodGeneration;
+    QHash<int, QImage> mLodImages;
+    QSet<int> mPendingLodImages;
+    QSharedPointer<LodGuard> mLodGuard;
 };
 
-/**
- * A graphical item displaying a single tile in a Qt Quick scene.
- */
-class TileItem : public QQuickItem
+inline const QList<Tiled::TileLayer*> &TileLayerItem::layers() const
 {
-    Q_OBJECT
-
-public:
-    TileItem(const Tiled::Cell &cell, QPoint position, MapItem *parent);
-
-    QSGNode *updatePaintNode(QSGNode *node, UpdatePaintNodeData *);
+    return mLayers;
+}
 
-    QPoint position() const;
+inline int TileLayerItem::row() const
+{
+    return mRow;
+}
 
-private:
-    Tiled::Cell mCell;
-    QPoint mPosition;
-};
+inline int TileLayerItem::lodLevel() const
+{
+    return mLodLevel;
+}
 
-inline QPoint TileItem::position() const
+inline int TileLayerItem::chunkHeight() const
 {
-    return mPosition;
+    return mChunkHeight;
 }
 
 } // namespace Mana
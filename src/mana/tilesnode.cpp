@@ -18,81 +18,300 @@
 
 #include "tilesnode.h"
 
+#include "renderstatistics.h"
+
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+
+#include <cstring>
+
+#if !defined(MANA_NO_SIMD)
+#  if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define MANA_SIMD_SSE2
+#    include <emmintrin.h>
+#  elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#    define MANA_SIMD_NEON
+#    include <arm_neon.h>
+#  endif
+#endif
+
 namespace Mana {
 
+namespace {
+
+/**
+ * The indices used to draw each tile as two triangles. Every TilesNode copies
+ * its indices from this pattern, which is computed only once.
+ */
+struct QuadIndexPattern
+{
+    QuadIndexPattern()
+        : indices(TilesNode::MAX_TILES * 6)
+    {
+        quint16 *i = indices.data();
+
+        for (int tile = 0; tile < TilesNode::MAX_TILES; ++tile) {
+            const quint16 v = tile * 4;
+
+            // TopLeft, BottomLeft, TopRight
+            i[0] = v;       i[1] = v + 1;   i[2] = v + 2;
+            // BottomLeft, BottomRight, TopRight
+            i[3] = v + 1;   i[4] = v + 3;   i[5] = v + 2;
+
+            i += 6;
+        }
+    }
+
+    QVector<quint16> indices;
+};
+
+Q_GLOBAL_STATIC(QuadIndexPattern, quadIndexPattern)
+
+/**
+ * Returns whether the vertex data can be uploaded once using StaticPattern.
+ * Since the tile data is never modified this makes sense, however this is
+ * causing issues on the Raspberry Pi (VideoCore), so it is avoided there.
+ */
+static bool staticVertexDataSupported()
+{
+    static int supported = -1;
+
+    if (supported == -1) {
+        QOpenGLContext *context = QOpenGLContext::currentContext();
+        if (!context)
+            return false;
+
+        const char *renderer = reinterpret_cast<const char *>(
+                    context->functions()->glGetString(GL_RENDERER));
+
+        supported = !(renderer && std::strstr(renderer, "VideoCore"));
+    }
+
+    return supported;
+}
+
+} // anonymous namespace
+
+void generateTileVerticesScalar(QSGGeometry::TexturedPoint2D *v,
+                                const TileData *tiles, int count,
+                                const QRectF &subRect, float s_x, float s_y)
+{
+    const float r_x = subRect.x();
+    const float r_y = subRect.y();
+
+    for (const TileData *data = tiles, *end = tiles + count; data != end; ++data) {
+        // Taking into account the normalized texture subrectancle
+        const float s_width = data->width * s_x;
+        const float s_height = data->height * s_y;
+        const float s_tx = r_x + data->tx * s_x;
+        const float s_ty = r_y + data->ty * s_y;
+
+        // TopLeft                      // TopRight
+        v[0].x = data->x;               v[2].x = data->x + data->width;
+        v[0].y = data->y;               v[2].y = data->y;
+        v[0].tx = s_tx;                 v[2].tx = s_tx + s_width;
+        v[0].ty = s_ty;                 v[2].ty = s_ty;
+
+        // BottomLeft                   // BottomRight
+        v[1].x = data->x;               v[3].x = data->x + data->width;
+        v[1].y = data->y + data->height; v[3].y = data->y + data->height;
+        v[1].tx = s_tx;                 v[3].tx = s_tx + s_width;
+        v[1].ty = s_ty + s_height;      v[3].ty = s_ty + s_height;
+
+        v += 4;
+    }
+}
+
+#if defined(MANA_SIMD_SSE2) || defined(MANA_SIMD_NEON)
+Q_STATIC_ASSERT(sizeof(TileData) == 6 * sizeof(float));
+Q_STATIC_ASSERT(sizeof(QSGGeometry::TexturedPoint2D) == 4 * sizeof(float));
+#endif
+
+#if defined(MANA_SIMD_SSE2)
+
+/*
+ * Each vertex is four floats (x, y, tx, ty), so a whole vertex fits in one
+ * register. From the tile position, size and texture position the top-left
+ * vertex and the offsets to the right and bottom vertices are computed, after
+ * which the four vertices are stored with three additions.
+ */
+void generateTileVertices(QSGGeometry::TexturedPoint2D *v,
+                          const TileData *tiles, int count,
+                          const QRectF &subRect, float s_x, float s_y)
+{
+    const __m128 scale = _mm_setr_ps(1, 1, s_x, s_y);
+    const __m128 offset = _mm_setr_ps(0, 0, subRect.x(), subRect.y());
+    const __m128 maskX = _mm_castsi128_ps(_mm_setr_epi32(-1, 0, -1, 0));
+    const __m128 maskY = _mm_castsi128_ps(_mm_setr_epi32(0, -1, 0, -1));
+
+    float *out = reinterpret_cast<float*>(v);
+
+    for (const TileData *data = tiles, *end = tiles + count; data != end; ++data) {
+        const float *in = &data->x;
+
+        // (x, y, width, height) and (tx, ty)
+        const __m128 rect = _mm_loadu_ps(in);
+        const __m128 texPos = _mm_loadl_pi(_mm_setzero_ps(),
+                                           reinterpret_cast<const __m64*>(in + 4));
+
+        // (x, y, tx, ty) and (width, height, width, height)
+        const __m128 pos = _mm_movelh_ps(rect, texPos);
+        const __m128 size = _mm_movehl_ps(rect, rect);
+
+        const __m128 topLeft = _mm_add_ps(_mm_mul_ps(pos, scale), offset);
+        const __m128 scaledSize = _mm_mul_ps(size, scale);
+        const __m128 dx = _mm_and_ps(scaledSize, maskX);
+        const __m128 dy = _mm_and_ps(scaledSize, maskY);
+        const __m128 topRight = _mm_add_ps(topLeft, dx);
+
+        _mm_storeu_ps(out, topLeft);
+        _mm_storeu_ps(out + 4, _mm_add_ps(topLeft, dy));
+        _mm_storeu_ps(out + 8, topRight);
+        _mm_storeu_ps(out + 12, _mm_add_ps(topRight, dy));
+
+        out += 16;
+    }
+}
+
+#elif defined(MANA_SIMD_NEON)
+
+/*
+ * The NEON version of the above, see the SSE2 version for the approach.
+ */
+void generateTileVertices(QSGGeometry::TexturedPoint2D *v,
+                          const TileData *tiles, int count,
+                          const QRectF &subRect, float s_x, float s_y)
+{
+    const float scaleValues[4] = { 1, 1, s_x, s_y };
+    const float offsetValues[4] = { 0, 0, float(subRect.x()), float(subRect.y()) };
+    const float maskXValues[4] = { 1, 0, 1, 0 };
+    const float maskYValues[4] = { 0, 1, 0, 1 };
+
+    const float32x4_t scale = vld1q_f32(scaleValues);
+    const float32x4_t offset = vld1q_f32(offsetValues);
+    const float32x4_t maskX = vld1q_f32(maskXValues);
+    const float32x4_t maskY = vld1q_f32(maskYValues);
+
+    float *out = reinterpret_cast<float*>(v);
+
+    for (const TileData *data = tiles, *end = tiles + count; data != end; ++data) {
+        const float *in = &data->x;
+
+        // (x, y, width, height) and (tx, ty)
+        const float32x4_t rect = vld1q_f32(in);
+        const float32x2_t texPos = vld1_f32(in + 4);
+
+        // (x, y, tx, ty) and (width, height, width, height)
+        const float32x4_t pos = vcombine_f32(vget_low_f32(rect), texPos);
+        const float32x4_t size = vcombine_f32(vget_high_f32(rect), vget_high_f32(rect));
+
+        const float32x4_t topLeft = vaddq_f32(vmulq_f32(pos, scale), offset);
+        const float32x4_t scaledSize = vmulq_f32(size, scale);
+        const float32x4_t dx = vmulq_f32(scaledSize, maskX);
+        const float32x4_t dy = vmulq_f32(scaledSize, maskY);
+        const float32x4_t topRight = vaddq_f32(topLeft, dx);
+
+        vst1q_f32(out, topLeft);
+        vst1q_f32(out + 4, vaddq_f32(topLeft, dy));
+        vst1q_f32(out + 8, topRight);
+        vst1q_f32(out + 12, vaddq_f32(topRight, dy));
+
+        out += 16;
+    }
+}
+
+#else
+
+void generateTileVertices(QSGGeometry::TexturedPoint2D *v,
+                          const TileData *tiles, int count,
+                          const QRectF &subRect, float s_x, float s_y)
+{
+    generateTileVerticesScalar(v, tiles, count, subRect, s_x, s_y);
+}
+
+#endif
+
 TilesNode::TilesNode(QSGTexture *texture, const QVector<TileData> &tileData)
-    : mGeometry(QSGGeometry::defaultAttributes_TexturedPoint2D(), 0)
+    : mGeometry(QSGGeometry::defaultAttributes_TexturedPoint2D(), 0, 0,
+                GL_UNSIGNED_SHORT)
 {
+    Q_ASSERT(tileData.size() <= MAX_TILES);
+
     setFlag(QSGNode::OwnedByParent);
 
     mMaterial.setTexture(texture);
     mOpaqueMaterial.setTexture(texture);
 
     mGeometry.setDrawingMode(GL_TRIANGLES);
+    mGeometry.setIndexDataPattern(QSGGeometry::StaticPattern);
 
-    // TODO: Using StaticPattern would make sense since the data is never
-    // being modified, however this is causing issues on the Raspberry Pi.
-    //mGeometry.setVertexDataPattern(QSGGeometry::StaticPattern);
+    if (staticVertexDataSupported())
+        mGeometry.setVertexDataPattern(QSGGeometry::StaticPattern);
 
     processTileData(tileData);
 
     setGeometry(&mGeometry);
     setMaterial(&mMaterial);
     setOpaqueMaterial(&mOpaqueMaterial);
+
+    RenderStatistics::add(RenderStatistics::NodesCreated, 1);
 }
 
-void TilesNode::processTileData(const QVector<TileData> &tileData)
+TilesNode::~TilesNode()
 {
-    const QSize s = mMaterial.texture()->textureSize();
-    const QRectF r = mMaterial.texture()->normalizedTextureSubRect();
+    RenderStatistics::add(RenderStatistics::NodesDestroyed, 1);
+}
 
-    const float s_x = r.width() / s.width();
-    const float s_y = r.height() / s.height();
+void TilesNode::setTexture(QSGTexture *texture)
+{
+    if (mMaterial.texture() == texture)
+        return;
 
-    // TODO: By using indices the memory usage could be reduced by 25%, at the
-    // cost of an additional indirection:
-    //
-    // Currently each tile takes:   6 * 16         = 96 bytes
-    // With indices it would take:  4 * 16 + 4 * 2 = 72 bytes
+    mMaterial.setTexture(texture);
+    mOpaqueMaterial.setTexture(texture);
+    markDirty(DirtyMaterial);
+}
 
-    // Two triangles to draw each tile
-    mGeometry.allocate(tileData.size() * 6);
-    QSGGeometry::TexturedPoint2D *v = mGeometry.vertexDataAsTexturedPoint2D();
+/**
+ * Replaces the tiles drawn by this node. The geometry is only reallocated
+ * when the number of tiles changes, otherwise just the vertices are
+ * rewritten. Since the tiles of the node are changing, the vertex data is
+ * no longer uploaded as static data.
+ */
+void TilesNode::setTileData(const QVector<TileData> &tileData)
+{
+    Q_ASSERT(tileData.size() <= MAX_TILES);
 
-    foreach (const TileData &data, tileData) {
-        // Taking into account the normalized texture subrectancle
-        const float s_width = data.width * s_x;
-        const float s_height = data.height * s_y;
-        const float s_tx = r.x() + data.tx * s_x;
-        const float s_ty = r.y() + data.ty * s_y;
+    mGeometry.setVertexDataPattern(QSGGeometry::DynamicPattern);
+    processTileData(tileData);
+}
 
-        // TopLeft                      // TopRight
-        v[0].x = data.x;                v[2].x = data.x + data.width;
-        v[0].y = data.y;                v[2].y = data.y;
-        v[0].tx = s_tx;                 v[2].tx = s_tx + s_width;
-        v[0].ty = s_ty;                 v[2].ty = s_ty;
+void TilesNode::processTileData(const QVector<TileData> &tileData)
+{
+    const QSize s = mMaterial.texture()->textureSize();
+    const QRectF r = mMaterial.texture()->normalizedTextureSubRect();
 
-        // BottomLeft
-        v[1].x = data.x;
-        v[1].y = data.y + data.height;
-        v[1].tx = s_tx;
-        v[1].ty = s_ty + s_height;
+    const float s_x = r.width() / s.width();
+    const float s_y = r.height() / s.height();
 
+    // Each tile takes 4 * 16 + 6 * 2 = 76 bytes, compared to the 6 * 16 = 96
+    // bytes it would take without using indices.
+    const int tileCount = tileData.size();
+    if (mGeometry.vertexCount() != tileCount * 4) {
+        mGeometry.allocate(tileCount * 4, tileCount * 6);
 
-                                        // TopRight
-                                        v[5].x = data.x + data.width;
-                                        v[5].y = data.y;
-                                        v[5].tx = s_tx + s_width;
-                                        v[5].ty = s_ty;
+        std::memcpy(mGeometry.indexDataAsUShort(),
+                    quadIndexPattern()->indices.constData(),
+                    tileCount * 6 * sizeof(quint16));
+    }
 
-        // BottomLeft                   // BottomRight
-        v[3].x = data.x;                v[4].x = data.x + data.width;
-        v[3].y = data.y + data.height;  v[4].y = data.y + data.height;
-        v[3].tx = s_tx;                 v[4].tx = s_tx + s_width;
-        v[3].ty = s_ty + s_height;      v[4].ty = s_ty + s_height;
+    generateTileVertices(mGeometry.vertexDataAsTexturedPoint2D(),
+                         tileData.constData(), tileCount, r, s_x, s_y);
 
-        v += 6;
-    }
+    RenderStatistics::add(RenderStatistics::Vertices, tileCount * 4);
+    RenderStatistics::add(RenderStatistics::BytesUploaded,
+                          mGeometry.vertexCount() * mGeometry.sizeOfVertex() +
+                          mGeometry.indexCount() * mGeometry.sizeOfIndex());
 
     markDirty(DirtyGeometry);
 }
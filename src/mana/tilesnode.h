@@ -33,12 +33,45 @@ struct TileData {
     float ty;
 };
 
+/**
+ * Fills in four vertices for each of the given \a tiles, in the order
+ * top-left, bottom-left, top-right, bottom-right. The texture coordinates are
+ * scaled by \a scaleX and \a scaleY and offset by the top-left of \a subRect.
+ *
+ * Uses SSE2 or NEON when available.
+ */
+void generateTileVertices(QSGGeometry::TexturedPoint2D *vertices,
+                          const TileData *tiles, int count,
+                          const QRectF &subRect, float scaleX, float scaleY);
+
+/**
+ * The scalar version of generateTileVertices, used when no SIMD instructions
+ * are available. Exposed for benchmarking.
+ */
+void generateTileVerticesScalar(QSGGeometry::TexturedPoint2D *vertices,
+                                const TileData *tiles, int count,
+                                const QRectF &subRect, float scaleX, float scaleY);
+
+/**
+ * A geometry node drawing a list of tiles from a single texture. Each tile is
+ * drawn as an indexed quad, using four vertices and six indices.
+ */
 class TilesNode : public QSGGeometryNode
 {
 public:
+    /**
+     * The maximum number of tiles that fit in a single node. This is limited
+     * by the use of 16-bit indices.
+     */
+    static const int MAX_TILES = 65536 / 4;
+
     TilesNode(QSGTexture *texture, const QVector<TileData> &tileData);
+    ~TilesNode();
 
     QSGTexture *texture() const;
+    void setTexture(QSGTexture *texture);
+
+    void setTileData(const QVector<TileData> &tileData);
 
 private:
     void processTileData(const QVector<TileData> &tileData);
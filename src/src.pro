@@ -8,7 +8,7 @@ else:macx:DESTDIR = ../example/tales.app/Contents/Resources/qml/Mana
 else:DESTDIR = qml/Mana/
 TARGET = mana
 
-QT += network qml quick
+QT += network qml quick gui-private
 
 DEFINES += QT_NO_URL_CAST_FROM_STRING
 
@@ -23,6 +23,17 @@ DEFINES += TILED_LIBRARY
 win32:INCLUDEPATH += $$(QTDIR)/src/3rdparty/zlib
 LIBS += -lz
 
+# Optional Zstandard and LZ4 compression of tile layer data, enabled by
+# running qmake with CONFIG+=zstd and CONFIG+=lz4
+zstd {
+    DEFINES += TILED_ZSTD_SUPPORT
+    LIBS += -lzstd
+}
+lz4 {
+    DEFINES += TILED_LZ4_SUPPORT
+    LIBS += -llz4
+}
+
 !win32-msvc2010 {
     # Silence compile warnings in ENet code
     # (this effectively excludes those types of warnings for C code)
@@ -57,10 +68,12 @@ SOURCES += \
     mana/monster.cpp \
     mana/npc.cpp \
     mana/questloglistmodel.cpp \
+    mana/renderstatistics.cpp \
     mana/resource/abilitydb.cpp \
     mana/resource/action.cpp \
     mana/resource/animation.cpp \
     mana/resource/attributedb.cpp \
+    mana/resource/compiledmap.cpp \
     mana/resource/hairdb.cpp \
     mana/resource/imageresource.cpp \
     mana/resource/imageset.cpp \
@@ -71,12 +84,15 @@ SOURCES += \
     mana/resource/racedb.cpp \
     mana/resource/resource.cpp \
     mana/resource/spritedef.cpp \
+    mana/resource/tilesetresource.cpp \
     mana/resourcelistmodel.cpp \
     mana/resourcemanager.cpp \
     mana/settings.cpp \
     mana/shoplistmodel.cpp \
+    mana/spritebatchitem.cpp \
     mana/spriteitem.cpp \
     mana/spritelistmodel.cpp \
+    mana/textureuploadqueue.cpp \
     mana/tilelayeritem.cpp \
     mana/tilesnode.cpp \
     tiled/compression.cpp \
@@ -121,10 +137,12 @@ HEADERS += \
     mana/npc.h \
     mana/protocol.h \
     mana/questloglistmodel.h \
+    mana/renderstatistics.h \
     mana/resource/abilitydb.h \
     mana/resource/action.h \
     mana/resource/animation.h \
     mana/resource/attributedb.h \
+    mana/resource/compiledmap.h \
     mana/resource/hairdb.h \
     mana/resource/imageresource.h \
     mana/resource/imageset.h \
@@ -135,12 +153,15 @@ HEADERS += \
     mana/resource/racedb.h \
     mana/resource/resource.h \
     mana/resource/spritedef.h \
+    mana/resource/tilesetresource.h \
     mana/resourcelistmodel.h \
     mana/resourcemanager.h \
     mana/settings.h \
     mana/shoplistmodel.h \
+    mana/spritebatchitem.h \
     mana/spriteitem.h \
     mana/spritelistmodel.h \
+    mana/textureuploadqueue.h \
     mana/tilelayeritem.h \
     mana/tilesnode.h \
     mana/xmlreader.h \
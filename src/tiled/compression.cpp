@@ -32,6 +32,14 @@
 #include <QByteArray>
 #include <QDebug>
 
+#ifdef TILED_ZSTD_SUPPORT
+#include <zstd.h>
+#endif
+
+#ifdef TILED_LZ4_SUPPORT
+#include <lz4frame.h>
+#endif
+
 using namespace Tiled;
 
 // TODO: Improve error reporting by showing these errors in the user interface
@@ -54,8 +62,71 @@ static void logZlibError(int error)
     }
 }
 
-QByteArray Tiled::decompress(const QByteArray &data, int expectedSize)
+bool Tiled::compressionSupported(CompressionMethod method)
 {
+    switch (method) {
+    case Gzip:
+    case Zlib:
+        return true;
+    case Zstandard:
+#ifdef TILED_ZSTD_SUPPORT
+        return true;
+#else
+        return false;
+#endif
+    case LZ4:
+#ifdef TILED_LZ4_SUPPORT
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+/**
+ * Decompresses the data using a Decompressor, for the methods that have no
+ * dedicated implementation.
+ */
+static QByteArray decompressInChunks(const QByteArray &data, int expectedSize,
+                                     CompressionMethod method)
+{
+    Decompressor decompressor(method);
+    decompressor.setInput(data.constData(), data.length());
+
+    QByteArray out;
+    out.resize(qMax(expectedSize, 1024));
+    int outLength = 0;
+
+    while (!decompressor.atEnd()) {
+        if (outLength == out.size())
+            out.resize(out.size() * 2);
+
+        const int length = decompressor.read(out.data() + outLength,
+                                             out.size() - outLength);
+        if (length < 0 || (length == 0 && decompressor.needsInput()
+                           && !decompressor.atEnd()))
+            return QByteArray();
+
+        outLength += length;
+    }
+
+    if (!decompressor.needsInput()) {
+        qDebug() << "Unexpected data after compressed data!";
+        return QByteArray();
+    }
+
+    out.resize(outLength);
+    return out;
+}
+
+QByteArray Tiled::decompress(const QByteArray &data, int expectedSize,
+                             CompressionMethod method)
+{
+    if (method == Zstandard || method == LZ4)
+        return decompressInChunks(data, expectedSize, method);
+
     QByteArray out;
     out.resize(expectedSize);
     z_stream strm;
@@ -113,6 +184,46 @@ QByteArray Tiled::decompress(const QByteArray &data, int expectedSize)
 
 QByteArray Tiled::compress(const QByteArray &data, CompressionMethod method)
 {
+    if (method == Zstandard) {
+#ifdef TILED_ZSTD_SUPPORT
+        QByteArray out;
+        out.resize(ZSTD_compressBound(data.length()));
+
+        const size_t size = ZSTD_compress(out.data(), out.size(),
+                                          data.constData(), data.length(),
+                                          ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(size)) {
+            qDebug() << "Error while compressing data:" << ZSTD_getErrorName(size);
+            return QByteArray();
+        }
+
+        out.resize(size);
+        return out;
+#else
+        qDebug() << "Zstandard compression is not supported!";
+        return QByteArray();
+#endif
+    } else if (method == LZ4) {
+#ifdef TILED_LZ4_SUPPORT
+        QByteArray out;
+        out.resize(LZ4F_compressFrameBound(data.length(), NULL));
+
+        const size_t size = LZ4F_compressFrame(out.data(), out.size(),
+                                               data.constData(), data.length(),
+                                               NULL);
+        if (LZ4F_isError(size)) {
+            qDebug() << "Error while compressing data:" << LZ4F_getErrorName(size);
+            return QByteArray();
+        }
+
+        out.resize(size);
+        return out;
+#else
+        qDebug() << "LZ4 compression is not supported!";
+        return QByteArray();
+#endif
+    }
+
     QByteArray out;
     out.resize(1024);
     int err;
@@ -160,3 +271,200 @@ QByteArray Tiled::compress(const QByteArray &data, CompressionMethod method)
     out.resize(outLength);
     return out;
 }
+
+namespace Tiled {
+
+class DecompressorPrivate
+{
+public:
+    CompressionMethod method;
+    bool initialized;
+    bool atEnd;
+
+    const char *input;
+    int inputLength;
+
+    z_stream strm;
+#ifdef TILED_ZSTD_SUPPORT
+    ZSTD_DStream *zstd;
+#endif
+#ifdef TILED_LZ4_SUPPORT
+    LZ4F_decompressionContext_t lz4;
+#endif
+};
+
+} // namespace Tiled
+
+Decompressor::Decompressor(CompressionMethod method)
+    : d(new DecompressorPrivate)
+{
+    d->method = method;
+    d->initialized = false;
+    d->atEnd = false;
+    d->input = 0;
+    d->inputLength = 0;
+
+    switch (method) {
+    case Gzip:
+    case Zlib: {
+        d->strm.zalloc = Z_NULL;
+        d->strm.zfree = Z_NULL;
+        d->strm.opaque = Z_NULL;
+        d->strm.next_in = Z_NULL;
+        d->strm.avail_in = 0;
+
+        // Both zlib and gzip headers are detected automatically
+        const int ret = inflateInit2(&d->strm, 15 + 32);
+        d->initialized = (ret == Z_OK);
+
+        if (!d->initialized)
+            logZlibError(ret);
+        break;
+    }
+    case Zstandard:
+#ifdef TILED_ZSTD_SUPPORT
+        d->zstd = ZSTD_createDStream();
+        d->initialized = d->zstd && !ZSTD_isError(ZSTD_initDStream(d->zstd));
+#endif
+        break;
+    case LZ4:
+#ifdef TILED_LZ4_SUPPORT
+        d->initialized = !LZ4F_isError(
+                    LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION));
+#endif
+        break;
+    }
+
+    if (!d->initialized && !compressionSupported(method))
+        qDebug() << "Unsupported compression method:" << method;
+}
+
+Decompressor::~Decompressor()
+{
+    switch (d->method) {
+    case Gzip:
+    case Zlib:
+        if (d->initialized)
+            inflateEnd(&d->strm);
+        break;
+    case Zstandard:
+#ifdef TILED_ZSTD_SUPPORT
+        ZSTD_freeDStream(d->zstd);
+#endif
+        break;
+    case LZ4:
+#ifdef TILED_LZ4_SUPPORT
+        if (d->initialized)
+            LZ4F_freeDecompressionContext(d->lz4);
+#endif
+        break;
+    }
+
+    delete d;
+}
+
+void Decompressor::setInput(const char *data, int length)
+{
+    d->input = data;
+    d->inputLength = length;
+}
+
+bool Decompressor::needsInput() const
+{
+    return d->inputLength == 0;
+}
+
+int Decompressor::read(char *data, int maxLength)
+{
+    if (!d->initialized)
+        return -1;
+    if (d->atEnd || maxLength == 0)
+        return 0;
+
+    switch (d->method) {
+    case Gzip:
+    case Zlib: {
+        d->strm.next_in = (Bytef *) d->input;
+        d->strm.avail_in = d->inputLength;
+        d->strm.next_out = (Bytef *) data;
+        d->strm.avail_out = maxLength;
+
+        int ret = inflate(&d->strm, Z_NO_FLUSH);
+
+        d->input = (const char *) d->strm.next_in;
+        d->inputLength = d->strm.avail_in;
+
+        switch (ret) {
+            case Z_NEED_DICT:
+            case Z_STREAM_ERROR:
+                ret = Z_DATA_ERROR;
+            case Z_DATA_ERROR:
+            case Z_MEM_ERROR:
+                logZlibError(ret);
+                return -1;
+            case Z_STREAM_END:
+                d->atEnd = true;
+                break;
+        }
+
+        // Z_BUF_ERROR just means no progress was possible without more input
+        return maxLength - d->strm.avail_out;
+    }
+    case Zstandard: {
+#ifdef TILED_ZSTD_SUPPORT
+        ZSTD_inBuffer in = { d->input, size_t(d->inputLength), 0 };
+        ZSTD_outBuffer out = { data, size_t(maxLength), 0 };
+
+        const size_t ret = ZSTD_decompressStream(d->zstd, &out, &in);
+
+        d->input += in.pos;
+        d->inputLength -= in.pos;
+
+        if (ZSTD_isError(ret)) {
+            qDebug() << "Error while decompressing data:" << ZSTD_getErrorName(ret);
+            return -1;
+        }
+
+        // A return value of 0 means the frame is complete
+        if (ret == 0)
+            d->atEnd = true;
+
+        return out.pos;
+#else
+        return -1;
+#endif
+    }
+    case LZ4: {
+#ifdef TILED_LZ4_SUPPORT
+        size_t outLength = maxLength;
+        size_t inLength = d->inputLength;
+
+        const size_t ret = LZ4F_decompress(d->lz4, data, &outLength,
+                                           d->input, &inLength, NULL);
+
+        d->input += inLength;
+        d->inputLength -= inLength;
+
+        if (LZ4F_isError(ret)) {
+            qDebug() << "Error while decompressing data:" << LZ4F_getErrorName(ret);
+            return -1;
+        }
+
+        // A return value of 0 means the frame is complete
+        if (ret == 0)
+            d->atEnd = true;
+
+        return outLength;
+#else
+        return -1;
+#endif
+    }
+    }
+
+    return -1;
+}
+
+bool Decompressor::atEnd() const
+{
+    return d->atEnd;
+}
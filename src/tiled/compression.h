@@ -35,14 +35,27 @@ class QByteArray;
 
 namespace Tiled {
 
+/**
+ * The supported compression methods. Zstandard and LZ4 are only available
+ * when building with TILED_ZSTD_SUPPORT and TILED_LZ4_SUPPORT respectively.
+ * LZ4 data uses the LZ4 frame format.
+ */
 enum CompressionMethod {
     Gzip,
-    Zlib
+    Zlib,
+    Zstandard,
+    LZ4
 };
 
 /**
- * Decompresses either zlib or gzip compressed memory. Returns a null
- * QByteArray if decompressing failed.
+ * Returns whether the given compression \a method is available in this build.
+ */
+bool TILEDSHARED_EXPORT compressionSupported(CompressionMethod method);
+
+/**
+ * Decompresses compressed memory. Returns a null QByteArray if decompressing
+ * failed. Zlib and gzip compressed data are both handled when \a method is
+ * either Zlib or Gzip.
  *
  * Needed because qUncompress does not support gzip compressed data. Also,
  * this method does not need the expected size to be prepended to the data,
@@ -50,14 +63,16 @@ enum CompressionMethod {
  *
  * @param data         the compressed data
  * @param expectedSize the expected size of the uncompressed data in bytes
+ * @param method       the compression method used for the data
  * @return the uncompressed data, or a null QByteArray if decompressing failed
  */
 QByteArray TILEDSHARED_EXPORT decompress(const QByteArray &data,
-                                         int expectedSize = 1024);
+                                         int expectedSize = 1024,
+                                         CompressionMethod method = Zlib);
 
 /**
- * Compresses the give data in either gzip or zlib format. Returns a null
- * QByteArray if compression failed.
+ * Compresses the give data using the given compression method. Returns a
+ * null QByteArray if compression failed.
  *
  * Needed because qCompress does not support gzip compression.
  *
@@ -67,6 +82,50 @@ QByteArray TILEDSHARED_EXPORT decompress(const QByteArray &data,
 QByteArray TILEDSHARED_EXPORT compress(const QByteArray &data,
                                        CompressionMethod method = Zlib);
 
+class DecompressorPrivate;
+
+/**
+ * Decompresses data in chunks. Unlike
+ * decompress(), this does not need the compressed or the uncompressed data
+ * to be available as a whole, which avoids large intermediate buffers.
+ *
+ * The compressed data is passed using setInput() whenever needsInput()
+ * returns true, and the uncompressed data is read until atEnd() returns true.
+ */
+class TILEDSHARED_EXPORT Decompressor
+{
+public:
+    explicit Decompressor(CompressionMethod method = Zlib);
+    ~Decompressor();
+
+    /**
+     * Sets the next chunk of compressed data. The data needs to stay valid
+     * until needsInput() returns true again.
+     */
+    void setInput(const char *data, int length);
+
+    /**
+     * Returns whether all compressed data passed so far has been consumed.
+     */
+    bool needsInput() const;
+
+    /**
+     * Decompresses up to \a maxLength bytes into \a data. Returns the number
+     * of bytes written, or -1 if decompressing failed.
+     */
+    int read(char *data, int maxLength);
+
+    /**
+     * Returns whether the end of the compressed data has been reached.
+     */
+    bool atEnd() const;
+
+private:
+    Q_DISABLE_COPY(Decompressor)
+
+    DecompressorPrivate *d;
+};
+
 } // namespace Tiled
 
 #endif // COMPRESSION_H
@@ -75,12 +75,14 @@ public:
      * The different formats in which the tile layer data can be stored.
      */
     enum LayerDataFormat {
-        Default    = -1,
-        XML        = 0,
-        Base64     = 1,
-        Base64Gzip = 2,
-        Base64Zlib = 3,
-        CSV        = 4
+        Default         = -1,
+        XML             = 0,
+        Base64          = 1,
+        Base64Gzip      = 2,
+        Base64Zlib      = 3,
+        CSV             = 4,
+        Base64Zstandard = 5,
+        Base64LZ4       = 6
     };
 
     /**
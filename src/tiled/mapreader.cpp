@@ -41,13 +41,21 @@
 #include "tileset.h"
 #include "terrain.h"
 
+#include <QAtomicInt>
 #include <QCoreApplication>
 #include <QDebug>
 #include <QDir>
 #include <QFileInfo>
+#include <QRect>
+#include <QRunnable>
+#include <QScopedPointer>
+#include <QSemaphore>
+#include <QThreadPool>
 #include <QVector>
 #include <QXmlStreamReader>
 
+#include <cstring>
+
 using namespace Tiled;
 using namespace Tiled::Internal;
 
@@ -75,6 +83,23 @@ public:
 
     QString errorString() const;
 
+    /**
+     * The encoded cells of a \a tileLayer within \a area, which are decoded
+     * into global tile IDs once the whole map has been read.
+     */
+    struct LayerData
+    {
+        TileLayer *tileLayer;
+        QRect area;
+        QString text;
+        QString encoding;
+        QString compression;
+        QVector<unsigned> gids;
+        QString error;
+    };
+
+    static void decodeLayerData(LayerData &data);
+
     bool mLazy;
 
 private:
@@ -90,10 +115,16 @@ private:
 
     TileLayer *readLayer();
     void readLayerData(TileLayer *tileLayer);
-    void decodeBinaryLayerData(TileLayer *tileLayer,
-                               const QStringRef &text,
+    void readLayerDataContents(TileLayer *tileLayer,
+                               const QRect &area,
+                               const QStringRef &encoding,
                                const QStringRef &compression);
-    void decodeCSVLayerData(TileLayer *tileLayer, const QString &text);
+    void readLayerChunk(TileLayer *tileLayer,
+                        const QStringRef &encoding,
+                        const QStringRef &compression);
+    void finishLayerData();
+    static void decodeBinaryLayerData(LayerData &data);
+    static void decodeCSVLayerData(LayerData &data);
 
     /**
      * Returns the cell for the given global tile ID. Errors are raised with
@@ -121,6 +152,7 @@ private:
     QString mPath;
     Map *mMap;
     QList<Tileset*> mCreatedTilesets;
+    QVector<LayerData> mLayerData;
     GidMapper mGidMapper;
     bool mReadingExternalTileset;
 
@@ -245,6 +277,11 @@ Map *MapReaderPrivate::readMap()
             readUnknownElement();
     }
 
+    // The layer data is decoded once all tilesets are known
+    if (!xml.hasError())
+        finishLayerData();
+    mLayerData.clear();
+
     // Clean up in case of error
     if (xml.hasError()) {
         // The tilesets are not owned by the map
@@ -548,10 +585,30 @@ void MapReaderPrivate::readLayerData(TileLayer *tileLayer)
                 mMap->setLayerDataFormat(Map::Base64Gzip);
             else if (compression == QLatin1String("zlib"))
                 mMap->setLayerDataFormat(Map::Base64Zlib);
+            else if (compression == QLatin1String("zstd"))
+                mMap->setLayerDataFormat(Map::Base64Zstandard);
+            else if (compression == QLatin1String("lz4"))
+                mMap->setLayerDataFormat(Map::Base64LZ4);
         }
         // else, error handled below
     }
 
+    readLayerDataContents(tileLayer,
+                          QRect(0, 0, tileLayer->width(), tileLayer->height()),
+                          encoding, compression);
+}
+
+/**
+ * Reads the cells of the given \a tileLayer within \a area, given either as
+ * <tile> elements, as encoded text or split up into <chunk> elements.
+ *
+ * Encoded text is only collected here, and decoded by finishLayerData().
+ */
+void MapReaderPrivate::readLayerDataContents(TileLayer *tileLayer,
+                                             const QRect &area,
+                                             const QStringRef &encoding,
+                                             const QStringRef &compression)
+{
     int x = 0;
     int y = 0;
 
@@ -560,32 +617,39 @@ void MapReaderPrivate::readLayerData(TileLayer *tileLayer)
             break;
         else if (xml.isStartElement()) {
             if (xml.name() == QLatin1String("tile")) {
-                if (y >= tileLayer->height()) {
+                if (y >= area.height()) {
                     xml.raiseError(tr("Too many <tile> elements"));
                     continue;
                 }
 
                 const QXmlStreamAttributes atts = xml.attributes();
                 unsigned gid = atts.value(QLatin1String("gid")).toString().toUInt();
-                tileLayer->setCell(x, y, cellForGid(gid));
+                if (tileLayer->contains(area.x() + x, area.y() + y))
+                    tileLayer->setCell(area.x() + x, area.y() + y,
+                                       cellForGid(gid));
 
                 x++;
-                if (x >= tileLayer->width()) {
+                if (x >= area.width()) {
                     x = 0;
                     y++;
                 }
 
                 xml.skipCurrentElement();
+            } else if (xml.name() == QLatin1String("chunk")) {
+                readLayerChunk(tileLayer, encoding, compression);
             } else {
                 readUnknownElement();
             }
         } else if (xml.isCharacters() && !xml.isWhitespace()) {
-            if (encoding == QLatin1String("base64")) {
-                decodeBinaryLayerData(tileLayer,
-                                      xml.text(),
-                                      compression);
-            } else if (encoding == QLatin1String("csv")) {
-                decodeCSVLayerData(tileLayer, xml.text().toString());
+            if (encoding == QLatin1String("base64") ||
+                    encoding == QLatin1String("csv")) {
+                LayerData data;
+                data.tileLayer = tileLayer;
+                data.area = area;
+                data.text = xml.text().toString();
+                data.encoding = encoding.toString();
+                data.compression = compression.toString();
+                mLayerData.append(data);
             } else {
                 xml.raiseError(tr("Unknown encoding: %1")
                                .arg(encoding.toString()));
@@ -595,79 +659,462 @@ void MapReaderPrivate::readLayerData(TileLayer *tileLayer)
     }
 }
 
-void MapReaderPrivate::decodeBinaryLayerData(TileLayer *tileLayer,
-                                             const QStringRef &text,
-                                             const QStringRef &compression)
+/**
+ * Reads a <chunk> element of the layer data, which holds the cells of a
+ * rectangle of the layer. The chunk position is relative to the layer, and
+ * parts of the chunk that fall outside of the layer are dropped.
+ */
+void MapReaderPrivate::readLayerChunk(TileLayer *tileLayer,
+                                      const QStringRef &encoding,
+                                      const QStringRef &compression)
 {
-#if QT_VERSION < 0x040800
-    const QString textData = QString::fromRawData(text.unicode(), text.size());
-    const QByteArray latin1Text = textData.toLatin1();
-#else
-    const QByteArray latin1Text = text.toLatin1();
-#endif
-    QByteArray tileData = QByteArray::fromBase64(latin1Text);
-    const int size = (tileLayer->width() * tileLayer->height()) * 4;
-
-    if (compression == QLatin1String("zlib")
-        || compression == QLatin1String("gzip")) {
-        tileData = decompress(tileData, size);
-    } else if (!compression.isEmpty()) {
-        xml.raiseError(tr("Compression method '%1' not supported")
-                       .arg(compression.toString()));
-        return;
-    }
+    Q_ASSERT(xml.isStartElement() && xml.name() == QLatin1String("chunk"));
+
+    const QXmlStreamAttributes atts = xml.attributes();
+    const int x = atts.value(QLatin1String("x")).toString().toInt();
+    const int y = atts.value(QLatin1String("y")).toString().toInt();
+    const int width = atts.value(QLatin1String("width")).toString().toInt();
+    const int height = atts.value(QLatin1String("height")).toString().toInt();
 
-    if (size != tileData.length()) {
-        xml.raiseError(tr("Corrupt layer data for layer '%1'")
+    if (width < 0 || height < 0) {
+        xml.raiseError(tr("Invalid chunk size on layer '%1'")
                        .arg(tileLayer->name()));
         return;
     }
 
-    const unsigned char *data =
-            reinterpret_cast<const unsigned char*>(tileData.constData());
-    int x = 0;
-    int y = 0;
+    readLayerDataContents(tileLayer, QRect(x, y, width, height),
+                          encoding, compression);
+}
+
+namespace {
+
+/**
+ * The values of the base64 characters, -1 for characters that are skipped
+ * and -2 for the padding character.
+ */
+static const signed char base64Values[128] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -2, -1, -1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1
+};
+
+/**
+ * Decodes base64 encoded text in chunks, so that the decoded data does not
+ * need to be stored as a whole. Characters outside of the base64 alphabet,
+ * like line breaks, are skipped and decoding stops at the padding.
+ */
+class Base64Decoder
+{
+public:
+    Base64Decoder(const QChar *text, int length)
+        : mText(text)
+        , mEnd(text + length)
+        , mBits(0)
+        , mBitCount(0)
+    {}
+
+    int decode(char *data, int maxLength);
+
+private:
+    static int valueOf(QChar c)
+    {
+        const ushort u = c.unicode();
+        return u < 128 ? base64Values[u] : -1;
+    }
+
+    const QChar *mText;
+    const QChar *mEnd;
+    unsigned mBits;
+    int mBitCount;
+};
+
+/**
+ * Decodes up to \a maxLength bytes into \a data, which needs to be at least
+ * 3 bytes. Returns the number of bytes written, which is 0 at the end of the
+ * text.
+ */
+int Base64Decoder::decode(char *data, int maxLength)
+{
+    char *out = data;
+    char *const end = data + maxLength;
+
+    while (mText != mEnd && end - out >= 3) {
+        // Fast path for four characters that decode to three whole bytes
+        if (mBitCount == 0 && mEnd - mText >= 4) {
+            const int a = valueOf(mText[0]);
+            const int b = valueOf(mText[1]);
+            const int c = valueOf(mText[2]);
+            const int d = valueOf(mText[3]);
+
+            if ((a | b | c | d) >= 0) {
+                const unsigned bits = a << 18 | b << 12 | c << 6 | d;
+                *out++ = char(bits >> 16);
+                *out++ = char(bits >> 8);
+                *out++ = char(bits);
+                mText += 4;
+                continue;
+            }
+        }
 
-    for (int i = 0; i < size - 3; i += 4) {
-        const unsigned gid = data[i] |
-                             data[i + 1] << 8 |
-                             data[i + 2] << 16 |
-                             data[i + 3] << 24;
+        const int value = valueOf(*mText++);
+        if (value == -2) {
+            mText = mEnd;
+            break;
+        } else if (value < 0) {
+            continue;
+        }
 
-        tileLayer->setCell(x, y, cellForGid(gid));
+        mBits = mBits << 6 | value;
+        mBitCount += 6;
 
-        x++;
-        if (x == tileLayer->width()) {
-            x = 0;
-            y++;
+        if (mBitCount >= 8) {
+            mBitCount -= 8;
+            *out++ = char(mBits >> mBitCount);
+            mBits &= (1 << mBitCount) - 1;
         }
     }
+
+    return out - data;
 }
 
-void MapReaderPrivate::decodeCSVLayerData(TileLayer *tileLayer, const QString &text)
+static bool compressionMethodFromString(const QString &compression,
+                                        CompressionMethod &method)
 {
-    QString trimText = text.trimmed();
-    QStringList tiles = trimText.split(QLatin1Char(','));
+    if (compression == QLatin1String("zlib"))
+        method = Zlib;
+    else if (compression == QLatin1String("gzip"))
+        method = Gzip;
+    else if (compression == QLatin1String("zstd"))
+        method = Zstandard;
+    else if (compression == QLatin1String("lz4"))
+        method = LZ4;
+    else
+        return false;
 
-    if (tiles.length() != tileLayer->width() * tileLayer->height()) {
-        xml.raiseError(tr("Corrupt layer data for layer '%1'")
-                       .arg(tileLayer->name()));
-        return;
+    return true;
+}
+
+/**
+ * Decodes the layer data collected while reading a map. The calling thread
+ * is helped by the threads of the global thread pool that are free. Helpers
+ * are never queued, so a reader that runs on the thread pool itself does not
+ * end up waiting for a thread.
+ *
+ * The decoded layers are taken in order with takeDecoded(), so that each of
+ * them can be applied and freed as soon as it is done.
+ */
+class LayerDataDecoder
+{
+public:
+    explicit LayerDataDecoder(QVector<MapReaderPrivate::LayerData> &layerData)
+        : mLayerData(layerData.data())
+        , mCount(layerData.size())
+        , mDecoded(layerData.size())
+        , mNext(0)
+        , mTaken(0)
+        , mHelpers(0)
+    {}
+
+    ~LayerDataDecoder();
+
+    void start();
+    MapReaderPrivate::LayerData *takeDecoded();
+    void help();
+
+private:
+    bool decodeNext();
+
+    MapReaderPrivate::LayerData *mLayerData;
+    const int mCount;
+    QVector<QAtomicInt> mDecoded;
+    QAtomicInt mNext;
+    int mTaken;
+    int mHelpers;
+    QSemaphore mLayersDecoded;
+    QSemaphore mHelpersFinished;
+};
+
+class LayerDataJob : public QRunnable
+{
+public:
+    explicit LayerDataJob(LayerDataDecoder *decoder)
+        : mDecoder(decoder)
+    {}
+
+    void run() { mDecoder->help(); }
+
+private:
+    LayerDataDecoder *mDecoder;
+};
+
+/**
+ * Waits for the helpers. Layers that were not started yet are skipped.
+ */
+LayerDataDecoder::~LayerDataDecoder()
+{
+    mNext.fetchAndStoreRelaxed(mCount);
+    mHelpersFinished.acquire(mHelpers);
+}
+
+void LayerDataDecoder::start()
+{
+    QThreadPool *pool = QThreadPool::globalInstance();
+
+    for (int i = 1; i < mCount; ++i) {
+        LayerDataJob *job = new LayerDataJob(this);
+        if (!pool->tryStart(job)) {
+            delete job;
+            break;
+        }
+        ++mHelpers;
+    }
+}
+
+/**
+ * Returns the next layer in order once it has been decoded, or 0 when all
+ * layers have been taken. Decodes layers while waiting for it.
+ */
+MapReaderPrivate::LayerData *LayerDataDecoder::takeDecoded()
+{
+    if (mTaken == mCount)
+        return 0;
+
+    while (!mDecoded[mTaken].loadAcquire()) {
+        // Once all layers are claimed, a helper is still busy with this one
+        if (!decodeNext())
+            mLayersDecoded.acquire();
+    }
+
+    return &mLayerData[mTaken++];
+}
+
+void LayerDataDecoder::help()
+{
+    while (decodeNext())
+        mLayersDecoded.release();
+
+    mHelpersFinished.release();
+}
+
+/**
+ * Claims and decodes the next layer that was not started yet. Returns false
+ * when there is none left.
+ */
+bool LayerDataDecoder::decodeNext()
+{
+    const int index = mNext.fetchAndAddRelaxed(1);
+    if (index >= mCount)
+        return false;
+
+    MapReaderPrivate::decodeLayerData(mLayerData[index]);
+    mDecoded[index].storeRelease(1);
+    return true;
+}
+
+} // anonymous namespace
+
+/**
+ * Decodes the layer data collected while reading the map, and sets the cells
+ * of the layers. The layers are decoded in parallel. Their global tile IDs
+ * are turned into cells on this thread, since that may change tilesets.
+ *
+ * Each layer is applied as soon as it has been decoded, after which its
+ * global tile IDs are freed.
+ */
+void MapReaderPrivate::finishLayerData()
+{
+    LayerDataDecoder decoder(mLayerData);
+    decoder.start();
+
+    while (LayerData *data = decoder.takeDecoded()) {
+        if (!data->error.isEmpty()) {
+            xml.raiseError(data->error);
+            break;
+        }
+
+        TileLayer *tileLayer = data->tileLayer;
+        const QRect &area = data->area;
+        const unsigned *gid = data->gids.constData();
+
+        for (int y = area.top(); y <= area.bottom(); ++y) {
+            for (int x = area.left(); x <= area.right(); ++x, ++gid) {
+                // Cells start out empty
+                if (*gid && tileLayer->contains(x, y))
+                    tileLayer->setCell(x, y, cellForGid(*gid));
+            }
+        }
+
+        data->gids = QVector<unsigned>();
+
+        if (xml.hasError())
+            break;
+    }
+}
+
+/**
+ * Decodes the text of the given layer \a data into global tile IDs. Errors
+ * are stored with the data. Called from multiple threads at once.
+ */
+void MapReaderPrivate::decodeLayerData(LayerData &data)
+{
+    if (data.encoding == QLatin1String("base64"))
+        decodeBinaryLayerData(data);
+    else
+        decodeCSVLayerData(data);
+
+    // Free the text as early as possible
+    data.text.clear();
+}
+
+void MapReaderPrivate::decodeBinaryLayerData(LayerData &data)
+{
+    QScopedPointer<Decompressor> decompressor;
+
+    if (!data.compression.isEmpty()) {
+        CompressionMethod method;
+        if (!compressionMethodFromString(data.compression, method)
+                || !compressionSupported(method)) {
+            data.error = tr("Compression method '%1' not supported")
+                    .arg(data.compression);
+            return;
+        }
+
+        decompressor.reset(new Decompressor(method));
     }
 
-    for (int y = 0; y < tileLayer->height(); y++) {
-        for (int x = 0; x < tileLayer->width(); x++) {
-            bool conversionOk;
-            const unsigned gid = tiles.at(y * tileLayer->width() + x)
-                    .toUInt(&conversionOk);
-            if (!conversionOk) {
-                xml.raiseError(
-                        tr("Unable to parse tile at (%1,%2) on layer '%3'")
-                               .arg(x + 1).arg(y + 1).arg(tileLayer->name()));
-                return;
+    const int cellCount = data.area.width() * data.area.height();
+    data.gids.resize(cellCount);
+    unsigned *gids = data.gids.data();
+
+    // The text is decoded and decompressed in chunks, which are directly
+    // turned into global tile IDs
+    Base64Decoder base64(data.text.unicode(), data.text.size());
+    char input[4096];
+    char output[4096];
+    int outputLength = 0;
+    int index = 0;
+    bool corrupt = false;
+
+    forever {
+        int length;
+
+        if (decompressor) {
+            if (decompressor->atEnd())
+                break;
+
+            // Without input left, the decompressor may still have buffered
+            // data, but it is corrupt when it does not get to the end
+            bool endOfInput = false;
+
+            if (decompressor->needsInput()) {
+                const int inputLength = base64.decode(input, sizeof(input));
+                endOfInput = inputLength == 0;
+                decompressor->setInput(input, inputLength);
             }
-            tileLayer->setCell(x, y, cellForGid(gid));
+
+            length = decompressor->read(output + outputLength,
+                                        sizeof(output) - outputLength);
+            if (length < 0 || (length == 0 && endOfInput)) {
+                corrupt = true;
+                break;
+            }
+        } else {
+            length = base64.decode(output + outputLength,
+                                   sizeof(output) - outputLength);
+            if (length == 0)
+                break;
+        }
+
+        // Global tile IDs may be split between chunks
+        outputLength += length;
+        const int complete = outputLength & ~3;
+
+        if (index + complete / 4 > cellCount) {
+            corrupt = true;
+            break;
+        }
+
+        const unsigned char *bytes =
+                reinterpret_cast<const unsigned char*>(output);
+
+        for (int i = 0; i < complete; i += 4) {
+            gids[index++] = bytes[i] |
+                            bytes[i + 1] << 8 |
+                            bytes[i + 2] << 16 |
+                            bytes[i + 3] << 24;
         }
+
+        outputLength -= complete;
+        memmove(output, output + complete, outputLength);
+    }
+
+    if (corrupt || outputLength != 0 || index != cellCount
+            || (decompressor && !decompressor->needsInput())) {
+        data.error = tr("Corrupt layer data for layer '%1'")
+                .arg(data.tileLayer->name());
+    }
+}
+
+void MapReaderPrivate::decodeCSVLayerData(LayerData &data)
+{
+    const QChar *c = data.text.unicode();
+    const QChar *const end = c + data.text.size();
+    const int width = data.area.width();
+    const int cellCount = width * data.area.height();
+    int index = 0;
+
+    data.gids.resize(cellCount);
+    unsigned *gids = data.gids.data();
+
+    // Tokenize the text in place rather than splitting it into strings
+    while (c != end) {
+        while (c != end && c->isSpace())
+            ++c;
+        if (c == end)
+            break;
+
+        if (index >= cellCount) {
+            data.error = tr("Corrupt layer data for layer '%1'")
+                    .arg(data.tileLayer->name());
+            return;
+        }
+
+        quint64 gid = 0;
+        bool conversionOk = false;
+
+        while (c != end && c->unicode() >= '0' && c->unicode() <= '9') {
+            gid = gid * 10 + (c->unicode() - '0');
+            conversionOk = gid <= 0xFFFFFFFF;
+            ++c;
+        }
+
+        while (c != end && c->isSpace())
+            ++c;
+        if (c != end) {
+            if (*c == QLatin1Char(','))
+                ++c;
+            else
+                conversionOk = false;
+        }
+
+        if (!conversionOk) {
+            data.error = tr("Unable to parse tile at (%1,%2) on layer '%3'")
+                    .arg(index % width + 1).arg(index / width + 1)
+                    .arg(data.tileLayer->name());
+            return;
+        }
+
+        gids[index++] = unsigned(gid);
+    }
+
+    if (index != cellCount) {
+        data.error = tr("Corrupt layer data for layer '%1'")
+                .arg(data.tileLayer->name());
     }
 }
 
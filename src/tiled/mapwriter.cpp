@@ -348,7 +348,9 @@ void MapWriterPrivate::writeTileLayer(QXmlStreamWriter &w,
 
     if (mLayerDataFormat == Map::Base64
             || mLayerDataFormat == Map::Base64Gzip
-            || mLayerDataFormat == Map::Base64Zlib) {
+            || mLayerDataFormat == Map::Base64Zlib
+            || mLayerDataFormat == Map::Base64Zstandard
+            || mLayerDataFormat == Map::Base64LZ4) {
 
         encoding = QLatin1String("base64");
 
@@ -356,6 +358,10 @@ void MapWriterPrivate::writeTileLayer(QXmlStreamWriter &w,
             compression = QLatin1String("gzip");
         else if (mLayerDataFormat == Map::Base64Zlib)
             compression = QLatin1String("zlib");
+        else if (mLayerDataFormat == Map::Base64Zstandard)
+            compression = QLatin1String("zstd");
+        else if (mLayerDataFormat == Map::Base64LZ4)
+            compression = QLatin1String("lz4");
 
     } else if (mLayerDataFormat == Map::CSV)
         encoding = QLatin1String("csv");
@@ -409,6 +415,10 @@ void MapWriterPrivate::writeTileLayer(QXmlStreamWriter &w,
             tileData = compress(tileData, Gzip);
         else if (mLayerDataFormat == Map::Base64Zlib)
             tileData = compress(tileData, Zlib);
+        else if (mLayerDataFormat == Map::Base64Zstandard)
+            tileData = compress(tileData, Zstandard);
+        else if (mLayerDataFormat == Map::Base64LZ4)
+            tileData = compress(tileData, LZ4);
 
         w.writeCharacters(QLatin1String("\n   "));
         w.writeCharacters(QString::fromLatin1(tileData.toBase64()));
@@ -33,15 +33,168 @@
 #include "tile.h"
 #include "tileset.h"
 
+#include <QDebug>
+
 using namespace Tiled;
 
-TileLayer::TileLayer(const QString &name, int x, int y, int width, int height):
+/**
+ * The width and height of the chunks of sparse tile layers.
+ */
+static const int CHUNK_SIZE = 16;
+
+namespace {
+
+/**
+ * Switches a sparse tile layer to dense storage for as long as it exists,
+ * for the operations that rebuild the whole grid.
+ */
+class DenseScope
+{
+public:
+    explicit DenseScope(TileLayer *layer)
+        : mLayer(layer)
+        , mSparse(layer->isSparse())
+    {
+        mLayer->setSparse(false);
+    }
+
+    ~DenseScope()
+    {
+        mLayer->setSparse(mSparse);
+    }
+
+private:
+    TileLayer *mLayer;
+    bool mSparse;
+};
+
+} // anonymous namespace
+
+TileLayer::CellIterator::CellIterator(const TileLayer *layer,
+                                      const QRect &rect)
+    : mLayer(layer)
+    , mRect(rect & QRect(0, 0, layer->width(), layer->height()))
+    , mX(mRect.left() - 1)
+    , mY(mRect.top())
+    , mChunkColumn(0)
+    , mRunEnd(0)
+    , mCellBase(0)
+{
+    if (mLayer->mSparse && !mRect.isEmpty()) {
+        mCursors.resize(mRect.right() / CHUNK_SIZE -
+                        mRect.left() / CHUNK_SIZE + 1);
+
+        // Makes nextRun() start at the first chunk of the top row
+        mChunkColumn = mCursors.size() - 1;
+        mY = mRect.top() - 1;
+    }
+}
+
+bool TileLayer::CellIterator::next()
+{
+    if (mRect.isEmpty())
+        return false;
+
+    if (!mLayer->mSparse) {
+        for (;;) {
+            if (++mX > mRect.right()) {
+                mX = mRect.left();
+                if (++mY > mRect.bottom())
+                    return false;
+            }
+
+            mCell = mLayer->mGrid.at(mX + mY * mLayer->mWidth);
+            if (!mCell.isEmpty())
+                return true;
+        }
+    }
+
+    for (;;) {
+        // Runs may contain empty cells, when tilesets have been removed
+        while (++mX < mRunEnd) {
+            mCell = mLayer->mGrid.at(mCellBase + mX);
+            if (!mCell.isEmpty())
+                return true;
+        }
+
+        if (!nextRun())
+            return false;
+    }
+}
+
+/**
+ * Moves to the next run overlapping the rectangle, clipped to it.
+ */
+bool TileLayer::CellIterator::nextRun()
+{
+    const int firstChunkColumn = mRect.left() / CHUNK_SIZE;
+    const int chunkColumns = mLayer->chunkColumns();
+    const QVector<int> &chunkRuns = mLayer->mChunkRuns;
+    const QVector<SparseRun> &runs = mLayer->mRuns;
+
+    for (;;) {
+        const int chunkX = firstChunkColumn + mChunkColumn;
+        const int chunk = chunkX + (mY / CHUNK_SIZE) * chunkColumns;
+        const int chunkY = mY % CHUNK_SIZE;
+
+        if (mY >= mRect.top()) {
+            int &cursor = mCursors[mChunkColumn];
+            const int end = chunkRuns.at(chunk + 1);
+
+            while (cursor < end) {
+                const SparseRun &run = runs.at(cursor);
+                if (run.y > chunkY)
+                    break;
+
+                ++cursor;
+                if (run.y < chunkY)
+                    continue;
+
+                const int runLeft = chunkX * CHUNK_SIZE + run.x;
+                const int left = qMax(runLeft, mRect.left());
+                const int right = qMin(runLeft + run.length, mRect.right() + 1);
+                if (left >= right)
+                    continue;
+
+                mX = left - 1;
+                mRunEnd = right;
+                mCellBase = run.cell - runLeft;
+                return true;
+            }
+        }
+
+        // Move on to the next chunk, or to the next row
+        if (++mChunkColumn == mCursors.size()) {
+            mChunkColumn = 0;
+            if (++mY > mRect.bottom())
+                return false;
+
+            // Rewind the cursors when entering a new row of chunks
+            if (mY == mRect.top() || mY % CHUNK_SIZE == 0) {
+                const int row = (mY / CHUNK_SIZE) * chunkColumns;
+                for (int i = 0; i < mCursors.size(); ++i)
+                    mCursors[i] = chunkRuns.at(row + firstChunkColumn + i);
+            }
+        }
+    }
+}
+
+TileLayer::TileLayer(const QString &name, int x, int y, int width, int height,
+                     Storage storage):
     Layer(TileLayerType, name, x, y, width, height),
     mMaxTileSize(0, 0),
-    mGrid(width * height)
+    mSparse(storage == SparseStorage),
+    mChangeTracking(false)
 {
     Q_ASSERT(width >= 0);
     Q_ASSERT(height >= 0);
+
+    if (mSparse) {
+        const int rows = (height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        mChunkRuns.fill(0, chunkColumns() * rows + 1);
+    } else {
+        mGrid.resize(width * height);
+    }
 }
 
 QRegion TileLayer::region() const
@@ -50,10 +203,10 @@ QRegion TileLayer::region() const
 
     for (int y = 0; y < mHeight; ++y) {
         for (int x = 0; x < mWidth; ++x) {
-            if (!cellAt(x, y).isEmpty()) {
+            if (!packedCellAt(x, y).isEmpty()) {
                 const int rangeStart = x;
                 for (++x; x <= mWidth; ++x) {
-                    if (x == mWidth || cellAt(x, y).isEmpty()) {
+                    if (x == mWidth || packedCellAt(x, y).isEmpty()) {
                         const int rangeEnd = x;
                         region += QRect(rangeStart + mX, y + mY,
                                         rangeEnd - rangeStart, 1);
@@ -87,10 +240,345 @@ void TileLayer::setCell(int x, int y, const Cell &cell)
 {
     Q_ASSERT(contains(x, y));
 
-    mGrid[x + y * mWidth] = cell;
+    const PackedCell packed = pack(cell);
+
+    if (mChangeTracking) {
+        if (packedCellAt(x, y) == packed)
+            return;
+        mDirtyRegion += QRect(x, y, 1, 1);
+    }
+
+    if (mSparse)
+        setSparseCell(x, y, packed);
+    else
+        mGrid[x + y * mWidth] = packed;
+
     adjustDrawMargins(cell);
 }
 
+void TileLayer::setSparse(bool sparse)
+{
+    if (mSparse == sparse)
+        return;
+
+    const int columns = chunkColumns();
+    const int rows = (mHeight + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    if (sparse) {
+        QVector<SparseRun> runs;
+        QVector<PackedCell> runCells;
+        QVector<int> chunkRuns;
+        chunkRuns.reserve(columns * rows + 1);
+
+        for (int chunkY = 0; chunkY < rows; ++chunkY) {
+            for (int chunkX = 0; chunkX < columns; ++chunkX) {
+                const int left = chunkX * CHUNK_SIZE;
+                const int top = chunkY * CHUNK_SIZE;
+
+                chunkRuns.append(runs.size());
+                appendRuns(mGrid.constData() + left + top * mWidth, mWidth,
+                           qMin(CHUNK_SIZE, mWidth - left),
+                           qMin(CHUNK_SIZE, mHeight - top),
+                           runs, runCells);
+            }
+        }
+        chunkRuns.append(runs.size());
+
+        mGrid = runCells;
+        mChunkRuns = chunkRuns;
+        mRuns = runs;
+    } else {
+        QVector<PackedCell> grid(mWidth * mHeight);
+
+        for (int chunk = 0; chunk < columns * rows; ++chunk) {
+            const int left = (chunk % columns) * CHUNK_SIZE;
+            const int top = (chunk / columns) * CHUNK_SIZE;
+
+            for (int i = mChunkRuns.at(chunk), end = mChunkRuns.at(chunk + 1);
+                 i < end; ++i) {
+                const SparseRun &run = mRuns.at(i);
+                PackedCell *dest = grid.data() + left + run.x +
+                        (top + run.y) * mWidth;
+                for (int j = 0; j < run.length; ++j)
+                    dest[j] = mGrid.at(run.cell + j);
+            }
+        }
+
+        mGrid = grid;
+        mChunkRuns.clear();
+        mRuns.clear();
+    }
+
+    mSparse = sparse;
+}
+
+qint64 TileLayer::cellMemoryUsage() const
+{
+    return qint64(mGrid.capacity()) * sizeof(PackedCell) +
+            qint64(mChunkRuns.capacity()) * sizeof(int) +
+            qint64(mRuns.capacity()) * sizeof(SparseRun);
+}
+
+int TileLayer::chunkColumns() const
+{
+    return (mWidth + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+PackedCell TileLayer::sparseCellAt(int x, int y) const
+{
+    const int chunk = x / CHUNK_SIZE + (y / CHUNK_SIZE) * chunkColumns();
+    const int chunkX = x % CHUNK_SIZE;
+    const int chunkY = y % CHUNK_SIZE;
+
+    for (int i = mChunkRuns.at(chunk), end = mChunkRuns.at(chunk + 1);
+         i < end; ++i) {
+        const SparseRun &run = mRuns.at(i);
+        if (run.y > chunkY)
+            break;
+        if (run.y == chunkY && chunkX >= run.x && chunkX < run.x + run.length)
+            return mGrid.at(run.cell + chunkX - run.x);
+    }
+
+    return PackedCell();
+}
+
+/**
+ * Sets a cell of a sparse layer. Cells within an existing run are replaced
+ * in place, otherwise the runs of the chunk are encoded again.
+ */
+void TileLayer::setSparseCell(int x, int y, const PackedCell &cell)
+{
+    const int chunk = x / CHUNK_SIZE + (y / CHUNK_SIZE) * chunkColumns();
+    const int chunkX = x % CHUNK_SIZE;
+    const int chunkY = y % CHUNK_SIZE;
+    const int runsBegin = mChunkRuns.at(chunk);
+    const int runsEnd = mChunkRuns.at(chunk + 1);
+
+    for (int i = runsBegin; i < runsEnd; ++i) {
+        const SparseRun &run = mRuns.at(i);
+        if (run.y == chunkY && chunkX >= run.x && chunkX < run.x + run.length) {
+            mGrid[run.cell + chunkX - run.x] = cell;
+            return;
+        }
+    }
+
+    if (cell.isEmpty())
+        return;
+
+    // Decode the chunk, set the cell and encode the chunk again
+    PackedCell cells[CHUNK_SIZE * CHUNK_SIZE];
+    for (int i = runsBegin; i < runsEnd; ++i) {
+        const SparseRun &run = mRuns.at(i);
+        for (int j = 0; j < run.length; ++j)
+            cells[run.x + j + run.y * CHUNK_SIZE] = mGrid.at(run.cell + j);
+    }
+    cells[chunkX + chunkY * CHUNK_SIZE] = cell;
+
+    const int left = x - chunkX;
+    const int top = y - chunkY;
+    QVector<SparseRun> runs;
+    QVector<PackedCell> runCells;
+    appendRuns(cells, CHUNK_SIZE,
+               qMin(CHUNK_SIZE, mWidth - left),
+               qMin(CHUNK_SIZE, mHeight - top),
+               runs, runCells);
+
+    // The cells of an empty chunk go where those of the next chunk start
+    const int cellsBegin = runsBegin < mRuns.size() ? mRuns.at(runsBegin).cell
+                                                    : mGrid.size();
+    const int cellsEnd = runsEnd < mRuns.size() ? mRuns.at(runsEnd).cell
+                                                : mGrid.size();
+
+    for (int i = 0; i < runs.size(); ++i)
+        runs[i].cell += cellsBegin;
+
+    const int runDelta = runs.size() - (runsEnd - runsBegin);
+    const int cellDelta = runCells.size() - (cellsEnd - cellsBegin);
+
+    mRuns = mRuns.mid(0, runsBegin) + runs + mRuns.mid(runsEnd);
+    mGrid = mGrid.mid(0, cellsBegin) + runCells + mGrid.mid(cellsEnd);
+
+    for (int i = runsBegin + runs.size(); i < mRuns.size(); ++i)
+        mRuns[i].cell += cellDelta;
+    for (int i = chunk + 1; i < mChunkRuns.size(); ++i)
+        mChunkRuns[i] += runDelta;
+}
+
+/**
+ * Sets the cells of a sparse layer within \a area to those of \a source at
+ * \a sourcePos, or erases them when no source is given. The runs of all
+ * chunks are rebuilt in one go, which is a lot faster than setting many
+ * cells one by one.
+ */
+void TileLayer::setSparseCells(const QRect &area, const TileLayer *source,
+                               const QPoint &sourcePos)
+{
+    const int columns = chunkColumns();
+    const int chunkCount = mChunkRuns.size() - 1;
+
+    QVector<SparseRun> runs;
+    QVector<PackedCell> runCells;
+    QVector<int> chunkRuns;
+    runs.reserve(mRuns.size());
+    runCells.reserve(mGrid.size());
+    chunkRuns.reserve(chunkCount + 1);
+
+    for (int chunk = 0; chunk < chunkCount; ++chunk) {
+        const int left = (chunk % columns) * CHUNK_SIZE;
+        const int top = (chunk / columns) * CHUNK_SIZE;
+        const QRect chunkRect(left, top,
+                              qMin(CHUNK_SIZE, mWidth - left),
+                              qMin(CHUNK_SIZE, mHeight - top));
+        const int runsBegin = mChunkRuns.at(chunk);
+        const int runsEnd = mChunkRuns.at(chunk + 1);
+
+        chunkRuns.append(runs.size());
+
+        // Chunks outside of the area keep their runs
+        if (!chunkRect.intersects(area)) {
+            for (int i = runsBegin; i < runsEnd; ++i) {
+                SparseRun run = mRuns.at(i);
+                const int cell = run.cell;
+                run.cell = runCells.size();
+                runs.append(run);
+                for (int j = 0; j < run.length; ++j)
+                    runCells.append(mGrid.at(cell + j));
+            }
+            continue;
+        }
+
+        PackedCell cells[CHUNK_SIZE * CHUNK_SIZE];
+        for (int i = runsBegin; i < runsEnd; ++i) {
+            const SparseRun &run = mRuns.at(i);
+            for (int j = 0; j < run.length; ++j)
+                cells[run.x + j + run.y * CHUNK_SIZE] = mGrid.at(run.cell + j);
+        }
+
+        const QRect overlap = chunkRect & area;
+        for (int y = overlap.top(); y <= overlap.bottom(); ++y) {
+            for (int x = overlap.left(); x <= overlap.right(); ++x) {
+                PackedCell &cell = cells[x - left + (y - top) * CHUNK_SIZE];
+
+                if (source) {
+                    const Cell sourceCell = source->cellAt(x - sourcePos.x(),
+                                                           y - sourcePos.y());
+                    cell = pack(sourceCell);
+                    adjustDrawMargins(sourceCell);
+                } else {
+                    cell = PackedCell();
+                }
+            }
+        }
+
+        appendRuns(cells, CHUNK_SIZE, chunkRect.width(), chunkRect.height(),
+                   runs, runCells);
+    }
+    chunkRuns.append(runs.size());
+
+    mGrid = runCells;
+    mChunkRuns = chunkRuns;
+    mRuns = runs;
+
+    if (mChangeTracking)
+        mDirtyRegion += area;
+}
+
+/**
+ * Appends the runs of non-empty cells found in the given area of \a cells,
+ * with their cell indexes relative to the start of \a runCells.
+ */
+void TileLayer::appendRuns(const PackedCell *cells, int stride,
+                           int width, int height,
+                           QVector<SparseRun> &runs,
+                           QVector<PackedCell> &runCells)
+{
+    for (int y = 0; y < height; ++y) {
+        const PackedCell *row = cells + y * stride;
+
+        for (int x = 0; x < width; ++x) {
+            if (row[x].isEmpty())
+                continue;
+
+            SparseRun run;
+            run.x = x;
+            run.y = y;
+            run.cell = runCells.size();
+
+            while (x < width && !row[x].isEmpty())
+                runCells.append(row[x++]);
+
+            run.length = x - run.x;
+            runs.append(run);
+        }
+    }
+}
+
+Cell TileLayer::unpack(const PackedCell &packed) const
+{
+    Cell cell;
+    if (!packed.isEmpty()) {
+        cell.tile = mTilesets.at(packed.tilesetIndex())->tileAt(packed.tileId());
+        cell.flippedHorizontally = packed.flippedHorizontally();
+        cell.flippedVertically = packed.flippedVertically();
+        cell.flippedAntiDiagonally = packed.flippedAntiDiagonally();
+    }
+    return cell;
+}
+
+/**
+ * Packs the given \a cell, adding its tileset to the tileset table of this
+ * layer when necessary.
+ */
+PackedCell TileLayer::pack(const Cell &cell)
+{
+    if (!cell.tile)
+        return PackedCell();
+
+    if (quint32(cell.tile->id()) > PackedCell::TileIdMask) {
+        qWarning() << "Tile ID too large for tile layer" << mName;
+        return PackedCell();
+    }
+
+    Tileset *tileset = cell.tile->tileset();
+    int index = mTilesets.indexOf(tileset);
+    if (index == -1) {
+        index = mTilesets.indexOf(0);
+        if (index == -1) {
+            if (mTilesets.size() == PackedCell::MaxTilesets) {
+                qWarning() << "Too many tilesets on tile layer" << mName;
+                return PackedCell();
+            }
+            index = mTilesets.size();
+            mTilesets.append(tileset);
+        } else {
+            mTilesets[index] = tileset;
+        }
+    }
+
+    PackedCell packed(index, cell.tile->id());
+    packed.setFlag(PackedCell::FlippedHorizontallyFlag,
+                   cell.flippedHorizontally);
+    packed.setFlag(PackedCell::FlippedVerticallyFlag,
+                   cell.flippedVertically);
+    packed.setFlag(PackedCell::FlippedAntiDiagonallyFlag,
+                   cell.flippedAntiDiagonally);
+    return packed;
+}
+
+void TileLayer::setChangeTracking(bool enabled)
+{
+    mChangeTracking = enabled;
+    if (!enabled)
+        mDirtyRegion = QRegion();
+}
+
+QRegion TileLayer::takeDirtyRegion()
+{
+    QRegion region = mDirtyRegion;
+    mDirtyRegion = QRegion();
+    return region;
+}
+
 TileLayer *TileLayer::copy(const QRegion &region) const
 {
     const QRegion area = region.intersected(QRect(0, 0, width(), height()));
@@ -121,10 +609,10 @@ void TileLayer::merge(const QPoint &pos, const TileLayer *layer)
 
     for (int y = area.top(); y <= area.bottom(); ++y) {
         for (int x = area.left(); x <= area.right(); ++x) {
-            const Cell &cell = layer->cellAt(x - area.left(),
-                                             y - area.top());
-            if (!cell.isEmpty())
-                setCell(x, y, cell);
+            const PackedCell packed = layer->packedCellAt(x - area.left(),
+                                                          y - area.top());
+            if (!packed.isEmpty())
+                setCell(x, y, layer->unpack(packed));
         }
     }
 }
@@ -139,6 +627,12 @@ void TileLayer::setCells(int x, int y, TileLayer *layer,
     if (!mask.isEmpty())
         area &= mask;
 
+    if (mSparse) {
+        foreach (const QRect &rect, area.rects())
+            setSparseCells(rect, layer, QPoint(x, y));
+        return;
+    }
+
     foreach (const QRect &rect, area.rects())
         for (int _x = rect.left(); _x <= rect.right(); ++_x)
             for (int _y = rect.top(); _y <= rect.bottom(); ++_y)
@@ -147,6 +641,13 @@ void TileLayer::setCells(int x, int y, TileLayer *layer,
 
 void TileLayer::erase(const QRegion &area)
 {
+    if (mSparse) {
+        const QRegion clipped = area & QRect(0, 0, mWidth, mHeight);
+        foreach (const QRect &rect, clipped.rects())
+            setSparseCells(rect, 0, QPoint());
+        return;
+    }
+
     const Cell emptyCell;
     foreach (const QRect &rect, area.rects())
         for (int x = rect.left(); x <= rect.right(); ++x)
@@ -156,21 +657,25 @@ void TileLayer::erase(const QRegion &area)
 
 void TileLayer::flip(FlipDirection direction)
 {
-    QVector<Cell> newGrid(mWidth * mHeight);
+    DenseScope dense(this);
+
+    QVector<PackedCell> newGrid(mWidth * mHeight);
 
     Q_ASSERT(direction == FlipHorizontally || direction == FlipVertically);
 
     for (int y = 0; y < mHeight; ++y) {
         for (int x = 0; x < mWidth; ++x) {
-            Cell &dest = newGrid[x + y * mWidth];
+            PackedCell &dest = newGrid[x + y * mWidth];
             if (direction == FlipHorizontally) {
-                const Cell &source = cellAt(mWidth - x - 1, y);
-                dest = source;
-                dest.flippedHorizontally = !source.flippedHorizontally;
+                dest = packedCellAt(mWidth - x - 1, y);
+                if (!dest.isEmpty())
+                    dest.setFlag(PackedCell::FlippedHorizontallyFlag,
+                                 !dest.flippedHorizontally());
             } else if (direction == FlipVertically) {
-                const Cell &source = cellAt(x, mHeight - y - 1);
-                dest = source;
-                dest.flippedVertically = !source.flippedVertically;
+                dest = packedCellAt(x, mHeight - y - 1);
+                if (!dest.isEmpty())
+                    dest.setFlag(PackedCell::FlippedVerticallyFlag,
+                                 !dest.flippedVertically());
             }
         }
     }
@@ -180,6 +685,8 @@ void TileLayer::flip(FlipDirection direction)
 
 void TileLayer::rotate(RotateDirection direction)
 {
+    DenseScope dense(this);
+
     static const char rotateRightMask[8] = { 5, 4, 1, 0, 7, 6, 3, 2 };
     static const char rotateLeftMask[8]  = { 3, 2, 7, 6, 1, 0, 5, 4 };
 
@@ -188,23 +695,24 @@ void TileLayer::rotate(RotateDirection direction)
 
     int newWidth = mHeight;
     int newHeight = mWidth;
-    QVector<Cell> newGrid(newWidth * newHeight);
+    QVector<PackedCell> newGrid(newWidth * newHeight);
 
     for (int y = 0; y < mHeight; ++y) {
         for (int x = 0; x < mWidth; ++x) {
-            const Cell &source = cellAt(x, y);
-            Cell dest = source;
+            PackedCell dest = packedCellAt(x, y);
+            if (dest.isEmpty())
+                continue;
 
             unsigned char mask =
-                    (dest.flippedHorizontally << 2) |
-                    (dest.flippedVertically << 1) |
-                    (dest.flippedAntiDiagonally << 0);
+                    (dest.flippedHorizontally() << 2) |
+                    (dest.flippedVertically() << 1) |
+                    (dest.flippedAntiDiagonally() << 0);
 
             mask = rotateMask[mask];
 
-            dest.flippedHorizontally = (mask & 4) != 0;
-            dest.flippedVertically = (mask & 2) != 0;
-            dest.flippedAntiDiagonally = (mask & 1) != 0;
+            dest.setFlag(PackedCell::FlippedHorizontallyFlag, mask & 4);
+            dest.setFlag(PackedCell::FlippedVerticallyFlag, mask & 2);
+            dest.setFlag(PackedCell::FlippedAntiDiagonallyFlag, mask & 1);
 
             if (direction == RotateRight)
                 newGrid[x * newWidth + (mHeight - y - 1)] = dest;
@@ -226,18 +734,31 @@ QSet<Tileset*> TileLayer::usedTilesets() const
 {
     QSet<Tileset*> tilesets;
 
-    for (int i = 0, i_end = mGrid.size(); i < i_end; ++i)
-        if (const Tile *tile = mGrid.at(i).tile)
-            tilesets.insert(tile->tileset());
+    // The tileset table may contain tilesets that are no longer used
+    QVector<bool> used(mTilesets.size());
+    int remaining = mTilesets.size();
+
+    for (int i = 0, i_end = mGrid.size(); i < i_end && remaining > 0; ++i) {
+        const PackedCell &cell = mGrid.at(i);
+        if (!cell.isEmpty() && !used.at(cell.tilesetIndex())) {
+            used[cell.tilesetIndex()] = true;
+            tilesets.insert(mTilesets.at(cell.tilesetIndex()));
+            --remaining;
+        }
+    }
 
     return tilesets;
 }
 
 bool TileLayer::referencesTileset(const Tileset *tileset) const
 {
+    const int index = mTilesets.indexOf(const_cast<Tileset*>(tileset));
+    if (index == -1)
+        return false;
+
     for (int i = 0, i_end = mGrid.size(); i < i_end; ++i) {
-        const Tile *tile = mGrid.at(i).tile;
-        if (tile && tile->tileset() == tileset)
+        const PackedCell &cell = mGrid.at(i);
+        if (!cell.isEmpty() && cell.tilesetIndex() == index)
             return true;
     }
     return false;
@@ -247,33 +768,78 @@ QRegion TileLayer::tilesetReferences(Tileset *tileset) const
 {
     QRegion region;
 
-    for (int y = 0; y < mHeight; ++y)
-        for (int x = 0; x < mWidth; ++x)
-            if (const Tile *tile = cellAt(x, y).tile)
-                if (tile->tileset() == tileset)
-                    region += QRegion(x + mX, y + mY, 1, 1);
+    const int index = mTilesets.indexOf(tileset);
+    if (index == -1)
+        return region;
+
+    for (int y = 0; y < mHeight; ++y) {
+        for (int x = 0; x < mWidth; ++x) {
+            const PackedCell cell = packedCellAt(x, y);
+            if (!cell.isEmpty() && cell.tilesetIndex() == index)
+                region += QRegion(x + mX, y + mY, 1, 1);
+        }
+    }
 
     return region;
 }
 
 void TileLayer::removeReferencesToTileset(Tileset *tileset)
 {
+    const int index = mTilesets.indexOf(tileset);
+    if (index == -1)
+        return;
+
     for (int i = 0, i_end = mGrid.size(); i < i_end; ++i) {
-        const Tile *tile = mGrid.at(i).tile;
-        if (tile && tile->tileset() == tileset)
-            mGrid.replace(i, Cell());
+        const PackedCell &cell = mGrid.at(i);
+        if (!cell.isEmpty() && cell.tilesetIndex() == index)
+            mGrid.replace(i, PackedCell());
     }
+
+    // Free the slot for reuse by another tileset
+    mTilesets[index] = 0;
 }
 
 void TileLayer::replaceReferencesToTileset(Tileset *oldTileset,
                                            Tileset *newTileset)
 {
+    const int index = mTilesets.indexOf(oldTileset);
+    if (index == -1)
+        return;
+
+    // When the new tileset is already in the table, the cells referring to
+    // the old tileset need to be moved over to its index
+    int newIndex = mTilesets.indexOf(newTileset);
+    if (newIndex == -1) {
+        mTilesets[index] = newTileset;
+        newIndex = index;
+    } else {
+        mTilesets[index] = 0;
+    }
+
+    const int tileCount = newTileset->tileCount();
+
     for (int i = 0, i_end = mGrid.size(); i < i_end; ++i) {
-        const Tile *tile = mGrid.at(i).tile;
-        if (tile && tile->tileset() == oldTileset) {
-            mGrid[i].tile = newTileset->tileAt(tile->id());
-            adjustDrawMargins(mGrid[i]);
+        PackedCell &cell = mGrid[i];
+        if (cell.isEmpty() || cell.tilesetIndex() != index)
+            continue;
+
+        if (cell.tileId() >= tileCount) {
+            cell = PackedCell();
+            continue;
         }
+
+        if (newIndex != index) {
+            PackedCell moved(newIndex, cell.tileId());
+            moved.setFlag(PackedCell::FlippedHorizontallyFlag,
+                          cell.flippedHorizontally());
+            moved.setFlag(PackedCell::FlippedVerticallyFlag,
+                          cell.flippedVertically());
+            moved.setFlag(PackedCell::FlippedAntiDiagonallyFlag,
+                          cell.flippedAntiDiagonally());
+            cell = moved;
+        }
+
+        adjustDrawMargins(unpack(cell));
     }
 }
 
@@ -282,7 +848,9 @@ void TileLayer::resize(const QSize &size, const QPoint &offset)
     if (this->size() == size && offset.isNull())
         return;
 
-    QVector<Cell> newGrid(size.width() * size.height());
+    DenseScope dense(this);
+
+    QVector<PackedCell> newGrid(size.width() * size.height());
 
     // Copy over the preserved part
     const int startX = qMax(0, -offset.x());
@@ -293,7 +861,7 @@ void TileLayer::resize(const QSize &size, const QPoint &offset)
     for (int y = startY; y < endY; ++y) {
         for (int x = startX; x < endX; ++x) {
             const int index = x + offset.x() + (y + offset.y()) * size.width();
-            newGrid[index] = cellAt(x, y);
+            newGrid[index] = packedCellAt(x, y);
         }
     }
 
@@ -305,13 +873,15 @@ void TileLayer::offset(const QPoint &offset,
                        const QRect &bounds,
                        bool wrapX, bool wrapY)
 {
-    QVector<Cell> newGrid(mWidth * mHeight);
+    DenseScope dense(this);
+
+    QVector<PackedCell> newGrid(mWidth * mHeight);
 
     for (int y = 0; y < mHeight; ++y) {
         for (int x = 0; x < mWidth; ++x) {
             // Skip out of bounds tiles
             if (!bounds.contains(x, y)) {
-                newGrid[x + y * mWidth] = cellAt(x, y);
+                newGrid[x + y * mWidth] = packedCellAt(x, y);
                 continue;
             }
 
@@ -337,9 +907,9 @@ void TileLayer::offset(const QPoint &offset,
 
             // Set the new tile
             if (contains(oldX, oldY) && bounds.contains(oldX, oldY))
-                newGrid[x + y * mWidth] = cellAt(oldX, oldY);
+                newGrid[x + y * mWidth] = packedCellAt(oldX, oldY);
             else
-                newGrid[x + y * mWidth] = Cell();
+                newGrid[x + y * mWidth] = PackedCell();
         }
     }
 
@@ -414,6 +984,10 @@ TileLayer *TileLayer::initializeClone(TileLayer *clone) const
 {
     Layer::initializeClone(clone);
     clone->mGrid = mGrid;
+    clone->mTilesets = mTilesets;
+    clone->mSparse = mSparse;
+    clone->mChunkRuns = mChunkRuns;
+    clone->mRuns = mRuns;
     clone->mMaxTileSize = mMaxTileSize;
     clone->mOffsetMargins = mOffsetMargins;
     return clone;
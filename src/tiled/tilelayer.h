@@ -36,6 +36,7 @@
 #include "tiled.h"
 
 #include <QMargins>
+#include <QRegion>
 #include <QString>
 #include <QVector>
 
@@ -88,20 +89,135 @@ public:
     bool flippedAntiDiagonally;
 };
 
+/**
+ * A cell packed into 32 bits, which is how a TileLayer stores its cells. The
+ * highest bits hold the flip flags, followed by the index of the tileset in
+ * the tileset table of the layer and the ID of the tile. An empty cell is 0.
+ *
+ * Unlike with a Cell, looking at a packed cell does not involve its Tile, so
+ * loops over many cells stay cache-friendly. A layer supports up to 511
+ * different tilesets with up to 2^20 tiles each.
+ */
+class PackedCell
+{
+public:
+    static const quint32 FlippedHorizontallyFlag   = 0x80000000;
+    static const quint32 FlippedVerticallyFlag     = 0x40000000;
+    static const quint32 FlippedAntiDiagonallyFlag = 0x20000000;
+    static const quint32 TilesetMask = 0x1ff00000;
+    static const quint32 TileIdMask  = 0x000fffff;
+    static const int TilesetShift = 20;
+    static const int MaxTilesets = 511;
+
+    PackedCell() : mValue(0) {}
+
+    PackedCell(int tilesetIndex, int tileId) :
+        mValue(quint32(tilesetIndex + 1) << TilesetShift | quint32(tileId))
+    {}
+
+    bool isEmpty() const { return mValue == 0; }
+
+    /**
+     * Returns the index of the tileset in the tileset table of the layer.
+     * Only valid for non-empty cells.
+     */
+    int tilesetIndex() const
+    { return int((mValue & TilesetMask) >> TilesetShift) - 1; }
+
+    int tileId() const { return int(mValue & TileIdMask); }
+
+    bool flippedHorizontally() const
+    { return mValue & FlippedHorizontallyFlag; }
+    bool flippedVertically() const
+    { return mValue & FlippedVerticallyFlag; }
+    bool flippedAntiDiagonally() const
+    { return mValue & FlippedAntiDiagonallyFlag; }
+
+    void setFlag(quint32 flag, bool enabled)
+    { mValue = enabled ? (mValue | flag) : (mValue & ~flag); }
+
+    bool operator == (const PackedCell &other) const
+    { return mValue == other.mValue; }
+    bool operator != (const PackedCell &other) const
+    { return mValue != other.mValue; }
+
+private:
+    quint32 mValue;
+};
+
+} // namespace Tiled
+
+Q_DECLARE_TYPEINFO(Tiled::PackedCell, Q_PRIMITIVE_TYPE);
+
+namespace Tiled {
+
 /**
  * A tile layer is a grid of cells. Each cell refers to a specific tile, and
  * stores how the tile is flipped.
  *
  * Coordinates and regions passed to function parameters are in local
  * coordinates and do not take into account the position of the layer.
+ *
+ * The cells are stored in a dense grid by default. Layers that are mostly
+ * empty can be switched to a sparse storage, which divides the layer into
+ * chunks of 16x16 cells. Empty chunks take no space besides an offset, and
+ * the rows within a chunk are stored as runs of non-empty cells.
  */
 class TILEDSHARED_EXPORT TileLayer : public Layer
 {
 public:
     /**
-     * Constructor.
+     * Iterates over the non-empty cells of a tile layer within a rectangle,
+     * row by row. For sparse layers, the empty chunks and the gaps between
+     * the runs are skipped without looking at them.
+     *
+     * The layer may not be changed while it is being iterated.
+     */
+    class TILEDSHARED_EXPORT CellIterator
+    {
+    public:
+        CellIterator(const TileLayer *layer, const QRect &rect);
+
+        /**
+         * Moves to the next non-empty cell. Returns false when there are no
+         * more cells.
+         */
+        bool next();
+
+        int x() const { return mX; }
+        int y() const { return mY; }
+        PackedCell cell() const { return mCell; }
+
+    private:
+        bool nextRun();
+
+        const TileLayer *mLayer;
+        QRect mRect;
+        int mX;
+        int mY;
+        PackedCell mCell;
+
+        // Only used for sparse layers
+        QVector<int> mCursors;
+        int mChunkColumn;
+        int mRunEnd;
+        int mCellBase;
+    };
+
+    /**
+     * The ways in which the cells of a tile layer can be stored.
+     */
+    enum Storage {
+        DenseStorage,
+        SparseStorage
+    };
+
+    /**
+     * Constructor. A layer created with sparse storage does not allocate the
+     * dense grid of cells at all.
      */
-    TileLayer(const QString &name, int x, int y, int width, int height);
+    TileLayer(const QString &name, int x, int y, int width, int height,
+              Storage storage = DenseStorage);
 
     /**
      * Returns the maximum tile size of this layer.
@@ -138,20 +254,72 @@ public:
     QRegion region() const;
 
     /**
-     * Returns a read-only reference to the cell at the given coordinates. The
-     * coordinates have to be within this layer.
+     * Returns the cell at the given coordinates. The coordinates have to be
+     * within this layer.
      */
-    const Cell &cellAt(int x, int y) const
-    { return mGrid.at(x + y * mWidth); }
+    Cell cellAt(int x, int y) const
+    { return unpack(packedCellAt(x, y)); }
 
-    const Cell &cellAt(const QPoint &point) const
+    Cell cellAt(const QPoint &point) const
     { return cellAt(point.x(), point.y()); }
 
+    /**
+     * Returns the packed cell at the given coordinates. Use tilesetAt() to
+     * look up its tileset, preferably only when the tileset index changes.
+     */
+    PackedCell packedCellAt(int x, int y) const
+    { return mSparse ? sparseCellAt(x, y) : mGrid.at(x + y * mWidth); }
+
+    PackedCell packedCellAt(const QPoint &point) const
+    { return packedCellAt(point.x(), point.y()); }
+
+    /**
+     * Returns the tileset at the given \a index in the tileset table of this
+     * layer, as referred to by packed cells.
+     */
+    Tileset *tilesetAt(int index) const { return mTilesets.at(index); }
+
+    /**
+     * Returns the cell corresponding to the given packed cell of this layer.
+     */
+    Cell unpack(const PackedCell &packed) const;
+
     /**
      * Sets the cell at the given coordinates.
      */
     void setCell(int x, int y, const Cell &cell);
 
+    /**
+     * Sets whether the cells of this layer are stored sparsely. This is
+     * meant for layers that are mostly empty, since changing a sparse layer
+     * is slower and accessing a single cell involves looking for its run.
+     */
+    void setSparse(bool sparse);
+    bool isSparse() const { return mSparse; }
+
+    /**
+     * Returns the number of bytes allocated to store the cells of this
+     * layer.
+     */
+    qint64 cellMemoryUsage() const;
+
+    /**
+     * Sets whether changes made to the cells of this layer are recorded in
+     * the dirty region. Tracking is off by default, to avoid recording every
+     * cell while the layer is being loaded.
+     */
+    void setChangeTracking(bool enabled);
+    bool isChangeTracking() const { return mChangeTracking; }
+
+    /**
+     * Returns the region of cells that were changed by setCell() since the
+     * last call to this function, and clears it.
+     *
+     * Changes to the size or layout of the layer, like resize() or rotate(),
+     * are not recorded.
+     */
+    QRegion takeDirtyRegion();
+
     /**
      * Returns a copy of the area specified by the given \a region. The
      * caller is responsible for the returned tile layer.
@@ -262,11 +430,46 @@ protected:
     TileLayer *initializeClone(TileLayer *clone) const;
 
 private:
+    /**
+     * A run of cells within a row of a chunk. The cells of the run are
+     * stored consecutively in the grid, starting at \a cell.
+     */
+    struct SparseRun
+    {
+        quint8 x;
+        quint8 y;
+        quint8 length;
+        int cell;
+    };
+
     void adjustDrawMargins(const Cell &cell);
+    PackedCell pack(const Cell &cell);
+
+    int chunkColumns() const;
+    PackedCell sparseCellAt(int x, int y) const;
+    void setSparseCell(int x, int y, const PackedCell &cell);
+    void setSparseCells(const QRect &area, const TileLayer *source,
+                        const QPoint &sourcePos);
+    static void appendRuns(const PackedCell *cells, int stride,
+                           int width, int height,
+                           QVector<SparseRun> &runs,
+                           QVector<PackedCell> &runCells);
 
     QSize mMaxTileSize;
     QMargins mOffsetMargins;
-    QVector<Cell> mGrid;
+
+    /**
+     * The cells of this layer. For sparse layers, these are the cells of all
+     * runs, ordered by chunk.
+     */
+    QVector<PackedCell> mGrid;
+    QVector<Tileset*> mTilesets;
+
+    bool mSparse;
+    QVector<int> mChunkRuns;        // Index of the first run of each chunk
+    QVector<SparseRun> mRuns;
+    QRegion mDirtyRegion;
+    bool mChangeTracking;
 };
 
 } // namespace Tiled